@@ -18,6 +18,7 @@
 #include <pybind11/pytypes.h>
 #include <pybind11/stl.h>
 
+#include <algorithm>
 #include <complex>
 #include <iostream>
 #include <vector>
@@ -27,6 +28,7 @@
 #include <boost/container/vector.hpp>
 
 #include "simulator-mpi/SimulatorMPI.hpp"
+#include "simulator-mpi/arithmetic.hpp"
 
 namespace pybind11
 {
@@ -58,26 +60,185 @@ void emulate_math_wrapper(SimulatorMPI& sim, py::function const& pyfunc,
      sim.emulate_math(f, qr, ctrls);
 }
 
+template <class F, class QR>
+void emulate_native_math(SimulatorMPI& sim, F const& f, QR const& qr,
+                         Fusion::IndexVector const& ctrls)
+{
+#ifdef _OPENMP
+     sim.emulate_math(f, qr, ctrls, omp_get_max_threads());
+#else
+     sim.emulate_math(f, qr, ctrls);
+#endif
+}
+
+template <class QR>
+void emulate_add_constant(SimulatorMPI& sim, int a, QR const& qr,
+                          Fusion::IndexVector const& ctrls)
+{
+     emulate_native_math(sim, arithmetic::AddConstant{a}, qr, ctrls);
+}
+
+template <class QR>
+void emulate_add_constant_mod_n(SimulatorMPI& sim, int a, int N, QR const& qr,
+                                Fusion::IndexVector const& ctrls)
+{
+     emulate_native_math(sim, arithmetic::AddConstantModN{a, N}, qr, ctrls);
+}
+
+template <class QR>
+void emulate_multiply_by_constant_mod_n(SimulatorMPI& sim, int a, int N,
+                                        QR const& qr,
+                                        Fusion::IndexVector const& ctrls)
+{
+     emulate_native_math(sim, arithmetic::MultiplyByConstantModN{a, N}, qr,
+                         ctrls);
+}
+
+py::array_t<c_type> get_amplitudes(
+    SimulatorMPI const& sim, std::vector<std::vector<bool>> const& bit_strings,
+    std::vector<SimulatorMPI::Index> const& ids)
+{
+     auto amplitudes = sim.GetAmplitudes(bit_strings, ids);
+     return py::array_t<c_type>(amplitudes.size(), amplitudes.data());
+}
+
+// The local part of the state vector as a numpy array viewing vec_, which
+// keeps the simulator alive. The other calls write the state back into the
+// same memory, so the view is valid until the next qubit allocation or
+// deallocation (measure_and_deallocate included), which changes its size.
+py::tuple cheat_local(py::object self)
+{
+     auto res = self.cast<SimulatorMPI&>().cheat_local();
+     auto& vec = std::get<1>(res);
+     return py::make_tuple(std::get<0>(res),
+                           py::array_t<c_type>(vec.size(), vec.data(), self));
+}
+
+py::array_t<c_type> gather_state_vector(SimulatorMPI& sim, int root)
+{
+     auto vec = new SimulatorMPI::StateVector(sim.GatherStateVector(root));
+     py::capsule owner(vec, [](void* p) {
+          delete reinterpret_cast<SimulatorMPI::StateVector*>(p);
+     });
+     return py::array_t<c_type>(vec->size(), vec->data(), owner);
+}
+
+// Each process only reads its slice of the wavefunction, which may thus be a
+// memory-mapped file. A C-contiguous complex128 array is read in place; any
+// other array (or sequence) only has the slice of this process converted.
+void set_wavefunction(SimulatorMPI& sim, py::object const& wavefunction,
+                      std::vector<SimulatorMPI::Index> const& ids)
+{
+     using c_array = py::array_t<c_type, py::array::c_style>;
+     using cast_array = py::array_t<c_type, py::array::c_style
+                                                | py::array::forcecast>;
+     if (py::isinstance<c_array>(wavefunction)) {
+          auto array = wavefunction.cast<c_array>();
+          sim.SetWavefunction(array.data(), array.size(), ids);
+          return;
+     }
+
+     auto array = py::array::ensure(wavefunction);
+     if (!array) {
+          throw py::error_already_set();
+     }
+     if (array.ndim() != 1) {
+          array = py::array::ensure(array.attr("reshape")(-1));
+     }
+     auto convert = [&array](size_t begin, size_t end) {
+          py::object item = array[py::slice(begin, end, 1)];
+          auto slice = cast_array::ensure(item);
+          if (!slice) {
+               throw py::error_already_set();
+          }
+          return slice;
+     };
+     // a dtype which can't be converted fails on every process, before the
+     // collective calls of SetWavefunction()
+     convert(0, 0);
+     sim.SetWavefunction(
+         array.size(), ids,
+         [&convert](size_t begin, c_type* dst, size_t count) {
+              auto slice = convert(begin, begin + count);
+              std::copy(slice.data(), slice.data() + count, dst);
+         });
+}
+
 PYBIND11_MODULE(_cppsim_mpi, m)
 {
+     py::class_<SimulatorMPI::Reduction>(m, "Reduction")
+         .def(py::init<>())
+         .def("add_norm", &SimulatorMPI::Reduction::AddNorm)
+         .def("add_entropy", &SimulatorMPI::Reduction::AddEntropy)
+         .def("add_probability", &SimulatorMPI::Reduction::AddProbability)
+         .def("add_qubit_probabilities",
+              &SimulatorMPI::Reduction::AddQubitProbabilities)
+         .def("size", &SimulatorMPI::Reduction::size);
+
+     py::class_<ExecutionPlan>(m, "ExecutionPlan")
+         .def(py::init<>())
+         .def("add_arrange", &ExecutionPlan::AddArrange)
+         .def("add_swap", &ExecutionPlan::AddSwap)
+         .def("add_gate", &ExecutionPlan::AddGate)
+         .def("add_parametric_gate", &ExecutionPlan::AddParametricGate)
+         .def("end_cluster", &ExecutionPlan::EndCluster)
+         .def_property_readonly("parameters", &ExecutionPlan::parameters);
+
      py::class_<SimulatorMPI>(m, "SimulatorMPI")
          .def(py::init<uint64_t, int, int>())
+         .def(py::init<uint64_t, int, int, size_t>())
+         .def(py::init<uint64_t, int, int, size_t, std::string>())
          .def("get_qubits_ids", &SimulatorMPI::GetQubitsPermutation)
          .def("get_local_qubits_ids", &SimulatorMPI::GetLocalQubitsPermutation)
          .def("get_global_qubits_ids",
               &SimulatorMPI::GetGlobalQubitsPermutation)
+         .def("get_global_qubits_swap_cost",
+              &SimulatorMPI::GetGlobalQubitsSwapCost)
+         .def("get_rank", &SimulatorMPI::GetRank)
          .def("set_qubits_perm", &SimulatorMPI::SetQubitsPermutation)
          .def("swap_qubits", &SimulatorMPI::SwapQubitsWrapper)
+         .def("start_swap_qubits", &SimulatorMPI::StartSwapQubits)
+         .def("wait_swap_qubits", &SimulatorMPI::WaitSwapQubits)
+         .def("get_overlapped_clusters",
+              &SimulatorMPI::OverlappedClustersCount)
          .def("allocate_qureg", &SimulatorMPI::AllocateQureg)
          .def("allocate_qubit", &SimulatorMPI::AllocateQubit)
          .def("deallocate_qubit", &SimulatorMPI::DeallocateQubit)
          .def("measure_qubits", &SimulatorMPI::MeasureQubits)
+         .def("measure_and_deallocate", &SimulatorMPI::MeasureAndDeallocate)
+         .def("sample", &SimulatorMPI::Sample)
          .def("apply_controlled_gate", &SimulatorMPI::ApplyGate)
          .def("emulate_math", &emulate_math_wrapper<QuRegs>)
+         .def("emulate_math_add_constant", &emulate_add_constant<QuRegs>)
+         .def("emulate_math_add_constant_mod_n",
+              &emulate_add_constant_mod_n<QuRegs>)
+         .def("emulate_math_multiply_by_constant_mod_n",
+              &emulate_multiply_by_constant_mod_n<QuRegs>)
          .def("get_amplitude", &SimulatorMPI::GetAmplitude)
+         .def("get_amplitudes", &get_amplitudes)
          .def("get_probability", &SimulatorMPI::GetProbability)
+         .def("get_probabilities", &SimulatorMPI::GetProbabilities)
+         .def("get_expectation_value", &SimulatorMPI::GetExpectationValue)
+         .def("apply_qubit_operator", &SimulatorMPI::ApplyQubitOperator)
+         .def("emulate_time_evolution", &SimulatorMPI::EmulateTimeEvolution)
+         .def("get_marginal_distribution",
+              &SimulatorMPI::GetMarginalDistribution)
          .def("run", &SimulatorMPI::Run)
          .def("entropy", &SimulatorMPI::Entropy)
-         .def("cheat_local", &SimulatorMPI::cheat_local)
-         .def("collapse_wavefunction", &SimulatorMPI::collapseWaveFunction);
+         .def("reduce", &SimulatorMPI::Reduce)
+         .def("cheat_local", &cheat_local)
+         .def("gather_state_vector", &gather_state_vector)
+         .def("collapse_wavefunction", &SimulatorMPI::collapseWaveFunction)
+         .def("set_wavefunction", &set_wavefunction)
+         .def("set_wavefunction_from_file",
+              &SimulatorMPI::SetWavefunctionFromFile)
+         .def("set_basis_state", &SimulatorMPI::SetBasisState)
+         .def("set_uniform_superposition",
+              &SimulatorMPI::SetUniformSuperposition)
+         .def("set_product_state", &SimulatorMPI::SetProductState)
+         .def("save_checkpoint", &SimulatorMPI::SaveCheckpoint)
+         .def("load_checkpoint", &SimulatorMPI::LoadCheckpoint)
+         .def("start_trace", &SimulatorMPI::StartTrace)
+         .def("stop_trace", &SimulatorMPI::StopTrace)
+         .def("run_plan", &SimulatorMPI::RunPlan);
 }
@@ -18,9 +18,12 @@
 #include <pybind11/pytypes.h>
 #include <pybind11/stl.h>
 
+#include <stdexcept>
+
 #include "scheduler/cluster_scheduler.h"
 #include "scheduler/convertors.h"
 #include "scheduler/definitions.h"
+#include "scheduler/greedy_scheduler.h"
 #include "scheduler/swap_scheduler.h"
 
 namespace py = pybind11;
@@ -31,10 +34,48 @@ PYBIND11_MODULE(_sched_cpp, m)
          .def(py::init<std::vector<std::vector<id_num_t>>,
                        std::vector<std::vector<id_num_t>>, std::vector<bool>,
                        int, int, bool>())
+         .def(py::init<std::vector<std::vector<id_num_t>>,
+                       std::vector<std::vector<id_num_t>>, std::vector<bool>,
+                       int, int, bool, std::map<id_num_t, double>>())
          .def("ScheduleSwap", &SwapScheduler::ScheduleSwap);
      py::class_<ClusterScheduler>(m, "ClusterScheduler")
          .def(py::init<std::vector<std::vector<id_num_t>>,
                        std::vector<std::vector<id_num_t>>, std::vector<bool>,
                        std::vector<id_num_t>, std::vector<id_num_t>, int>())
          .def("ScheduleCluster", &ClusterScheduler::ScheduleCluster);
+
+     py::class_<GreedyScheduler> greedy(m, "GreedyScheduler");
+     py::enum_<GreedyScheduler::StepType>(greedy, "StepType")
+         .value("kPermute", GreedyScheduler::kPermute)
+         .value("kSwap", GreedyScheduler::kSwap)
+         .value("kCluster", GreedyScheduler::kCluster)
+         .export_values();
+     py::class_<GreedyScheduler::Step>(greedy, "Step")
+         .def_readonly("type", &GreedyScheduler::Step::type)
+         .def_readonly("data", &GreedyScheduler::Step::data);
+     greedy.def(py::init<int, int>())
+         .def("AddGate", &GreedyScheduler::AddGate)
+         // all gates are converted at once rather than with a call per gate
+         .def("AddGates",
+              [](GreedyScheduler& scheduler,
+                 std::vector<std::vector<id_num_t>> ids,
+                 std::vector<std::vector<id_num_t>> ctrl,
+                 const std::vector<bool>& diag,
+                 const std::vector<bool>& symmetric) {
+                   // raised as a ValueError by pybind11
+                   if (ctrl.size() != ids.size() || diag.size() != ids.size()
+                       || symmetric.size() != ids.size()) {
+                        throw std::invalid_argument(
+                            "AddGates(): ids, ctrl, diag and symmetric must "
+                            "have the same length");
+                   }
+                   for (size_t i = 0; i < ids.size(); ++i) {
+                        scheduler.AddGate(std::move(ids[i]),
+                                          std::move(ctrl[i]), diag[i],
+                                          symmetric[i]);
+                   }
+              })
+         .def("Schedule", &GreedyScheduler::Schedule)
+         .def("GateIds", &GreedyScheduler::GateIds)
+         .def("GateCtrl", &GreedyScheduler::GateCtrl);
 }
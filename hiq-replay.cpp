@@ -0,0 +1,234 @@
+//   Copyright 2019 <Huawei Technologies Co., Ltd>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Replays a trace recorded by SimulatorMPI::StartTrace() (e.g. with
+// SimulatorMPI(trace=...) in Python) on the same number of processes, and
+// reports the time spent in every kind of call:
+//
+//     mpirun -np 4 hiq-replay run.trace
+
+#include <boost/format.hpp>
+#include <boost/mpi.hpp>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+
+#include "simulator-mpi/SimulatorMPI.hpp"
+#include "simulator-mpi/Trace.hpp"
+
+#include <glog/logging.h>
+
+namespace po = boost::program_options;
+
+using Index = SimulatorMPI::Index;
+using IndexVector = std::vector<Index>;
+using Clock = SimulatorMPI::Clock;
+using Duration = SimulatorMPI::Duration;
+
+static const char* OpName(TraceOp op)
+{
+     switch (op) {
+          case TraceOp::kAllocateQubit:
+               return "AllocateQubit";
+          case TraceOp::kAllocateQureg:
+               return "AllocateQureg";
+          case TraceOp::kDeallocateQubit:
+               return "DeallocateQubit";
+          case TraceOp::kApplyGate:
+               return "ApplyGate";
+          case TraceOp::kRun:
+               return "Run";
+          case TraceOp::kSwapQubits:
+               return "SwapQubits";
+          case TraceOp::kStartSwapQubits:
+               return "StartSwapQubits";
+          case TraceOp::kWaitSwapQubits:
+               return "WaitSwapQubits";
+          case TraceOp::kMeasureQubits:
+               return "MeasureQubits";
+          case TraceOp::kMeasureAndDeallocate:
+               return "MeasureAndDeallocate";
+          case TraceOp::kCollapseWavefunction:
+               return "collapseWaveFunction";
+          case TraceOp::kSetQubitsPermutation:
+               return "SetQubitsPermutation";
+          case TraceOp::kUnsupported:
+               return "(not replayed)";
+          default:
+               return "(end)";
+     }
+}
+
+int main(int argc, const char** argv)
+{
+     std::string path;
+     uint64_t max_local = 0;
+     uint64_t max_cluster_size = 0;
+     uint64_t max_memory = 0;
+     std::string out_of_core_dir;
+
+     po::options_description desc("Options");
+     desc.add_options()("help", "produce help message")(
+         "trace", po::value<std::string>(&path), "trace file")(
+         "max-local", po::value<uint64_t>(&max_local),
+         "maximum number of local qubits (default: as recorded)")(
+         "max-cluster-size", po::value<uint64_t>(&max_cluster_size),
+         "maximum number of qubits in fused gates (default: as recorded)")(
+         "max-memory", po::value<uint64_t>(&max_memory),
+         "maximum size in bytes of the local state vector (default: as "
+         "recorded)")(
+         "out-of-core-dir", po::value<std::string>(&out_of_core_dir),
+         "directory of the out-of-core state vector");
+     po::positional_options_description positional;
+     positional.add("trace", 1);
+
+     po::variables_map vm;
+     po::store(po::command_line_parser(argc, argv)
+                   .options(desc)
+                   .positional(positional)
+                   .run(),
+               vm);
+     po::notify(vm);
+
+     if (vm.count("help") || path.empty()) {
+          std::cout << "Usage: hiq-replay [options] trace\n" << desc << "\n";
+          return vm.count("help") ? 0 : 1;
+     }
+
+     TraceReader trace(path);
+     auto& header = trace.header();
+     SimulatorMPI sim(mpi::communicator(), 0,
+                      max_local ? max_local : header.max_local,
+                      max_cluster_size ? max_cluster_size
+                                       : header.max_cluster_size,
+                      vm.count("max-memory") ? max_memory : header.max_memory,
+                      out_of_core_dir);
+     sim.SetRandomState(trace.rng_state());
+
+     // the recorded swaps and gates refer to the global qubits of the
+     // recording run
+     if (static_cast<uint64_t>(sim.world_.size()) != header.world_size) {
+          LOG(ERROR) << boost::format("hiq-replay: %s must be replayed on %d "
+                                      "processes")
+                            % path % header.world_size;
+          return 1;
+     }
+
+     std::map<TraceOp, std::pair<uint64_t, double>> stats;
+     std::map<std::string, uint64_t> skipped;
+     uint64_t mismatches = 0;
+     auto start_time = Clock::now();
+
+     for (auto op = trace.NextOp(); op != TraceOp::kEnd; op = trace.NextOp()) {
+          auto start_op_time = Clock::now();
+          switch (op) {
+               case TraceOp::kAllocateQubit:
+                    sim.AllocateQubit(trace.Get<Index>());
+                    break;
+               case TraceOp::kAllocateQureg: {
+                    auto ids = trace.GetVector<IndexVector>();
+                    auto init = trace.Get<SimulatorMPI::Complex>();
+                    sim.AllocateQureg(ids, init);
+                    break;
+               }
+               case TraceOp::kDeallocateQubit:
+                    sim.DeallocateQubit(trace.Get<Index>());
+                    break;
+               case TraceOp::kApplyGate: {
+                    auto m = trace.GetMatrix<SimulatorMPI::Matrix>();
+                    auto ids = trace.GetVector<IndexVector>();
+                    auto ctrl = trace.GetVector<IndexVector>();
+                    sim.ApplyGate(m, ids, ctrl);
+                    break;
+               }
+               case TraceOp::kRun:
+                    sim.Run();
+                    break;
+               case TraceOp::kSwapQubits:
+                    sim.SwapQubitsWrapper(trace.GetVector<IndexVector>());
+                    break;
+               case TraceOp::kStartSwapQubits:
+                    sim.StartSwapQubits(trace.GetVector<IndexVector>());
+                    break;
+               case TraceOp::kWaitSwapQubits:
+                    sim.WaitSwapQubits();
+                    break;
+               case TraceOp::kMeasureQubits:
+               case TraceOp::kMeasureAndDeallocate: {
+                    auto ids = trace.GetVector<IndexVector>();
+                    auto recorded = trace.GetBools();
+                    auto res = op == TraceOp::kMeasureQubits
+                                   ? sim.MeasureQubits(ids)
+                                   : sim.MeasureAndDeallocate(ids);
+                    mismatches += res != recorded;
+                    break;
+               }
+               case TraceOp::kCollapseWavefunction: {
+                    auto ids = trace.GetVector<IndexVector>();
+                    sim.collapseWaveFunction(ids, trace.GetBools());
+                    break;
+               }
+               case TraceOp::kSetQubitsPermutation:
+                    sim.SetQubitsPermutation(trace.GetVector<IndexVector>());
+                    break;
+               case TraceOp::kUnsupported:
+                    ++skipped[trace.GetString()];
+                    break;
+               default:
+                    LOG(ERROR) << "hiq-replay: unknown record in " << path;
+                    return 1;
+          }
+          auto& s = stats[op];
+          s.first += 1;
+          s.second += Duration(Clock::now() - start_op_time).count();
+     }
+     sim.WaitSwapQubits();
+     auto total = Duration(Clock::now() - start_time).count();
+
+     // the slowest process sets the pace
+     std::vector<double> times;
+     for (auto& s: stats) {
+          times.push_back(s.second.second);
+     }
+     times.push_back(total);
+     std::vector<double> max_times(times.size());
+     mpi::reduce(sim.world_, times.data(), static_cast<int>(times.size()),
+                 max_times.data(), mpi::maximum<double>(), 0);
+
+     if (sim.world_.rank() == 0) {
+          std::cout << boost::format("Replayed %s on %d processes (recorded "
+                                     "on %d)\n")
+                           % path % sim.world_.size() % header.world_size;
+          size_t i = 0;
+          for (auto& s: stats) {
+               std::cout << boost::format("  %-22s %10u calls %12.3lf s\n")
+                                % OpName(s.first) % s.second.first
+                                % max_times[i++];
+          }
+          std::cout << boost::format("  %-22s %29.3lf s\n") % "Total"
+                           % max_times.back();
+          for (auto& s: skipped) {
+               std::cout << boost::format("  not replayed: %s (%u calls)\n")
+                                % s.first % s.second;
+          }
+          if (mismatches) {
+               std::cout << boost::format("  %u measurements differ from the "
+                                          "recorded outcomes\n")
+                                % mismatches;
+          }
+     }
+}
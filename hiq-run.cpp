@@ -0,0 +1,808 @@
+//   Copyright 2019 <Huawei Technologies Co., Ltd>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+// Runs an OpenQASM 2 circuit on SimulatorMPI without Python: the gates are
+// scheduled into stages and clusters by the same greedy algorithm as the
+// GreedyScheduler engine, and the measurement outcomes are written as
+// "bits count" lines (the classical registers in the OpenQASM order, i.e.
+// the last register and its highest bit first):
+//
+//     mpirun -np 4 hiq-run --shots 1000 circuit.qasm
+//
+// The subset of OpenQASM 2 which is supported is the one of the circuits
+// which don't define gates: qreg, creg, the gates of qelib1.inc (and U, CX),
+// barrier and measure. With more than one shot, all measurements have to be
+// at the end of the circuit, which is then simulated once and sampled.
+// --trace records the calls to the simulator, which hiq-replay replays.
+
+#include <boost/format.hpp>
+#include <boost/mpi.hpp>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "scheduler/greedy_scheduler.h"
+#include "simulator-mpi/SimulatorMPI.hpp"
+
+#include <glog/logging.h>
+
+namespace po = boost::program_options;
+
+using Index = SimulatorMPI::Index;
+using IndexVector = std::vector<Index>;
+using Complex = SimulatorMPI::Complex;
+using Matrix = SimulatorMPI::Matrix;
+using Clock = SimulatorMPI::Clock;
+using Duration = SimulatorMPI::Duration;
+
+struct Gate
+{
+     Matrix m;
+     IndexVector ids;
+     IndexVector ctrl;
+};
+
+struct Register
+{
+     std::string name;
+     Index offset;
+     Index size;
+};
+
+// Gates, followed by the measurements of qubits into classical bits
+struct Segment
+{
+     std::vector<Gate> gates;
+     std::vector<std::pair<Index, Index>> measures;
+};
+
+struct Circuit
+{
+     std::vector<Register> qregs;
+     std::vector<Register> cregs;
+     Index num_qubits = 0;
+     Index num_clbits = 0;
+     std::vector<Segment> segments;
+};
+
+// =============================================================================
+
+static const double kPi = 3.141592653589793238462643383279502884;
+
+static Matrix Diagonal(const std::vector<Complex>& d)
+{
+     Matrix m(d.size());
+     for (size_t i = 0; i < d.size(); ++i) {
+          m[i].resize(d.size());
+          m[i][i] = d[i];
+     }
+     return m;
+}
+
+static Matrix U3(double theta, double phi, double lambda)
+{
+     auto c = std::cos(theta / 2);
+     auto s = std::sin(theta / 2);
+     return {{c, -std::polar(s, lambda)},
+             {std::polar(s, phi), std::polar(c, phi + lambda)}};
+}
+
+static Matrix Phase(double lambda)
+{
+     return Diagonal({1., std::polar(1., lambda)});
+}
+
+static Matrix RZ(double theta)
+{
+     return Diagonal({std::polar(1., -theta / 2), std::polar(1., theta / 2)});
+}
+
+static Matrix RZZ(double theta)
+{
+     auto a = std::polar(1., -theta / 2);
+     auto b = std::polar(1., theta / 2);
+     return Diagonal({a, b, b, a});
+}
+
+static Matrix X()
+{
+     return {{0., 1.}, {1., 0.}};
+}
+
+static Matrix Y()
+{
+     return {{0., Complex(0., -1.)}, {Complex(0., 1.), 0.}};
+}
+
+static Matrix H()
+{
+     auto h = 1. / std::sqrt(2.);
+     return {{h, h}, {h, -h}};
+}
+
+static Matrix SX(double sign)
+{
+     Complex a(.5, sign * .5), b(.5, -sign * .5);
+     return {{a, b}, {b, a}};
+}
+
+static Matrix Swap()
+{
+     return {{1., 0., 0., 0.},
+             {0., 0., 1., 0.},
+             {0., 1., 0., 0.},
+             {0., 0., 0., 1.}};
+}
+
+struct GateDef
+{
+     size_t num_params;
+     size_t num_ctrl;
+     size_t num_targets;
+     std::function<Matrix(const std::vector<double>&)> matrix;
+};
+
+// Gates of qelib1.inc, applied as a matrix on the targets with the controls
+static const std::map<std::string, GateDef>& GateDefs()
+{
+     using P = const std::vector<double>&;
+     static const Complex i(0., 1.);
+     static const std::map<std::string, GateDef> defs = {
+         {"U", {3, 0, 1, [](P p) { return U3(p[0], p[1], p[2]); }}},
+         {"u3", {3, 0, 1, [](P p) { return U3(p[0], p[1], p[2]); }}},
+         {"u", {3, 0, 1, [](P p) { return U3(p[0], p[1], p[2]); }}},
+         {"u2", {2, 0, 1, [](P p) { return U3(kPi / 2, p[0], p[1]); }}},
+         {"u1", {1, 0, 1, [](P p) { return Phase(p[0]); }}},
+         {"p", {1, 0, 1, [](P p) { return Phase(p[0]); }}},
+         {"id", {0, 0, 1, [](P) { return Phase(0.); }}},
+         {"x", {0, 0, 1, [](P) { return X(); }}},
+         {"y", {0, 0, 1, [](P) { return Y(); }}},
+         {"z", {0, 0, 1, [](P) { return Phase(kPi); }}},
+         {"h", {0, 0, 1, [](P) { return H(); }}},
+         {"s", {0, 0, 1, [](P) { return Diagonal({1., i}); }}},
+         {"sdg", {0, 0, 1, [](P) { return Diagonal({1., -i}); }}},
+         {"t", {0, 0, 1, [](P) { return Phase(kPi / 4); }}},
+         {"tdg", {0, 0, 1, [](P) { return Phase(-kPi / 4); }}},
+         {"sx", {0, 0, 1, [](P) { return SX(1.); }}},
+         {"sxdg", {0, 0, 1, [](P) { return SX(-1.); }}},
+         {"rx", {1, 0, 1, [](P p) { return U3(p[0], -kPi / 2, kPi / 2); }}},
+         {"ry", {1, 0, 1, [](P p) { return U3(p[0], 0., 0.); }}},
+         {"rz", {1, 0, 1, [](P p) { return RZ(p[0]); }}},
+         {"CX", {0, 1, 1, [](P) { return X(); }}},
+         {"cx", {0, 1, 1, [](P) { return X(); }}},
+         {"cy", {0, 1, 1, [](P) { return Y(); }}},
+         {"cz", {0, 1, 1, [](P) { return Diagonal({1., -1.}); }}},
+         {"ch", {0, 1, 1, [](P) { return H(); }}},
+         {"crx", {1, 1, 1, [](P p) { return U3(p[0], -kPi / 2, kPi / 2); }}},
+         {"cry", {1, 1, 1, [](P p) { return U3(p[0], 0., 0.); }}},
+         {"crz", {1, 1, 1, [](P p) { return RZ(p[0]); }}},
+         {"cu1", {1, 1, 1, [](P p) { return Phase(p[0]); }}},
+         {"cp", {1, 1, 1, [](P p) { return Phase(p[0]); }}},
+         {"cu3", {3, 1, 1, [](P p) { return U3(p[0], p[1], p[2]); }}},
+         {"ccx", {0, 2, 1, [](P) { return X(); }}},
+         {"swap", {0, 0, 2, [](P) { return Swap(); }}},
+         {"cswap", {0, 1, 2, [](P) { return Swap(); }}},
+         {"rzz", {1, 0, 2, [](P p) { return RZZ(p[0]); }}}};
+     return defs;
+}
+
+static bool IsDiagonal(const Matrix& m)
+{
+     for (size_t i = 0; i < m.size(); ++i) {
+          for (size_t j = 0; j < m.size(); ++j) {
+               if (i != j && m[i][j] != 0.) {
+                    return false;
+               }
+          }
+     }
+     return true;
+}
+
+// =============================================================================
+
+class QasmParser
+{
+public:
+     QasmParser(const std::string& path, const std::string& text)
+         : path_(path), text_(text)
+     {}
+
+     Circuit Parse()
+     {
+          Next();
+          if (tok_ == "OPENQASM") {
+               Next();
+               if (tok_.compare(0, 1, "2") != 0) {
+                    Error("only OpenQASM 2 is supported");
+               }
+               Next();
+               Expect(";");
+          }
+          while (!tok_.empty()) {
+               Statement();
+          }
+          return std::move(circuit_);
+     }
+
+private:
+     std::string path_;
+     std::string text_;
+     size_t pos_ = 0;
+     int line_ = 1;
+     std::string tok_;
+     Circuit circuit_;
+
+     [[noreturn]] void Error(const std::string& what) const
+     {
+          throw std::runtime_error(
+              (boost::format("%s:%d: %s") % path_ % line_ % what).str());
+     }
+
+     // Moves to the next token (empty at the end of the text)
+     void Next()
+     {
+          while (pos_ < text_.size()) {
+               if (text_[pos_] == '\n') {
+                    ++line_;
+               }
+               if (std::isspace(static_cast<unsigned char>(text_[pos_]))) {
+                    ++pos_;
+               }
+               else if (text_.compare(pos_, 2, "//") == 0) {
+                    pos_ = std::min(text_.find('\n', pos_), text_.size());
+               }
+               else {
+                    break;
+               }
+          }
+          auto start = pos_;
+          if (pos_ == text_.size()) {
+               tok_.clear();
+               return;
+          }
+          auto c = static_cast<unsigned char>(text_[pos_]);
+          if (std::isalpha(c) || c == '_') {
+               while (pos_ < text_.size()
+                      && (std::isalnum(static_cast<unsigned char>(text_[pos_]))
+                          || text_[pos_] == '_')) {
+                    ++pos_;
+               }
+          }
+          else if (std::isdigit(c) || c == '.') {
+               std::size_t n = 0;
+               std::stod(text_.substr(pos_, 64), &n);
+               pos_ += n;
+          }
+          else if (c == '"') {
+               pos_ = text_.find('"', pos_ + 1);
+               if (pos_ == std::string::npos) {
+                    Error("unterminated string");
+               }
+               ++pos_;
+          }
+          else if (text_.compare(pos_, 2, "->") == 0
+                   || text_.compare(pos_, 2, "==") == 0) {
+               pos_ += 2;
+          }
+          else {
+               ++pos_;
+          }
+          tok_ = text_.substr(start, pos_ - start);
+     }
+
+     void Expect(const std::string& tok)
+     {
+          if (tok_ != tok) {
+               Error("expected '" + tok + "' instead of '" + tok_ + "'");
+          }
+          Next();
+     }
+
+     std::string Identifier()
+     {
+          if (tok_.empty()
+              || !(std::isalpha(static_cast<unsigned char>(tok_[0]))
+                   || tok_[0] == '_')) {
+               Error("expected an identifier instead of '" + tok_ + "'");
+          }
+          auto id = tok_;
+          Next();
+          return id;
+     }
+
+     Index Integer()
+     {
+          if (tok_.empty()
+              || tok_.find_first_not_of("0123456789") != std::string::npos) {
+               Error("expected an integer instead of '" + tok_ + "'");
+          }
+          auto n = std::stoll(tok_);
+          Next();
+          return n;
+     }
+
+     void Statement()
+     {
+          auto name = Identifier();
+          if (name == "include") {
+               if (tok_ != "\"qelib1.inc\"") {
+                    Error("only qelib1.inc may be included");
+               }
+               Next();
+          }
+          else if (name == "qreg" || name == "creg") {
+               auto& regs = name == "qreg" ? circuit_.qregs : circuit_.cregs;
+               auto& total = name == "qreg" ? circuit_.num_qubits
+                                            : circuit_.num_clbits;
+               Register reg{Identifier(), total, 0};
+               Expect("[");
+               reg.size = Integer();
+               Expect("]");
+               if (Find(circuit_.qregs, reg.name)
+                   || Find(circuit_.cregs, reg.name)) {
+                    Error("register " + reg.name + " is already declared");
+               }
+               total += reg.size;
+               regs.push_back(reg);
+          }
+          else if (name == "barrier") {
+               Arguments(circuit_.qregs);
+          }
+          else if (name == "measure") {
+               auto q = Argument(circuit_.qregs);
+               Expect("->");
+               auto c = Argument(circuit_.cregs);
+               if (q.size() != c.size()) {
+                    Error("measure of registers of different sizes");
+               }
+               if (circuit_.segments.empty()) {
+                    circuit_.segments.emplace_back();
+               }
+               for (size_t i = 0; i < q.size(); ++i) {
+                    circuit_.segments.back().measures.emplace_back(q[i], c[i]);
+               }
+          }
+          else if (GateDefs().count(name)) {
+               GateStatement(name, GateDefs().at(name));
+          }
+          else if (name == "gate" || name == "opaque" || name == "if"
+                   || name == "reset") {
+               Error("'" + name + "' is not supported");
+          }
+          else {
+               Error("unknown gate '" + name + "'");
+          }
+          Expect(";");
+     }
+
+     void GateStatement(const std::string& name, const GateDef& def)
+     {
+          std::vector<double> params;
+          if (tok_ == "(") {
+               Next();
+               while (tok_ != ")") {
+                    params.push_back(Expression());
+                    if (tok_ != ")") {
+                         Expect(",");
+                    }
+               }
+               Next();
+          }
+          if (params.size() != def.num_params) {
+               Error(boost::str(boost::format("%s takes %d parameters") % name
+                                % def.num_params));
+          }
+          auto args = Arguments(circuit_.qregs);
+          if (args.size() != def.num_ctrl + def.num_targets) {
+               Error(boost::str(boost::format("%s acts on %d qubits") % name
+                                % (def.num_ctrl + def.num_targets)));
+          }
+
+          // arguments which are whole registers are broadcast
+          size_t n = 1;
+          for (auto& arg: args) {
+               if (arg.size() != 1) {
+                    if (n != 1 && n != arg.size()) {
+                         Error("registers of different sizes");
+                    }
+                    n = arg.size();
+               }
+          }
+          if (circuit_.segments.empty()
+              || !circuit_.segments.back().measures.empty()) {
+               circuit_.segments.emplace_back();
+          }
+          auto m = def.matrix(params);
+          for (size_t k = 0; k < n; ++k) {
+               Gate gate{m, {}, {}};
+               for (size_t j = 0; j < args.size(); ++j) {
+                    auto id = args[j][args[j].size() == 1 ? 0 : k];
+                    if (std::count(gate.ctrl.begin(), gate.ctrl.end(), id)
+                        || std::count(gate.ids.begin(), gate.ids.end(), id)) {
+                         Error("the qubits of " + name + " must be different");
+                    }
+                    (j < def.num_ctrl ? gate.ctrl : gate.ids).push_back(id);
+               }
+               circuit_.segments.back().gates.push_back(std::move(gate));
+          }
+     }
+
+     static const Register* Find(const std::vector<Register>& regs,
+                                 const std::string& name)
+     {
+          for (auto& reg: regs) {
+               if (reg.name == name) {
+                    return &reg;
+               }
+          }
+          return nullptr;
+     }
+
+     // Returns the bits of a register or of one of its elements
+     IndexVector Argument(const std::vector<Register>& regs)
+     {
+          auto name = Identifier();
+          auto reg = Find(regs, name);
+          if (!reg) {
+               Error("unknown register " + name);
+          }
+          IndexVector bits;
+          if (tok_ == "[") {
+               Next();
+               auto i = Integer();
+               Expect("]");
+               if (i >= reg->size) {
+                    Error(boost::str(boost::format("%s[%d] is out of range")
+                                     % name % i));
+               }
+               bits.push_back(reg->offset + i);
+          }
+          else {
+               for (Index i = 0; i < reg->size; ++i) {
+                    bits.push_back(reg->offset + i);
+               }
+          }
+          return bits;
+     }
+
+     std::vector<IndexVector> Arguments(const std::vector<Register>& regs)
+     {
+          std::vector<IndexVector> args{Argument(regs)};
+          while (tok_ == ",") {
+               Next();
+               args.push_back(Argument(regs));
+          }
+          return args;
+     }
+
+     double Expression()
+     {
+          auto v = Term();
+          while (tok_ == "+" || tok_ == "-") {
+               auto op = tok_;
+               Next();
+               v = op == "+" ? v + Term() : v - Term();
+          }
+          return v;
+     }
+
+     double Term()
+     {
+          auto v = Power();
+          while (tok_ == "*" || tok_ == "/") {
+               auto op = tok_;
+               Next();
+               v = op == "*" ? v * Power() : v / Power();
+          }
+          return v;
+     }
+
+     double Power()
+     {
+          auto v = Unary();
+          if (tok_ == "^") {
+               Next();
+               v = std::pow(v, Power());
+          }
+          return v;
+     }
+
+     double Unary()
+     {
+          if (tok_ == "-") {
+               Next();
+               return -Unary();
+          }
+          if (tok_ == "+") {
+               Next();
+               return Unary();
+          }
+          return Primary();
+     }
+
+     double Primary()
+     {
+          static const std::map<std::string, double (*)(double)> functions
+              = {{"sin", std::sin}, {"cos", std::cos}, {"tan", std::tan},
+                 {"exp", std::exp}, {"ln", std::log},  {"sqrt", std::sqrt}};
+
+          if (tok_ == "(") {
+               Next();
+               auto v = Expression();
+               Expect(")");
+               return v;
+          }
+          if (tok_ == "pi") {
+               Next();
+               return kPi;
+          }
+          if (functions.count(tok_)) {
+               auto f = functions.at(tok_);
+               Next();
+               Expect("(");
+               auto v = f(Expression());
+               Expect(")");
+               return v;
+          }
+          if (!tok_.empty()
+              && (std::isdigit(static_cast<unsigned char>(tok_[0]))
+                  || tok_[0] == '.')) {
+               auto v = std::stod(tok_);
+               Next();
+               return v;
+          }
+          Error("unexpected '" + tok_ + "' in expression");
+     }
+};
+
+// =============================================================================
+
+// Classical bits as a string: the last register and its highest bit first
+static std::string FormatBits(const Circuit& circuit,
+                              const std::vector<bool>& bits)
+{
+     std::string s;
+     for (auto reg = circuit.cregs.rbegin(); reg != circuit.cregs.rend();
+          ++reg) {
+          if (!s.empty()) {
+               s += ' ';
+          }
+          for (Index i = reg->size - 1; i >= 0; --i) {
+               s += bits[reg->offset + i] ? '1' : '0';
+          }
+     }
+     return s;
+}
+
+int main(int argc, const char** argv)
+{
+     std::string path;
+     std::string output;
+     uint64_t shots = 1;
+     uint64_t seed = 1;
+     uint64_t max_local = 33;
+     uint64_t max_cluster_size = 4;
+     uint64_t max_memory = 0;
+     int num_splits = 1000000;
+     std::string out_of_core_dir;
+     std::string trace_path;
+
+     po::options_description desc("Options");
+     desc.add_options()("help", "produce help message")(
+         "circuit", po::value<std::string>(&path), "OpenQASM 2 file")(
+         "shots", po::value<uint64_t>(&shots),
+         "number of samples of the measurements (default: 1)")(
+         "seed", po::value<uint64_t>(&seed),
+         "seed of the pseudo-random number generator (default: 1)")(
+         "output", po::value<std::string>(&output),
+         "file of the outcomes (default: standard output)")(
+         "async-swap", "overlap the swaps of qubits with the next clusters")(
+         "max-local", po::value<uint64_t>(&max_local),
+         "maximum number of local qubits (default: 33)")(
+         "max-cluster-size", po::value<uint64_t>(&max_cluster_size),
+         "maximum number of qubits in fused gates (default: 4)")(
+         "num-splits", po::value<int>(&num_splits),
+         "number of branch splits of the swap scheduling (default: 1000000)")(
+         "max-memory", po::value<uint64_t>(&max_memory),
+         "maximum size in bytes of the local state vector (default: no "
+         "limit)")(
+         "out-of-core-dir", po::value<std::string>(&out_of_core_dir),
+         "directory of the out-of-core state vector")(
+         "trace", po::value<std::string>(&trace_path),
+         "record the simulator calls in a trace for hiq-replay");
+     po::positional_options_description positional;
+     positional.add("circuit", 1);
+
+     po::variables_map vm;
+     po::store(po::command_line_parser(argc, argv)
+                   .options(desc)
+                   .positional(positional)
+                   .run(),
+               vm);
+     po::notify(vm);
+
+     if (vm.count("help") || path.empty() || shots == 0) {
+          std::cout << "Usage: hiq-run [options] circuit\n" << desc << "\n";
+          return vm.count("help") ? 0 : 1;
+     }
+
+     SimulatorMPI sim(mpi::communicator(), seed, max_local, max_cluster_size,
+                      max_memory, out_of_core_dir);
+     bool async_swap = vm.count("async-swap") != 0;
+
+     // the circuit is read by rank 0 only, as it may not be on a shared disk
+     std::string text;
+     if (sim.world_.rank() == 0) {
+          std::ifstream in(path);
+          std::stringstream ss;
+          ss << in.rdbuf();
+          text = in ? ss.str() : std::string(1, '\0');
+     }
+     mpi::broadcast(sim.world_, text, 0);
+     if (text == std::string(1, '\0')) {
+          LOG_IF(ERROR, sim.world_.rank() == 0)
+              << "hiq-run: can't read " << path;
+          return 1;
+     }
+
+     Circuit circuit;
+     try {
+          circuit = QasmParser(path, text).Parse();
+     }
+     catch (const std::exception& e) {
+          LOG_IF(ERROR, sim.world_.rank() == 0) << "hiq-run: " << e.what();
+          return 1;
+     }
+
+     bool terminal = true;
+     for (size_t i = 0; i + 1 < circuit.segments.size(); ++i) {
+          terminal &= circuit.segments[i].measures.empty();
+     }
+     if (shots > 1 && !terminal) {
+          LOG_IF(ERROR, sim.world_.rank() == 0)
+              << "hiq-run: more than one shot needs all measurements at the "
+                 "end of the circuit";
+          return 1;
+     }
+     if (shots > 1 && !circuit.segments.empty()
+         && circuit.segments.back().measures.size() > 64) {
+          LOG_IF(ERROR, sim.world_.rank() == 0)
+              << "hiq-run: can't sample more than 64 qubits";
+          return 1;
+     }
+
+     // the errors of the scheduler and of the simulator are the same on all
+     // processes
+     std::map<std::string, uint64_t> counts;
+     uint64_t num_clusters = 0;
+     uint64_t num_swaps = 0;
+     double total = 0;
+     try {
+          if (!trace_path.empty()) {
+               sim.StartTrace(trace_path);
+          }
+          auto start_time = Clock::now();
+          IndexVector ids(circuit.num_qubits);
+          std::iota(ids.begin(), ids.end(), 0);
+          sim.AllocateQureg(ids);
+
+          GreedyScheduler scheduler(num_splits,
+                                    static_cast<int>(max_cluster_size));
+          std::vector<bool> bits(circuit.num_clbits);
+
+          for (auto& segment: circuit.segments) {
+               for (auto& gate: segment.gates) {
+                    bool diag = IsDiagonal(gate.m);
+                    scheduler.AddGate(gate.ids, gate.ctrl, diag,
+                                      diag && !gate.ctrl.empty()
+                                          && gate.m[0][0] == 1.);
+               }
+               auto plan = scheduler.Schedule(sim.GetLocalQubitsPermutation(),
+                                              sim.GetGlobalQubitsPermutation(),
+                                              sim.GetGlobalQubitsSwapCost());
+
+               for (auto& step: plan) {
+                    switch (step.type) {
+                         case GreedyScheduler::kPermute:
+                              sim.SetQubitsPermutation(step.data);
+                              break;
+                         case GreedyScheduler::kSwap:
+                              if (async_swap) {
+                                   sim.StartSwapQubits(step.data);
+                              }
+                              else {
+                                   sim.SwapQubitsWrapper(step.data);
+                              }
+                              ++num_swaps;
+                              break;
+                         case GreedyScheduler::kCluster:
+                              for (auto i: step.data) {
+                                   sim.ApplyGate(segment.gates[i].m,
+                                                 scheduler.GateIds(i),
+                                                 scheduler.GateCtrl(i));
+                              }
+                              sim.Run();
+                              ++num_clusters;
+                              break;
+                    }
+               }
+
+               if (segment.measures.empty()) {
+                    continue;
+               }
+               IndexVector measured;
+               for (auto& m: segment.measures) {
+                    measured.push_back(m.first);
+               }
+               if (shots > 1) {
+                    for (auto& s: sim.Sample(measured, shots, seed)) {
+                         for (size_t i = 0; i < measured.size(); ++i) {
+                              bits[segment.measures[i].second]
+                                  = (s.first >> i) & 1;
+                         }
+                         counts[FormatBits(circuit, bits)] += s.second;
+                    }
+                    break;
+               }
+               auto res = sim.MeasureQubits(measured);
+               for (size_t i = 0; i < measured.size(); ++i) {
+                    bits[segment.measures[i].second] = res[i];
+               }
+          }
+          if (shots == 1) {
+               counts[FormatBits(circuit, bits)] = 1;
+          }
+          sim.WaitSwapQubits();
+          total = Duration(Clock::now() - start_time).count();
+          if (!trace_path.empty()) {
+               sim.StopTrace();
+          }
+     }
+     catch (const std::exception& e) {
+          LOG_IF(ERROR, sim.world_.rank() == 0) << "hiq-run: " << e.what();
+          return 1;
+     }
+
+     if (sim.world_.rank() == 0) {
+          std::ofstream file;
+          if (!output.empty()) {
+               file.open(output);
+          }
+          std::ostream& out = output.empty() ? std::cout : file;
+          for (auto& c: counts) {
+               out << c.first << " " << c.second << "\n";
+          }
+          LOG(INFO) << boost::format("hiq-run: %d qubits, %d clusters, %d "
+                                     "swaps in %.3lf s")
+                           % circuit.num_qubits % num_clusters % num_swaps
+                           % total;
+          if (!out) {
+               LOG(ERROR) << "hiq-run: can't write " << output;
+               return 1;
+          }
+     }
+}
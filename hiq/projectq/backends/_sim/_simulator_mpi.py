@@ -18,6 +18,7 @@ built first. If the c++ simulator is not exported to python, a (slow) python
 implementation is used as an alternative.
 """
 
+import cmath
 import math
 import random
 
@@ -32,11 +33,17 @@ from projectq.ops import (NOT,
                           Allocate,
                           Deallocate,
                           BasicMathGate,
+                          BasicPhaseGate,
+                          BasicRotationGate,
                           TimeEvolution, FastForwardingGate)
+from projectq.libs.math import (AddConstant,
+                                AddConstantModN,
+                                MultiplyByConstantModN)
 from projectq.types import WeakQubitRef
 
-from hiq.projectq.ops import MetaSwap, AllocateQuregGate
-from ._cppsim_mpi import SimulatorMPI as SimulatorBackend
+from hiq.projectq.ops import MetaSwap, AllocateQuregGate, ParameterTag
+from ._cppsim_mpi import (SimulatorMPI as SimulatorBackend, Reduction,
+                          ExecutionPlan)
 
 from mpi4py import rc
 rc.thread = True
@@ -57,7 +64,9 @@ class SimulatorMPI(BasicEngine):
         export OMP_NUM_THREADS=4 # use 4 threads
         export OMP_PROC_BIND=spread # bind threads to processors by spreading
     """
-    def __init__(self, gate_fusion=False, rnd_seed=None, num_local_qubits=33, max_fused_qubits=4):
+    def __init__(self, gate_fusion=False, rnd_seed=None, num_local_qubits=33, max_fused_qubits=4,
+                 async_swap=False, memory_budget=None, out_of_core_dir=None,
+                 trace=None):
         """
         Construct the C++/Python-simulator object and initialize it with a
         random seed.
@@ -72,6 +81,22 @@ class SimulatorMPI(BasicEngine):
                 allocate by itself
             max_fused_qubits (int): the maximum number of qubits the fused gate
                 can act on
+            async_swap (bool): If True, qubit swaps are exchanged in the
+                background when requested; small clusters following a swap
+                are then applied while the swap data is received (this needs
+                MPI to be initialized with MPI_THREAD_MULTIPLE, otherwise the
+                swap data is only exchanged when it is needed).
+            memory_budget (int): Maximum size in bytes of the state vector
+                held by each MPI process (no limit by default). Only the
+                memory of the allocated qubits is used, whatever
+                num_local_qubits is.
+            out_of_core_dir (str): Directory on a local disk (e.g. NVMe) in
+                which the state vector is memory-mapped, so that it may be
+                larger than the memory of the node (num_local_qubits and
+                memory_budget then refer to the disk).
+            trace (str): File in which the calls received by the C++
+                simulator are recorded, to be replayed (e.g. as a benchmark)
+                by the hiq-replay executable without Python.
 
         Example of gate_fusion: Instead of applying a Hadamard gate to 5
         qubits, the simulator calculates the kronecker product of the 1-qubit
@@ -89,8 +114,15 @@ class SimulatorMPI(BasicEngine):
         if rnd_seed is None:
             rnd_seed = random.randint(0, 4294967295)
         BasicEngine.__init__(self)
-        self._simulator = SimulatorBackend(rnd_seed, num_local_qubits, max_fused_qubits)
+        self._simulator = SimulatorBackend(rnd_seed, num_local_qubits, max_fused_qubits,
+                                           memory_budget or 0, out_of_core_dir or '')
+        if trace is not None:
+            self._simulator.start_trace(trace)
         self._gate_fusion = gate_fusion
+        self._async_swap = async_swap
+        self._plan = None
+        self._plan_arranged = False
+        self._plan_parameters = 0
 
     def is_available(self, cmd):
         """
@@ -110,9 +142,10 @@ class SimulatorMPI(BasicEngine):
                 cmd.gate == Deallocate or
                 isinstance(cmd.gate, AllocateQuregGate)):
             return True
-        elif (isinstance(cmd.gate, BasicMathGate) or  # current version don't support this
-               isinstance(cmd.gate, TimeEvolution)):
-            return False
+        elif isinstance(cmd.gate, BasicMathGate):
+            return True
+        elif isinstance(cmd.gate, TimeEvolution):
+            return True
             
         try:
             m = cmd.gate.matrix
@@ -249,6 +282,140 @@ class SimulatorMPI(BasicEngine):
         return self._simulator.get_probability(bit_string,
                                                [qb.id for qb in qureg])
 
+    def get_probabilities(self, bit_strings, qureg):
+        """
+        Return the probabilities of several outcomes `bit_strings` when
+        measuring the quantum register `qureg`.
+
+        Args:
+            bit_strings (list[list[bool|int]|string[0|1]]): Measurement
+                outcomes.
+            qureg (Qureg|list[Qubit]): Quantum register.
+
+        Returns:
+            List with the probability of each of the bit strings.
+
+        Note:
+            Make sure all previous commands (especially allocations) have
+            passed through the compilation chain (call main_engine.flush() to
+            make sure).
+
+        Note:
+            If there is a mapper present in the compiler, this function
+            automatically converts from logical qubits to mapped qubits for
+            the qureg argument.
+        """
+        qureg = self._convert_logical_to_mapped_qureg(qureg)
+        bit_strings = [[bool(int(b)) for b in bit_string]
+                       for bit_string in bit_strings]
+        return self._simulator.get_probabilities(bit_strings,
+                                                 [qb.id for qb in qureg])
+
+    def get_marginal_distribution(self, qureg):
+        """
+        Return the probabilities of all outcomes when measuring the quantum
+        register `qureg`.
+
+        Args:
+            qureg (Qureg|list[Qubit]): Quantum register (at most 20 qubits).
+
+        Returns:
+            List of 2^len(qureg) probabilities, bit i of the index is the
+            value of qureg[i].
+
+        Note:
+            Make sure all previous commands (especially allocations) have
+            passed through the compilation chain (call main_engine.flush() to
+            make sure).
+
+        Note:
+            If there is a mapper present in the compiler, this function
+            automatically converts from logical qubits to mapped qubits for
+            the qureg argument.
+        """
+        qureg = self._convert_logical_to_mapped_qureg(qureg)
+        return self._simulator.get_marginal_distribution([qb.id for qb in qureg])
+
+    def get_statistics(self, qureg=(), bit_strings=(), probability_qureg=()):
+        """
+        Return several statistics of the state, computed together in a single
+        pass over the wavefunction.
+
+        Args:
+            qureg (Qureg|list[Qubit]): Qubits whose probability of being
+                measured in state 1 is returned.
+            bit_strings (list[list[bool|int]|string[0|1]]): Measurement
+                outcomes of `probability_qureg` whose probabilities are
+                returned.
+            probability_qureg (Qureg|list[Qubit]): Quantum register of the
+                outcomes `bit_strings`.
+
+        Returns:
+            Dictionary with the norm ('norm'), the entropy ('entropy'), the
+            probability of 1 of each qubit of `qureg` ('qubit_probabilities')
+            and the probability of each of the bit strings ('probabilities').
+
+        Note:
+            Make sure all previous commands (especially allocations) have
+            passed through the compilation chain (call main_engine.flush() to
+            make sure).
+
+        Note:
+            If there is a mapper present in the compiler, this function
+            automatically converts from logical qubits to mapped qubits for
+            the qureg arguments.
+        """
+        qureg = self._convert_logical_to_mapped_qureg(qureg)
+        probability_qureg = self._convert_logical_to_mapped_qureg(
+            probability_qureg)
+        ids = [qb.id for qb in probability_qureg]
+
+        r = Reduction()
+        norm = r.add_norm()
+        entropy = r.add_entropy()
+        qubit_probabilities = r.add_qubit_probabilities(
+            [qb.id for qb in qureg])
+        probabilities = [r.add_probability([bool(int(b)) for b in bits], ids)
+                         for bits in bit_strings]
+        res = self._simulator.reduce(r)
+        return {'norm': res[norm],
+                'entropy': res[entropy],
+                'qubit_probabilities':
+                    res[qubit_probabilities:qubit_probabilities + len(qureg)],
+                'probabilities': [res[i] for i in probabilities]}
+
+    def sample(self, qureg, shots, seed=None):
+        """
+        Draw measurement outcomes of the quantum register `qureg` without
+        collapsing the wavefunction.
+
+        Args:
+            qureg (Qureg|list[Qubit]): Quantum register.
+            shots (int): Number of samples.
+            seed (int): Random seed (uses random.randint(0, 4294967295) by
+                default).
+
+        Returns:
+            Dictionary mapping each drawn outcome (string of '0' and '1', in
+            the order of `qureg`) to the number of times it was drawn.
+
+        Note:
+            Make sure all previous commands (especially allocations) have
+            passed through the compilation chain (call main_engine.flush() to
+            make sure).
+
+        Note:
+            If there is a mapper present in the compiler, this function
+            automatically converts from logical qubits to mapped qubits for
+            the qureg argument.
+        """
+        qureg = self._convert_logical_to_mapped_qureg(qureg)
+        if seed is None:
+            seed = random.randint(0, 4294967295)
+        counts = self._simulator.sample([qb.id for qb in qureg], shots, seed)
+        return {''.join('1' if key >> i & 1 else '0' for i in range(len(qureg))): count
+                for key, count in counts.items()}
+
     def get_amplitude(self, bit_string, qureg):
         """
         Return the probability amplitude of the supplied `bit_string`.
@@ -278,19 +445,23 @@ class SimulatorMPI(BasicEngine):
         return self._simulator.get_amplitude(bit_string,
                                              [qb.id for qb in qureg])
 
-    def set_wavefunction(self, wavefunction, qureg):
+    def get_amplitudes(self, bit_strings, qureg):
         """
-        Set the wavefunction and the qubit ordering of the simulator.
-
-        The simulator will adopt the ordering of qureg (instead of reordering
-        the wavefunction).
+        Return the probability amplitudes of several `bit_strings`, fetched
+        with a single collective operation.
+        The ordering is given by the quantum register `qureg`, which must
+        contain all allocated qubits.
 
         Args:
-            wavefunction (list[complex]): Array of complex amplitudes
-                describing the wavefunction (must be normalized).
+            bit_strings (list[list[bool|int]|string[0|1]]): Computational
+                basis states
             qureg (Qureg|list[Qubit]): Quantum register determining the
                 ordering. Must contain all allocated qubits.
 
+        Returns:
+            Numpy array with the probability amplitude of each of the bit
+            strings.
+
         Note:
             Make sure all previous commands (especially allocations) have
             passed through the compilation chain (call main_engine.flush() to
@@ -302,8 +473,10 @@ class SimulatorMPI(BasicEngine):
             the qureg argument.
         """
         qureg = self._convert_logical_to_mapped_qureg(qureg)
-        self._simulator.set_wavefunction(wavefunction,
-                                         [qb.id for qb in qureg])
+        bit_strings = [[bool(int(b)) for b in bit_string]
+                       for bit_string in bit_strings]
+        return self._simulator.get_amplitudes(bit_strings,
+                                              [qb.id for qb in qureg])
 
     def collapse_wavefunction(self, qureg, values):
         """
@@ -332,6 +505,209 @@ class SimulatorMPI(BasicEngine):
                                                      [bool(int(v)) for v in
                                                       values])
 
+    def set_wavefunction(self, wavefunction, qureg):
+        """
+        Set the wavefunction and the qubit ordering of the simulator.
+
+        Args:
+            wavefunction (list[complex]|numpy.ndarray|str): Array of complex
+                amplitudes describing the wavefunction (must be normalized),
+                or the path of a raw file of complex doubles holding them.
+            qureg (Qureg|list[Qubit]): Qubits to which the wavefunction
+                applies, bit i of the amplitude index being the state of
+                qureg[i]. They must be all the allocated qubits.
+
+        Raises:
+            RuntimeError: If the qubits are not all the allocated qubits (see
+                note) or the size of the wavefunction does not match.
+
+        Note:
+            Each MPI process only reads its own slice of the wavefunction, so
+            that it may be a numpy.memmap of a file too large for one
+            process. A C-contiguous complex128 array is read in place, any
+            other array only has the slice of the process converted.
+
+        Note:
+            Make sure all previous commands have passed through the
+            compilation chain (call main_engine.flush() to make sure).
+
+        Note:
+            If there is a mapper present in the compiler, this function
+            automatically converts from logical qubits to mapped qubits for
+            the qureg argument.
+        """
+        qureg = self._convert_logical_to_mapped_qureg(qureg)
+        ids = [qb.id for qb in qureg]
+        if isinstance(wavefunction, str):
+            self._simulator.set_wavefunction_from_file(wavefunction, ids)
+        else:
+            self._simulator.set_wavefunction(wavefunction, ids)
+
+    def set_basis_state(self, bit_string, qureg):
+        """
+        Set the state of the simulator to a computational basis state.
+
+        Args:
+            bit_string (list[bool|int]|string[0|1]): State of each qubit.
+            qureg (Qureg|list[Qubit]): All the allocated qubits.
+
+        Note:
+            See set_wavefunction() for the notes.
+        """
+        qureg = self._convert_logical_to_mapped_qureg(qureg)
+        self._simulator.set_basis_state([bool(int(b)) for b in bit_string],
+                                        [qb.id for qb in qureg])
+
+    def set_uniform_superposition(self):
+        """
+        Set the state of the simulator to the uniform superposition of all
+        basis states of the allocated qubits.
+
+        Note:
+            Make sure all previous commands have passed through the
+            compilation chain (call main_engine.flush() to make sure).
+        """
+        self._simulator.set_uniform_superposition()
+
+    def set_product_state(self, states, qureg):
+        """
+        Set the state of the simulator to a product state.
+
+        Args:
+            states (list[tuple(complex, complex)]): Normalized amplitudes of
+                |0> and |1> of each qubit.
+            qureg (Qureg|list[Qubit]): All the allocated qubits.
+
+        Note:
+            See set_wavefunction() for the notes.
+        """
+        qureg = self._convert_logical_to_mapped_qureg(qureg)
+        self._simulator.set_product_state([(complex(a), complex(b)) for a, b in states],
+                                          [qb.id for qb in qureg])
+
+    def save_checkpoint(self, path):
+        """
+        Save the state of the simulator (state vector, qubit ordering, random
+        number generator and statistics) to a file, so that an interrupted
+        run can be resumed with load_checkpoint().
+
+        Args:
+            path (str): File to write, shared by all MPI processes.
+
+        Note:
+            Make sure all previous commands have passed through the
+            compilation chain (call main_engine.flush() to make sure).
+        """
+        self._simulator.save_checkpoint(path)
+
+    def load_checkpoint(self, path):
+        """
+        Restore the state saved by save_checkpoint(). The number of MPI
+        processes may differ from the one of the saving run.
+
+        Args:
+            path (str): File written by save_checkpoint().
+
+        Raises:
+            RuntimeError: If the file is not a checkpoint or the allocated
+                qubits are not the ones of the checkpoint.
+
+        Note:
+            Allocate the same qubits as the saving run and call
+            main_engine.flush() before loading.
+        """
+        self._simulator.load_checkpoint(path)
+
+    def stop_trace(self):
+        """
+        Stop recording the trace requested in the constructor and close its
+        file (it is also closed when the simulator is destroyed).
+        """
+        self._simulator.stop_trace()
+
+    def start_plan(self):
+        """
+        Start recording the gates and swaps received from now on in an
+        execution plan, which run_plan() replays with other angles without
+        compiling and scheduling the circuit again (e.g. in a parameter
+        sweep). The commands are still simulated while they are recorded.
+
+        The angles of the rotation and phase gates are the parameters of the
+        plan, in the order in which the gates are issued. The matrix of any
+        other gate is recorded as it is.
+
+        Note:
+            Allocate the qubits and call main_engine.flush() before starting
+            and before stopping the recording. Measurements, allocations,
+            deallocations, math gates and time evolutions can't be recorded.
+        """
+        self._simulator.run()
+        self._plan = ExecutionPlan()
+        self._plan_arranged = False
+        self._plan_parameters = 0
+
+    def stop_plan(self):
+        """
+        Stop recording the execution plan started by start_plan().
+
+        Returns:
+            The plan, to pass to run_plan(). Its attribute parameters holds
+            the angles of the recorded run.
+        """
+        self._simulator.run()
+        plan, self._plan = self._plan, None
+        return plan
+
+    @property
+    def recording_plan(self):
+        """
+        True between start_plan() and stop_plan().
+        """
+        return self._plan is not None
+
+    def next_plan_parameter(self, gate):
+        """
+        Return the index of the next parameter of the plan being recorded
+        (used by the compiler engines to number the angles in the order of
+        the circuit, see ParameterTag).
+
+        Args:
+            gate (BasicGate): Gate taking the parameter.
+
+        Returns:
+            The index, or None if the gate is recorded with a constant matrix
+            (it isn't a rotation or phase gate whose matrix can be replayed
+            with another angle) and thus takes no parameter.
+        """
+        if (not isinstance(gate, (BasicRotationGate, BasicPhaseGate)) or
+                _angle_terms(gate) is None):
+            return None
+        index = self._plan_parameters
+        self._plan_parameters += 1
+        return index
+
+    def run_plan(self, plan, angles=None):
+        """
+        Execute an execution plan recorded by start_plan() and stop_plan() on
+        the current state. The global qubits are first swapped back to the
+        ones of the recording run if they differ.
+
+        Args:
+            plan (ExecutionPlan): Plan returned by stop_plan().
+            angles (list[float]): Angle of each parameter of the plan (the
+                ones of the recording run by default).
+
+        Raises:
+            RuntimeError: If there are fewer angles than parameters or the
+                allocated qubits are not the ones of the recording run.
+
+        Note:
+            Call main_engine.flush() before running the plan.
+        """
+        if angles is None:
+            angles = plan.parameters
+        self._simulator.run_plan(plan, [float(a) for a in angles])
+
     def cheat_local(self):
         """
         Access the ordering of the qubits and this MPI process's part of
@@ -342,6 +718,13 @@ class SimulatorMPI(BasicEngine):
             indices to bit-locations (all qubits) and the second entry is the local part
             of state vector.
 
+        Note:
+            The local part is a numpy array viewing the memory of the
+            simulator (no copy is made), which the gates, apply_qubit_operator,
+            emulate_time_evolution and emulate_math update in place. It is
+            only valid until the next allocation or deallocation of qubits
+            (a measurement followed by the deallocation of the measured
+            qubits included), copy it to keep it.
         """
         return self._simulator.cheat_local()
 
@@ -375,8 +758,37 @@ class SimulatorMPI(BasicEngine):
             qubits.
         """
         id2pos, vec = self.cheat_local()
-        tot_vec = numpy.zeros(len(vec)*MPI.COMM_WORLD.Get_size(), dtype=complex)
-        MPI.COMM_WORLD.Allgather([numpy.array(vec), MPI.COMPLEX], [tot_vec, MPI.COMPLEX])
+        size = MPI.COMM_WORLD.Get_size()
+        tot_vec = numpy.empty(len(vec)*size, dtype=complex)
+        # the simulator may number the processes differently (node by node
+        # or after relabeling), each part is received at its place
+        ranks = MPI.COMM_WORLD.allgather(self._simulator.get_rank())
+        counts = [len(vec)] * size
+        displs = [rank * len(vec) for rank in ranks]
+        MPI.COMM_WORLD.Allgatherv([vec, MPI.DOUBLE_COMPLEX],
+                                  [tot_vec, (counts, displs), MPI.DOUBLE_COMPLEX])
+        return id2pos, tot_vec
+
+    def cheat_gather(self, root=0):
+        """
+        Access the ordering of the qubits and the state vector on one MPI
+        process only.
+
+        Same as cheat(), but the state vector is only gathered on the process
+        root, the others do not allocate any memory for it.
+
+        Args:
+            root (int): Rank in MPI.COMM_WORLD of the process receiving the
+                state vector.
+
+        Returns:
+            A tuple (id2pos, tot_vec) as returned by cheat() on root, and
+            (id2pos, None) on the other processes.
+        """
+        id2pos = self.cheat_local()[0]
+        tot_vec = self._simulator.gather_state_vector(root)
+        if MPI.COMM_WORLD.Get_rank() != root:
+            tot_vec = None
         return id2pos, tot_vec
 
     def get_qubits_ids(self):
@@ -400,6 +812,16 @@ class SimulatorMPI(BasicEngine):
         """
         return self._simulator.get_global_qubits_ids()
 
+    def get_global_qubits_swap_cost(self):
+        """
+        Returns:
+             A list with the relative cost of swapping each global qubit
+             (in the order of get_global_qubits_ids()). Global qubits that only
+             split processes within a node are cheaper than the ones that
+             cross the network.
+        """
+        return self._simulator.get_global_qubits_swap_cost()
+
     def set_qubits_perm(self, ids):
         """
         Sets the initial permutation of qubits in simulator
@@ -409,11 +831,45 @@ class SimulatorMPI(BasicEngine):
             ids (list[int]): list of all qubits ids
         """
         self._simulator.set_qubits_perm(ids)
+        if self._plan is not None and self._plan_arranged:
+            self._plan.add_arrange(self._simulator.get_global_qubits_ids())
+
+    def _start_plan_step(self):
+        # the plan starts from the global qubits of its first step, which may
+        # have been relabeled since start_plan()
+        if not self._plan_arranged:
+            self._plan.add_arrange(self._simulator.get_global_qubits_ids())
+            self._plan_arranged = True
+
+    def _record_gate(self, cmd, ids, ctrlids):
+        self._start_plan_step()
+        gate = cmd.gate
+        terms = None
+        if isinstance(gate, (BasicRotationGate, BasicPhaseGate)):
+            terms = _angle_terms(gate)
+        if terms is None:
+            self._plan.add_gate(gate.matrix.tolist(), ids, ctrlids)
+        else:
+            # only the gates recorded as parametric take an index, so that
+            # the parameters have no holes
+            index = None
+            for tag in cmd.tags:
+                if isinstance(tag, ParameterTag):
+                    index = tag.index
+            if index is None:
+                index = self.next_plan_parameter(gate)
+            self._plan.add_parametric_gate(index, gate.angle,
+                                           [f for f, _ in terms],
+                                           [t.tolist() for _, t in terms],
+                                           ids, ctrlids)
 
     def _do_swap(self, qubits):
-        self._simulator.swap_qubits(qubits)
+        if self._async_swap:
+            self._simulator.start_swap_qubits(qubits)
+        else:
+            self._simulator.swap_qubits(qubits)
 
-    def _handle(self, cmd):
+    def _handle(self, cmd, deallocate=False):
         """
         Handle all commands, i.e., call the member functions of the C++-
         simulator object corresponding to measurement, allocation/
@@ -421,20 +877,36 @@ class SimulatorMPI(BasicEngine):
 
         Args:
             cmd (Command): Command to handle.
+            deallocate (bool): If cmd is a measurement, also deallocate the
+                measured qubits.
 
         Raises:
             Exception: If a non-single-qubit gate needs to be processed
                 (which should never happen due to is_available).
         """
+        if self._plan is not None and (
+                cmd.gate == Measure or cmd.gate == Allocate or
+                cmd.gate == Deallocate or
+                isinstance(cmd.gate, (AllocateQuregGate, BasicMathGate,
+                                      TimeEvolution))):
+            raise Exception("SimulatorMPI: {} can't be part of an execution "
+                            "plan.".format(cmd.gate))
+
         if isinstance(cmd.gate, FlushGate):
             pass
         elif cmd.gate == MetaSwap:
             qubits = [qb.id for qr in cmd.all_qubits for qb in qr]
+            if self._plan is not None:
+                self._start_plan_step()
+                self._plan.add_swap(qubits, self._async_swap)
             self._do_swap(qubits)
         elif cmd.gate == Measure:
             assert(get_control_count(cmd) == 0)
             ids = [qb.id for qr in cmd.qubits for qb in qr]
-            out = self._simulator.measure_qubits(ids)
+            if deallocate:
+                out = self._simulator.measure_and_deallocate(ids)
+            else:
+                out = self._simulator.measure_qubits(ids)
             i = 0
             for qr in cmd.qubits:
                 for qb in qr:
@@ -463,9 +935,21 @@ class SimulatorMPI(BasicEngine):
                 qubitids.append([])
                 for qb in qr:
                     qubitids[-1].append(qb.id)
-            math_fun = cmd.gate.get_math_function(cmd.qubits)
-            self._simulator.emulate_math(math_fun, qubitids,
-                                         [qb.id for qb in cmd.control_qubits])
+            ctrlids = [qb.id for qb in cmd.control_qubits]
+            # common arithmetic runs natively, anything else calls back into
+            # Python for every basis state
+            if isinstance(cmd.gate, AddConstant):
+                self._simulator.emulate_math_add_constant(
+                    cmd.gate.a, qubitids, ctrlids)
+            elif isinstance(cmd.gate, AddConstantModN):
+                self._simulator.emulate_math_add_constant_mod_n(
+                    cmd.gate.a, cmd.gate.N, qubitids, ctrlids)
+            elif isinstance(cmd.gate, MultiplyByConstantModN):
+                self._simulator.emulate_math_multiply_by_constant_mod_n(
+                    cmd.gate.a, cmd.gate.N, qubitids, ctrlids)
+            else:
+                math_fun = cmd.gate.get_math_function(cmd.qubits)
+                self._simulator.emulate_math(math_fun, qubitids, ctrlids)
         elif isinstance(cmd.gate, TimeEvolution):
             op = [(list(term), coeff) for (term, coeff)
                   in cmd.gate.hamiltonian.terms.items()]
@@ -482,12 +966,16 @@ class SimulatorMPI(BasicEngine):
                                     str(cmd.gate),
                                     int(math.log(len(cmd.gate.matrix), 2)),
                                     len(ids)))
+            ctrlids = [qb.id for qb in cmd.control_qubits]
+            if self._plan is not None:
+                self._record_gate(cmd, ids, ctrlids)
             self._simulator.apply_controlled_gate(matrix.tolist(),
                                                   ids,
-                                                  [qb.id for qb in
-                                                   cmd.control_qubits])
+                                                  ctrlids)
             if not self._gate_fusion:
                 self._simulator.run()
+                if self._plan is not None:
+                    self._plan.end_cluster()
         else:
             raise Exception("This simulator only supports controlled k-qubit"
                             " gates with k < 6!\nPlease add an auto-replacer"
@@ -503,11 +991,59 @@ class SimulatorMPI(BasicEngine):
             command_list (list<Command>): List of commands to execute on the
                 simulator.
         """
-        for cmd in command_list:
+        deallocated = None
+        for i, cmd in enumerate(command_list):
             if isinstance(cmd.gate, FlushGate) or isinstance(cmd.gate, FastForwardingGate):
                 self._simulator.run()  # flush gate --> run all saved gates
-
-            self._handle(cmd)
+                if self._plan is not None:
+                    self._plan.end_cluster()
+
+            # a measurement directly followed by the deallocation of the
+            # measured qubit drops it from the state vector in the same pass
+            next_cmd = (command_list[i + 1] if i + 1 < len(command_list)
+                        else None)
+            if cmd is deallocated:
+                pass
+            elif (cmd.gate == Measure and next_cmd is not None and
+                  next_cmd.gate == Deallocate and
+                  [qb.id for qr in cmd.qubits for qb in qr] ==
+                  [next_cmd.qubits[0][0].id]):
+                self._handle(cmd, deallocate=True)
+                deallocated = next_cmd
+            else:
+                self._handle(cmd)
 
             if not self.is_last_engine:
                 self.send([cmd])
+
+
+_ANGLE_FREQUENCIES = (-1., -.5, 0., .5, 1.)
+
+
+def _angle_terms(gate):
+    """
+    Return the matrix of a rotation or phase gate as a function of its angle,
+    as the pairs (frequency, term) of
+
+        matrix(angle) = sum(exp(1j * frequency * angle) * term)
+
+    found by sampling the matrix at 5 angles, or None if the matrix is not
+    such a sum (e.g. the gate can't be built from its angle alone).
+    """
+    angles = [4 * math.pi * j / len(_ANGLE_FREQUENCIES)
+              for j in range(len(_ANGLE_FREQUENCIES))]
+    try:
+        samples = [numpy.array(type(gate)(a).matrix, dtype=complex)
+                   for a in angles]
+    except TypeError:
+        return None
+    terms = []
+    for f in _ANGLE_FREQUENCIES:
+        term = sum(cmath.exp(-1j * f * a) * m
+                   for a, m in zip(angles, samples)) / len(angles)
+        if numpy.max(numpy.abs(term)) > 1e-12:
+            terms.append((f, term))
+    value = sum(cmath.exp(1j * f * gate.angle) * t for f, t in terms)
+    if not terms or not numpy.allclose(value, gate.matrix):
+        return None
+    return terms
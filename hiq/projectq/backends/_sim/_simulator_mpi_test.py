@@ -30,8 +30,10 @@ from projectq import MainEngine
 from projectq.cengines import (BasicEngine, BasicMapperEngine, DummyEngine,
                                LocalOptimizer, NotYetMeasuredError)
 from projectq.ops import (All, Allocate, BasicGate, BasicMathGate, CNOT,
-                          Command, H, Measure, QubitOperator, Rx, Ry, Rz, S,
-                          TimeEvolution, Toffoli, X, Y, Z)
+                          Command, FlushGate, H, Measure, QubitOperator, Rx,
+                          Ry, Rz, S, Swap, TimeEvolution, Toffoli, X, Y, Z)
+from projectq.libs.math import (AddConstant, AddConstantModN,
+                                MultiplyByConstantModN)
 from projectq.meta import Control, Dagger, LogicalQubitIDTag
 from projectq.types import WeakQubitRef
 
@@ -138,10 +140,10 @@ class MockNoMatrixGate(BasicGate):
 #    for cmd in backend.received_commands:
 #        assert sim.is_available(cmd)
 #
-#    # check that SimulatorMPI doesn't support BasicMathGate
+#    # check that SimulatorMPI supports BasicMathGate
 #    BasicMathGate(lambda x: x) | qubit
 #    cmd = backend.received_commands[-1]
-#    assert not sim.is_available(cmd)
+#    assert sim.is_available(cmd)
 #
 #    new_cmd = backend.received_commands[-1]
 #
@@ -178,6 +180,13 @@ def test_simulator_cheat(sim):
     assert len(sim.cheat()[1]) == 2*np
     assert 1. == pytest.approx(abs(sim.cheat()[1][0]))
 
+    # the state vector may be gathered on one process only
+    id2pos, vec = sim.cheat_gather()
+    if MPI.COMM_WORLD.Get_rank() == 0:
+        assert numpy.allclose(vec, sim.cheat()[1])
+    else:
+        assert vec is None
+
     qubit[0].__del__()
     eng.flush()
 
@@ -187,6 +196,36 @@ def test_simulator_cheat(sim):
     assert len(sim.cheat()[1]) == np
 
 
+def test_simulator_cheat_local_view(sim):
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qureg = eng.allocate_qureg(4)
+    for i, qb in enumerate(qureg):
+        Ry(0.3 + 0.4 * i) | qb
+    eng.flush()
+    view = sim.cheat_local()[1]
+
+    # the view follows the state, which is updated in place
+    def check_updated(before):
+        assert numpy.shares_memory(view, sim.cheat_local()[1])
+        assert not numpy.allclose(view, before)
+
+    before = view.copy()
+    sim.apply_qubit_operator(QubitOperator('Z0 Y1'), qureg)
+    check_updated(before)
+
+    before = view.copy()
+    TimeEvolution(0.4, QubitOperator('X0 Z1')) | qureg
+    eng.flush()
+    check_updated(before)
+
+    before = view.copy()
+    Plus2Gate() | qureg[:2]
+    eng.flush()
+    check_updated(before)
+
+    All(Measure) | qureg
+
+
 def test_simulator_functional_measurement(sim):
     eng = HiQMainEngine(sim, [GreedyScheduler()])
     qubits = eng.allocate_qureg(5)
@@ -220,30 +259,83 @@ def test_simulator_measure_mapped_qubit(sim):
     assert int(qb2) == 1
 
 
-# class Plus2Gate(BasicMathGate):
-#     def __init__(self):
-#         BasicMathGate.__init__(self, lambda x: (x+2,))
-#
-#
-# def test_simulator_emulation(sim):
-#     eng = MainEngine(sim, [])
-#     qubit1 = eng.allocate_qubit()
-#     qubit2 = eng.allocate_qubit()
-#     qubit3 = eng.allocate_qubit()
-#
-#     with Control(eng, qubit3):
-#         Plus2Gate() | (qubit1 + qubit2)
-#
-#     assert 1. == pytest.approx(sim.cheat()[1][0])
-#
-#     X | qubit3
-#     with Control(eng, qubit3):
-#         Plus2Gate() | (qubit1 + qubit2)
-#     assert 1. == pytest.approx(sim.cheat()[1][6])
-#
-#     All(Measure) | (qubit1 + qubit2 + qubit3)
-#
-#
+def test_simulator_measure_and_deallocate(sim):
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    # enough qubits to fill the global ones, so that the new qubit is local
+    qubits = eng.allocate_qureg(8)
+    X | qubits[1]
+    eng.flush()
+    qb = WeakQubitRef(engine=eng, idx=100)
+    sim.receive([Command(engine=eng, gate=Allocate, qubits=([qb],))])
+    id2pos, wavefunction = sim.cheat()
+    assert 100 in id2pos
+    # the deallocation directly following the measurement is done with it
+    sim.receive([Command(engine=eng, gate=Measure, qubits=([qb],)),
+                 Command(engine=eng, gate=Deallocate, qubits=([qb],))])
+    assert int(qb) == 0
+    id2pos, new_wavefunction = sim.cheat()
+    assert 100 not in id2pos
+    assert len(new_wavefunction) == len(wavefunction) // 2
+    assert 1. == pytest.approx(abs(new_wavefunction[1 << id2pos[qubits[1].id]]))
+    All(Measure) | qubits
+
+
+class Plus2Gate(BasicMathGate):
+    def __init__(self):
+        BasicMathGate.__init__(self, lambda x: (x+2,))
+
+
+def test_simulator_emulation(sim):
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubit1 = eng.allocate_qubit()
+    qubit2 = eng.allocate_qubit()
+    qubit3 = eng.allocate_qubit()
+
+    with Control(eng, qubit3):
+        Plus2Gate() | (qubit1 + qubit2)
+    eng.flush()
+    id2pos, wavefunction = sim.cheat()
+    assert 1. == pytest.approx(wavefunction[0])
+
+    X | qubit3
+    with Control(eng, qubit3):
+        Plus2Gate() | (qubit1 + qubit2)
+    eng.flush()
+    id2pos, wavefunction = sim.cheat()
+    index = ((1 << id2pos[qubit2[0].id]) | (1 << id2pos[qubit3[0].id]))
+    assert 1. == pytest.approx(wavefunction[index])
+
+    All(Measure) | (qubit1 + qubit2 + qubit3)
+
+
+def test_simulator_native_math(sim):
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qureg = eng.allocate_qureg(4)
+    ctrl_qubit = eng.allocate_qubit()
+    X | qureg[0]
+    X | qureg[2]
+    H | ctrl_qubit
+    with Control(eng, ctrl_qubit):
+        MultiplyByConstantModN(3, 11) | qureg
+    AddConstantModN(7, 11) | qureg
+    AddConstant(-1) | qureg
+    eng.flush()
+    id2pos, wavefunction = sim.cheat()
+
+    def index(value, ctrl):
+        res = ctrl << id2pos[ctrl_qubit[0].id]
+        for i, qb in enumerate(qureg):
+            res |= ((value >> i) & 1) << id2pos[qb.id]
+        return res
+
+    # 5 -> 5 * 3 mod 11 = 4 only if the control is set, then + 7 mod 11 and
+    # - 1 modulo 2^4
+    assert 0.5 == pytest.approx(abs(wavefunction[index(15, 1)]) ** 2)
+    assert 0.5 == pytest.approx(abs(wavefunction[index(0, 0)]) ** 2)
+
+    All(Measure) | qureg + ctrl_qubit
+
+
 def test_simulator_kqubit_gate(sim):
     m1 = Rx(0.3).matrix
     m2 = Rx(0.8).matrix
@@ -339,6 +431,70 @@ def test_simulator_probability(sim, mapper):
     All(Measure) | qubits
 
 
+def test_simulator_marginal_distribution(sim, mapper):
+    engine_list = [LocalOptimizer()]
+    if mapper is not None:
+        engine_list.append(mapper)
+
+    engine_list.append(GreedyScheduler())
+    eng = HiQMainEngine(sim, engine_list=engine_list)
+    qubits = eng.allocate_qureg(6)
+    All(H) | qubits
+    Ry(2 * math.acos(math.sqrt(0.3))) | qubits[0]
+    Ry(2 * math.acos(math.sqrt(0.4))) | qubits[2]
+    eng.flush()
+    dist = eng.backend.get_marginal_distribution(qubits[:3:2])
+    assert dist == pytest.approx([0.12, 0.28, 0.18, 0.42])
+    probs = eng.backend.get_probabilities([[0, 0], [0, 1], '10'], qubits[:3:2])
+    assert probs == pytest.approx([0.12, 0.18, 0.28])
+    with pytest.raises(RuntimeError):
+        eng.backend.get_probabilities([[0]], qubits[:3:2])
+    All(Measure) | qubits
+
+
+def test_simulator_statistics(sim, mapper):
+    engine_list = [LocalOptimizer()]
+    if mapper is not None:
+        engine_list.append(mapper)
+
+    engine_list.append(GreedyScheduler())
+    eng = HiQMainEngine(sim, engine_list=engine_list)
+    qubits = eng.allocate_qureg(6)
+    Ry(2 * math.acos(math.sqrt(0.3))) | qubits[0]
+    X | qubits[2]
+    eng.flush()
+    stats = eng.backend.get_statistics(qubits, ['10', '01'], qubits[:3:2])
+    assert stats['norm'] == pytest.approx(1.)
+    assert stats['entropy'] == pytest.approx(
+        -0.3 * math.log(0.3, 2) - 0.7 * math.log(0.7, 2))
+    assert stats['entropy'] == pytest.approx(sim._simulator.entropy())
+    assert stats['qubit_probabilities'] == pytest.approx(
+        [0.7, 0., 1., 0., 0., 0.])
+    assert stats['probabilities'] == pytest.approx([0., 0.3])
+    All(Measure) | qubits
+
+
+def test_simulator_sample(sim, mapper):
+    engine_list = [LocalOptimizer()]
+    if mapper is not None:
+        engine_list.append(mapper)
+
+    engine_list.append(GreedyScheduler())
+    eng = HiQMainEngine(sim, engine_list=engine_list)
+    qubits = eng.allocate_qureg(6)
+    Ry(2 * math.acos(math.sqrt(0.3))) | qubits[0]
+    X | qubits[2]
+    eng.flush()
+    counts = eng.backend.sample(qubits[:3], 10000, seed=42)
+    assert set(counts.keys()) <= {'001', '101'}
+    assert sum(counts.values()) == 10000
+    assert counts['001'] / 10000. == pytest.approx(0.3, abs=0.03)
+    assert counts == eng.backend.sample(qubits[:3], 10000, seed=42)
+    # the state is not collapsed
+    assert eng.backend.get_probability([0], [qubits[0]]) == pytest.approx(0.3)
+    All(Measure) | qubits
+
+
 def test_simulator_amplitude(sim, mapper):
     engine_list = [LocalOptimizer()]
     if mapper is not None:
@@ -356,6 +512,10 @@ def test_simulator_amplitude(sim, mapper):
     assert eng.backend.get_amplitude(bits, qubits) == pytest.approx(-1. / 8.)
     bits = [0, 1, 1, 0, 1, 0]
     assert eng.backend.get_amplitude(bits, qubits) == pytest.approx(-1. / 8.)
+    amplitudes = eng.backend.get_amplitudes(
+        [[0, 0, 1, 0, 1, 0], '000010', '011010'], qubits)
+    assert isinstance(amplitudes, numpy.ndarray)
+    assert amplitudes == pytest.approx([1. / 8., -1. / 8., -1. / 8.])
     All(H) | qubits
     All(X) | qubits
     Ry(2 * math.acos(0.3)) | qubits[0]
@@ -379,191 +539,314 @@ def test_simulator_amplitude(sim, mapper):
         eng.backend.get_amplitude(bits, qubits)
 
 
-#def test_simulator_expectation(sim, mapper):
-#    engine_list = []
-#    if mapper is not None:
-#        engine_list.append(mapper)
-#    eng = MainEngine(sim, engine_list=engine_list)
-#    qureg = eng.allocate_qureg(3)
-#    op0 = QubitOperator('Z0')
-#    expectation = sim.get_expectation_value(op0, qureg)
-#    assert 1. == pytest.approx(expectation)
-#    X | qureg[0]
-#    expectation = sim.get_expectation_value(op0, qureg)
-#    assert -1. == pytest.approx(expectation)
-#    H | qureg[0]
-#    op1 = QubitOperator('X0')
-#    expectation = sim.get_expectation_value(op1, qureg)
-#    assert -1. == pytest.approx(expectation)
-#    Z | qureg[0]
-#    expectation = sim.get_expectation_value(op1, qureg)
-#    assert 1. == pytest.approx(expectation)
-#    X | qureg[0]
-#    S | qureg[0]
-#    Z | qureg[0]
-#    X | qureg[0]
-#    op2 = QubitOperator('Y0')
-#    expectation = sim.get_expectation_value(op2, qureg)
-#    assert 1. == pytest.approx(expectation)
-#    Z | qureg[0]
-#    expectation = sim.get_expectation_value(op2, qureg)
-#    assert -1. == pytest.approx(expectation)
-#
-#    op_sum = QubitOperator('Y0 X1 Z2') + QubitOperator('X1')
-#    H | qureg[1]
-#    X | qureg[2]
-#    expectation = sim.get_expectation_value(op_sum, qureg)
-#    assert 2. == pytest.approx(expectation)
-#
-#    op_sum = QubitOperator('Y0 X1 Z2') + QubitOperator('X1')
-#    X | qureg[2]
-#    expectation = sim.get_expectation_value(op_sum, qureg)
-#    assert 0. == pytest.approx(expectation)
-#
-#    op_id = .4 * QubitOperator(())
-#    expectation = sim.get_expectation_value(op_id, qureg)
-#    assert .4 == pytest.approx(expectation)
-#
-#
-#def test_simulator_expectation_exception(sim):
-#    eng = MainEngine(sim, [])
-#    qureg = eng.allocate_qureg(3)
-#    op = QubitOperator('Z2')
-#    sim.get_expectation_value(op, qureg)
-#    op2 = QubitOperator('Z3')
-#    with pytest.raises(Exception):
-#        sim.get_expectation_value(op2, qureg)
-#    op3 = QubitOperator('Z1') + QubitOperator('X1 Y3')
-#    with pytest.raises(Exception):
-#        sim.get_expectation_value(op3, qureg)
-
-
-#def test_simulator_applyqubitoperator_exception(sim):
-#    eng = MainEngine(sim, [])
-#    qureg = eng.allocate_qureg(3)
-#    op = QubitOperator('Z2')
-#    sim.apply_qubit_operator(op, qureg)
-#    op2 = QubitOperator('Z3')
-#    with pytest.raises(Exception):
-#        sim.apply_qubit_operator(op2, qureg)
-#    op3 = QubitOperator('Z1') + QubitOperator('X1 Y3')
-#    with pytest.raises(Exception):
-#        sim.apply_qubit_operator(op3, qureg)
-
-
-#def test_simulator_applyqubitoperator(sim, mapper):
-#    engine_list = []
-#    if mapper is not None:
-#        engine_list.append(mapper)
-#    eng = MainEngine(sim, engine_list=engine_list)
-#    qureg = eng.allocate_qureg(3)
-#    op = QubitOperator('X0 Y1 Z2')
-#    sim.apply_qubit_operator(op, qureg)
-#    X | qureg[0]
-#    Y | qureg[1]
-#    Z | qureg[2]
-#    assert sim.get_amplitude('000', qureg) == pytest.approx(1.)
-#
-#    H | qureg[0]
-#    op_H = 1. / math.sqrt(2.) * (QubitOperator('X0') + QubitOperator('Z0'))
-#    sim.apply_qubit_operator(op_H, [qureg[0]])
-#    assert sim.get_amplitude('000', qureg) == pytest.approx(1.)
-#
-#    op_Proj0 = 0.5 * (QubitOperator('') + QubitOperator('Z0'))
-#    op_Proj1 = 0.5 * (QubitOperator('') - QubitOperator('Z0'))
-#    H | qureg[0]
-#    sim.apply_qubit_operator(op_Proj0, [qureg[0]])
-#    assert sim.get_amplitude('000', qureg) == pytest.approx(1. / math.sqrt(2.))
-#    sim.apply_qubit_operator(op_Proj1, [qureg[0]])
-#    assert sim.get_amplitude('000', qureg) == pytest.approx(0.)
-
-
-#def test_simulator_time_evolution(sim):
-#    N = 8  # number of qubits
-#    time_to_evolve = 1.1  # time to evolve for
-#    eng = MainEngine(sim, [])
-#    qureg = eng.allocate_qureg(N)
-#    # initialize in random wavefunction by applying some gates:
-#    for qb in qureg:
-#        Rx(random.random()) | qb
-#        Ry(random.random()) | qb
-#    eng.flush()
-#    # Use cheat to get initial start wavefunction:
-#    qubit_to_bit_map, init_wavefunction = copy.deepcopy(eng.backend.cheat())
-#    Qop = QubitOperator
-#    op = 0.3 * Qop("X0 Y1 Z2 Y3 X4")
-#    op += 1.1 * Qop(())
-#    op += -1.4 * Qop("Y0 Z1 X3 Y5")
-#    op += -1.1 * Qop("Y1 X2 X3 Y4")
-#    ctrl_qubit = eng.allocate_qubit()
-#    H | ctrl_qubit
-#    with Control(eng, ctrl_qubit):
-#        TimeEvolution(time_to_evolve, op) | qureg
-#    eng.flush()
-#    qbit_to_bit_map, final_wavefunction = copy.deepcopy(eng.backend.cheat())
-#    All(Measure) | qureg + ctrl_qubit
-#    # Check manually:
-#
-#    def build_matrix(list_single_matrices):
-#        res = list_single_matrices[0]
-#        for i in range(1, len(list_single_matrices)):
-#            res = scipy.sparse.kron(res, list_single_matrices[i])
-#        return res
-#    id_sp = scipy.sparse.identity(2, format="csr", dtype=complex)
-#    x_sp = scipy.sparse.csr_matrix([[0., 1.], [1., 0.]], dtype=complex)
-#    y_sp = scipy.sparse.csr_matrix([[0., -1.j], [1.j, 0.]], dtype=complex)
-#    z_sp = scipy.sparse.csr_matrix([[1., 0.], [0., -1.]], dtype=complex)
-#    gates = [x_sp, y_sp, z_sp]
-#
-#    res_matrix = 0
-#    for t, c in op.terms.items():
-#        matrix = [id_sp] * N
-#        for idx, gate in t:
-#            matrix[qbit_to_bit_map[qureg[idx].id]] = gates[ord(gate) -
-#                                                           ord('X')]
-#        matrix.reverse()
-#        res_matrix += build_matrix(matrix) * c
-#    res_matrix *= -1j * time_to_evolve
-#
-#    init_wavefunction = numpy.array(init_wavefunction, copy=False)
-#    final_wavefunction = numpy.array(final_wavefunction, copy=False)
-#    res = scipy.sparse.linalg.expm_multiply(res_matrix, init_wavefunction)
-#
-#    half = int(len(final_wavefunction) / 2)
-#    hadamard_f = 1. / math.sqrt(2.)
-#    # check evolution and control
-#    assert numpy.allclose(hadamard_f * res, final_wavefunction[half:])
-#    assert numpy.allclose(final_wavefunction[:half], hadamard_f *
-#                          init_wavefunction)
-
-
-#def test_simulator_set_wavefunction(sim, mapper):
-#    engine_list = [LocalOptimizer()]
-#    if mapper is not None:
-#        engine_list.append(mapper)
-#    eng = MainEngine(sim, engine_list=engine_list)
-#    qubits = eng.allocate_qureg(2)
-#    wf = [0., 0., math.sqrt(0.2), math.sqrt(0.8)]
-#    with pytest.raises(RuntimeError):
-#        eng.backend.set_wavefunction(wf, qubits)
-#    eng.flush()
-#    eng.backend.set_wavefunction(wf, qubits)
-#    assert pytest.approx(eng.backend.get_probability('1', [qubits[0]])) == .8
-#    assert pytest.approx(eng.backend.get_probability('01', qubits)) == .2
-#    assert pytest.approx(eng.backend.get_probability('1', [qubits[1]])) == 1.
-#    All(Measure) | qubits
-
-
-#def test_simulator_set_wavefunction_always_complex(sim):
-#    """ Checks that wavefunction is always complex """
-#    eng = MainEngine(sim)
-#    qubit = eng.allocate_qubit()
-#    eng.flush()
-#    wf = [1., 0]
-#    eng.backend.set_wavefunction(wf, qubit)
-#    Y | qubit
-#    eng.flush()
-#    assert eng.backend.get_amplitude('1', qubit) == pytest.approx(1j)
+def test_simulator_expectation(sim, mapper):
+    engine_list = []
+    if mapper is not None:
+        engine_list.append(mapper)
+    engine_list.append(GreedyScheduler())
+    eng = HiQMainEngine(sim, engine_list=engine_list)
+    qureg = eng.allocate_qureg(3)
+    eng.flush()
+    op0 = QubitOperator('Z0')
+    expectation = sim.get_expectation_value(op0, qureg)
+    assert 1. == pytest.approx(expectation)
+    X | qureg[0]
+    eng.flush()
+    expectation = sim.get_expectation_value(op0, qureg)
+    assert -1. == pytest.approx(expectation)
+    H | qureg[0]
+    eng.flush()
+    op1 = QubitOperator('X0')
+    expectation = sim.get_expectation_value(op1, qureg)
+    assert -1. == pytest.approx(expectation)
+    Z | qureg[0]
+    eng.flush()
+    expectation = sim.get_expectation_value(op1, qureg)
+    assert 1. == pytest.approx(expectation)
+    X | qureg[0]
+    S | qureg[0]
+    Z | qureg[0]
+    X | qureg[0]
+    eng.flush()
+    op2 = QubitOperator('Y0')
+    expectation = sim.get_expectation_value(op2, qureg)
+    assert 1. == pytest.approx(expectation)
+    Z | qureg[0]
+    eng.flush()
+    expectation = sim.get_expectation_value(op2, qureg)
+    assert -1. == pytest.approx(expectation)
+
+    op_sum = QubitOperator('Y0 X1 Z2') + QubitOperator('X1')
+    H | qureg[1]
+    X | qureg[2]
+    eng.flush()
+    expectation = sim.get_expectation_value(op_sum, qureg)
+    assert 2. == pytest.approx(expectation)
+
+    op_sum = QubitOperator('Y0 X1 Z2') + QubitOperator('X1')
+    X | qureg[2]
+    eng.flush()
+    expectation = sim.get_expectation_value(op_sum, qureg)
+    assert 0. == pytest.approx(expectation)
+
+    op_id = .4 * QubitOperator(())
+    expectation = sim.get_expectation_value(op_id, qureg)
+    assert .4 == pytest.approx(expectation)
+    All(Measure) | qureg
+
+
+def test_simulator_expectation_exception(sim):
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qureg = eng.allocate_qureg(3)
+    eng.flush()
+    op = QubitOperator('Z2')
+    sim.get_expectation_value(op, qureg)
+    op2 = QubitOperator('Z3')
+    with pytest.raises(Exception):
+        sim.get_expectation_value(op2, qureg)
+    op3 = QubitOperator('Z1') + QubitOperator('X1 Y3')
+    with pytest.raises(Exception):
+        sim.get_expectation_value(op3, qureg)
+    All(Measure) | qureg
+
+
+def test_simulator_applyqubitoperator_exception(sim):
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qureg = eng.allocate_qureg(3)
+    eng.flush()
+    op = QubitOperator('Z2')
+    sim.apply_qubit_operator(op, qureg)
+    op2 = QubitOperator('Z3')
+    with pytest.raises(Exception):
+        sim.apply_qubit_operator(op2, qureg)
+    op3 = QubitOperator('Z1') + QubitOperator('X1 Y3')
+    with pytest.raises(Exception):
+        sim.apply_qubit_operator(op3, qureg)
+    All(Measure) | qureg
+
+
+def test_simulator_applyqubitoperator(sim, mapper):
+    engine_list = []
+    if mapper is not None:
+        engine_list.append(mapper)
+    engine_list.append(GreedyScheduler())
+    eng = HiQMainEngine(sim, engine_list=engine_list)
+    qureg = eng.allocate_qureg(3)
+    eng.flush()
+    op = QubitOperator('X0 Y1 Z2')
+    sim.apply_qubit_operator(op, qureg)
+    X | qureg[0]
+    Y | qureg[1]
+    Z | qureg[2]
+    eng.flush()
+    assert sim.get_amplitude('000', qureg) == pytest.approx(1.)
+
+    H | qureg[0]
+    eng.flush()
+    op_H = 1. / math.sqrt(2.) * (QubitOperator('X0') + QubitOperator('Z0'))
+    sim.apply_qubit_operator(op_H, [qureg[0]])
+    assert sim.get_amplitude('000', qureg) == pytest.approx(1.)
+
+    op_Proj0 = 0.5 * (QubitOperator('') + QubitOperator('Z0'))
+    op_Proj1 = 0.5 * (QubitOperator('') - QubitOperator('Z0'))
+    H | qureg[0]
+    eng.flush()
+    sim.apply_qubit_operator(op_Proj0, [qureg[0]])
+    assert sim.get_amplitude('000', qureg) == pytest.approx(1. / math.sqrt(2.))
+    sim.apply_qubit_operator(op_Proj1, [qureg[0]])
+    assert sim.get_amplitude('000', qureg) == pytest.approx(0.)
+    All(Measure) | qureg
+
+
+def test_simulator_time_evolution(sim):
+    N = 8  # number of qubits
+    time_to_evolve = 1.1  # time to evolve for
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qureg = eng.allocate_qureg(N)
+    ctrl_qubit = eng.allocate_qubit()
+    # initialize in random wavefunction by applying some gates:
+    for qb in qureg:
+        Rx(random.random()) | qb
+        Ry(random.random()) | qb
+    H | ctrl_qubit
+    eng.flush()
+    # Use cheat to get initial start wavefunction:
+    qubit_to_bit_map, init_wavefunction = copy.deepcopy(eng.backend.cheat())
+    Qop = QubitOperator
+    op = 0.3 * Qop("X0 Y1 Z2 Y3 X4")
+    op += 1.1 * Qop(())
+    op += -1.4 * Qop("Y0 Z1 X3 Y5")
+    op += -1.1 * Qop("Y1 X2 X3 Y4")
+    with Control(eng, ctrl_qubit):
+        TimeEvolution(time_to_evolve, op) | qureg
+    eng.flush()
+    qbit_to_bit_map, final_wavefunction = copy.deepcopy(eng.backend.cheat())
+    All(Measure) | qureg + ctrl_qubit
+    # Check manually:
+
+    def build_matrix(list_single_matrices):
+        res = list_single_matrices[0]
+        for i in range(1, len(list_single_matrices)):
+            res = scipy.sparse.kron(res, list_single_matrices[i])
+        return res
+    id_sp = scipy.sparse.identity(2, format="csr", dtype=complex)
+    x_sp = scipy.sparse.csr_matrix([[0., 1.], [1., 0.]], dtype=complex)
+    y_sp = scipy.sparse.csr_matrix([[0., -1.j], [1.j, 0.]], dtype=complex)
+    z_sp = scipy.sparse.csr_matrix([[1., 0.], [0., -1.]], dtype=complex)
+    gates = [x_sp, y_sp, z_sp]
+
+    num_bits = int(math.log(len(init_wavefunction), 2))
+    res_matrix = 0
+    for t, c in op.terms.items():
+        matrix = [id_sp] * num_bits
+        for idx, gate in t:
+            matrix[qbit_to_bit_map[qureg[idx].id]] = gates[ord(gate) -
+                                                           ord('X')]
+        matrix.reverse()
+        res_matrix += build_matrix(matrix) * c
+    res_matrix *= -1j * time_to_evolve
+
+    init_wavefunction = numpy.array(init_wavefunction, copy=False)
+    final_wavefunction = numpy.array(final_wavefunction, copy=False)
+    res = scipy.sparse.linalg.expm_multiply(res_matrix, init_wavefunction)
+
+    ctrl_bit = qbit_to_bit_map[ctrl_qubit[0].id]
+    controlled = (numpy.arange(len(final_wavefunction)) >> ctrl_bit) & 1 == 1
+    # check evolution and control
+    assert numpy.allclose(res[controlled], final_wavefunction[controlled])
+    assert numpy.allclose(init_wavefunction[~controlled],
+                          final_wavefunction[~controlled])
+
+
+def test_simulator_set_wavefunction(sim, mapper):
+    engine_list = [LocalOptimizer()]
+    if mapper is not None:
+        engine_list.append(mapper)
+
+    engine_list.append(GreedyScheduler())
+    eng = HiQMainEngine(sim, engine_list=engine_list)
+    qubits = eng.allocate_qureg(2)
+    wf = [0., 0., math.sqrt(0.2), math.sqrt(0.8)]
+    with pytest.raises(RuntimeError):
+        eng.backend.set_wavefunction(wf, qubits)
+    eng.flush()
+    eng.backend.set_wavefunction(wf, qubits)
+    assert pytest.approx(eng.backend.get_probability('1', [qubits[0]])) == .8
+    assert pytest.approx(eng.backend.get_probability('01', qubits)) == .2
+    assert pytest.approx(eng.backend.get_probability('1', [qubits[1]])) == 1.
+    All(Measure) | qubits
+
+
+def test_simulator_set_wavefunction_always_complex(sim):
+    """ Checks that wavefunction is always complex """
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubit = eng.allocate_qubit()
+    eng.flush()
+    wf = [1., 0]
+    eng.backend.set_wavefunction(wf, qubit)
+    Y | qubit
+    eng.flush()
+    assert eng.backend.get_amplitude('1', qubit) == pytest.approx(1j)
+
+
+def test_simulator_set_wavefunction_converted(sim):
+    """ Checks arrays which aren't C-contiguous complex128 """
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(6)
+    eng.flush()
+    rng = numpy.random.RandomState(5)
+    wf = rng.randn(1 << len(qubits)) + 1j * rng.randn(1 << len(qubits))
+    wf /= numpy.linalg.norm(wf)
+
+    strided = numpy.zeros(2 * len(wf), dtype=complex)
+    strided[::2] = wf
+    eng.backend.set_wavefunction(strided[::2], qubits)
+    assert numpy.allclose(_logical_state(eng.backend, qubits), wf)
+
+    eng.backend.set_wavefunction(wf.astype(numpy.complex64), qubits)
+    assert numpy.allclose(_logical_state(eng.backend, qubits), wf, atol=1e-6)
+
+    # amplitudes which can't be converted are rejected by every process
+    with pytest.raises((TypeError, ValueError)):
+        eng.backend.set_wavefunction(numpy.array(['a'] * len(wf)), qubits)
+    All(Measure) | qubits
+
+
+def test_simulator_set_wavefunction_rejected(sim, tmpdir):
+    """ Checks that a rejected wavefunction leaves the state untouched """
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(4)
+    H | qubits[0]
+    CNOT | (qubits[0], qubits[2])
+    Ry(0.7) | qubits[3]
+    eng.flush()
+    bit_strings = [format(i, '04b') for i in range(16)]
+    before = [eng.backend.get_amplitude(b, qubits) for b in bit_strings]
+
+    reordered = qubits[::-1]
+    with pytest.raises(RuntimeError):
+        eng.backend.set_wavefunction([1.] + [0.] * 7, reordered)
+    path = MPI.COMM_WORLD.bcast(str(tmpdir.join('short.bin')), root=0)
+    if MPI.COMM_WORLD.Get_rank() == 0:
+        numpy.zeros(8, dtype=complex).tofile(path)
+    MPI.COMM_WORLD.Barrier()
+    with pytest.raises(RuntimeError):
+        eng.backend.set_wavefunction(path, reordered)
+    with pytest.raises(RuntimeError):
+        eng.backend.set_basis_state('010', reordered)
+
+    after = [eng.backend.get_amplitude(b, qubits) for b in bit_strings]
+    assert numpy.allclose(before, after)
+    All(Measure) | qubits
+
+
+def test_simulator_initial_states(sim, tmpdir):
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(6)
+    eng.flush()
+
+    eng.backend.set_basis_state('010011', qubits)
+    assert eng.backend.get_probability('010011', qubits) == pytest.approx(1.)
+
+    eng.backend.set_uniform_superposition()
+    assert eng.backend.get_amplitude('110100', qubits) == pytest.approx(.125)
+
+    states = [(math.sqrt(.3), 1j * math.sqrt(.7))] * 6
+    eng.backend.set_product_state(states, qubits)
+    assert eng.backend.get_probability('1', [qubits[2]]) == pytest.approx(.7)
+    assert eng.backend.get_amplitude('100000', qubits) == pytest.approx(
+        1j * math.sqrt(.7) * math.sqrt(.3) ** 5)
+
+    wf = numpy.zeros(64, dtype=complex)
+    wf[5] = wf[40] = math.sqrt(.5)
+    path = MPI.COMM_WORLD.bcast(str(tmpdir.join('wf.bin')), root=0)
+    if MPI.COMM_WORLD.Get_rank() == 0:
+        wf.tofile(path)
+    MPI.COMM_WORLD.Barrier()
+    eng.backend.set_wavefunction(path, qubits)
+    assert eng.backend.get_probability('101000', qubits) == pytest.approx(.5)
+    assert eng.backend.get_probability('000101', qubits) == pytest.approx(.5)
+    All(Measure) | qubits
+
+
+def test_simulator_checkpoint(sim, tmpdir):
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(5)
+    H | qubits[0]
+    CNOT | (qubits[0], qubits[3])
+    Rx(0.3) | qubits[4]
+    eng.flush()
+    path = MPI.COMM_WORLD.bcast(str(tmpdir.join('checkpoint.bin')), root=0)
+    eng.backend.save_checkpoint(path)
+    amplitude = eng.backend.get_amplitude('10010', qubits)
+
+    All(X) | qubits
+    eng.flush()
+    assert eng.backend.get_amplitude('10010', qubits) == pytest.approx(0.)
+    eng.backend.load_checkpoint(path)
+    assert eng.backend.get_amplitude('10010', qubits) == pytest.approx(
+        amplitude)
+    All(Measure) | qubits
 
 
 def test_simulator_collapse_wavefunction(sim, mapper):
@@ -706,6 +989,443 @@ def test_simulator_functional_entangle(sim):
     All(Measure) | qubits
 
 
+def _logical_state(sim, qureg):
+    """ State vector of qureg, bit k of the index being qureg[k] """
+    id2pos, vec = sim.cheat()
+    index = numpy.arange(len(vec))
+    logical = numpy.zeros(len(vec), dtype=int)
+    for k, qb in enumerate(qureg):
+        logical |= ((index >> id2pos[qb.id]) & 1) << k
+    state = numpy.zeros(1 << len(qureg), dtype=complex)
+    state[logical] = vec
+    return state
+
+
+def _measure_then_gates(sim, num_qubits, steps):
+    """
+    Prepares an entangled state, then hands the backends of sim and of the
+    ProjectQ simulator the steps, which are ('measure', ids) or
+    (matrix, ids, ctrls), without running them in between: the projection of
+    a measurement is fused with the gates following it. steps is called with
+    the global and the local qubit ids. Returns both final states.
+    """
+    from projectq.backends import Simulator
+
+    def prepare(eng):
+        qubits = eng.allocate_qureg(num_qubits)
+        All(H) | qubits
+        for i in range(len(qubits) - 1):
+            CNOT | (qubits[i], qubits[i + 1])
+        for i, qb in enumerate(qubits):
+            Ry(0.2 + 0.1 * i) | qb
+        eng.flush()
+        return qubits
+
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    ref_eng = MainEngine(Simulator(), [])
+    qubits = prepare(eng)
+    ref_qubits = prepare(ref_eng)
+
+    backend = sim._simulator
+    ref = ref_eng.backend._simulator
+    global_ids = [i for i in backend.get_global_qubits_ids() if i >= 0]
+    local_ids = backend.get_local_qubits_ids()
+    for step in steps(global_ids, local_ids):
+        if step[0] == 'measure':
+            outcome = backend.measure_qubits(step[1])
+            ref.collapse_wavefunction(step[1], outcome)
+        elif step[0] == 'swap':
+            backend.swap_qubits(step[1])
+        else:
+            backend.apply_controlled_gate(step[0].tolist(), step[1], step[2])
+            ref.apply_controlled_gate(step[0].tolist(), step[1], step[2])
+    backend.run()
+    ref.run()
+
+    state = _logical_state(sim, qubits)
+    expected = _logical_state(ref_eng.backend, ref_qubits)
+    All(Measure) | qubits
+    eng.flush()
+    All(Measure) | ref_qubits
+    ref_eng.flush()
+    return state, expected
+
+
+def test_simulator_measurement_fused(sim):
+    def steps(global_ids, local_ids):
+        return [('measure', local_ids[:1]),
+                (Rx(0.7).matrix, local_ids[:1], []),
+                (X.matrix, local_ids[2:3], local_ids[1:2]),
+                (Rz(0.4).matrix, local_ids[3:4], [])]
+
+    state, expected = _measure_then_gates(sim, 8, steps)
+    assert numpy.allclose(state, expected)
+
+
+def test_simulator_measurement_fused_global_qubit():
+    from hiq.projectq.backends import SimulatorMPI
+    if MPI.COMM_WORLD.Get_size() == 1:
+        pytest.skip("a single process has no global qubits")
+
+    # the ranks which don't hold the outcome get a zero projector
+    def steps(global_ids, local_ids):
+        return [('measure', global_ids[:1]),
+                (Rx(0.7).matrix, local_ids[:1], []),
+                (Rz(0.4).matrix, global_ids[:1], local_ids[:1])]
+
+    state, expected = _measure_then_gates(SimulatorMPI(gate_fusion=True),
+                                          16, steps)
+    assert numpy.allclose(state, expected)
+
+
+def test_simulator_measurement_across_swap():
+    from hiq.projectq.backends import SimulatorMPI
+    if MPI.COMM_WORLD.Get_size() == 1:
+        pytest.skip("a single process has no global qubits to swap")
+
+    # the projection is kept for the gates after a swap which leaves the
+    # measured qubit in place, and run before one which moves it
+    def steps(global_ids, local_ids):
+        return [('measure', local_ids[:1]),
+                ('swap', [global_ids[0], local_ids[-1]]),
+                (Rx(0.7).matrix, [global_ids[0]], local_ids[:1]),
+                ('measure', local_ids[1:2]),
+                ('swap', [local_ids[-1], local_ids[1]]),
+                (Rx(0.3).matrix, local_ids[-1:], [])]
+
+    state, expected = _measure_then_gates(SimulatorMPI(gate_fusion=True),
+                                          16, steps)
+    assert numpy.allclose(state, expected)
+
+
+def test_simulator_measurement_wider_than_cluster():
+    from hiq.projectq.backends import SimulatorMPI
+
+    # the projection on more qubits than a cluster has its own pass
+    def steps(global_ids, local_ids):
+        return [('measure', local_ids[:3]),
+                (Rx(0.7).matrix, local_ids[3:4], [])]
+
+    state, expected = _measure_then_gates(
+        SimulatorMPI(gate_fusion=True, max_fused_qubits=2), 8, steps)
+    assert numpy.allclose(state, expected)
+
+
+def test_simulator_measurement_cluster_overflow():
+    from hiq.projectq.backends import SimulatorMPI
+
+    # the projection and the gate following it don't fit in one cluster, so
+    # the projection is run first
+    def steps(global_ids, local_ids):
+        return [('measure', local_ids[:2]),
+                (X.matrix, local_ids[3:4], local_ids[2:3]),
+                (Rx(0.7).matrix, local_ids[:1], [])]
+
+    state, expected = _measure_then_gates(
+        SimulatorMPI(gate_fusion=True, max_fused_qubits=3), 8, steps)
+    assert numpy.allclose(state, expected)
+
+
+def _run_during_swap(async_swap, apply_clusters):
+    """
+    Prepares an entangled state, swaps all global qubits and calls
+    apply_clusters(backend, global_ids, local_ids) before the swap is waited
+    for. Returns the final state and the number of overlapped clusters.
+    """
+    from hiq.projectq.backends import SimulatorMPI
+    sim = SimulatorMPI(gate_fusion=True, async_swap=async_swap)
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    # the local state vector is made of several swap chunks
+    qubits = eng.allocate_qureg(16)
+    # the global qubits have to be swapped in for the Hadamard gates
+    All(H) | qubits
+    for i in range(len(qubits) - 1):
+        CNOT | (qubits[i], qubits[i + 1])
+    All(Rz(0.3)) | qubits
+    eng.flush()
+
+    backend = sim._simulator
+    global_ids = [i for i in backend.get_global_qubits_ids() if i >= 0]
+    local_ids = backend.get_local_qubits_ids()
+    pairs = []
+    for i, qb_id in enumerate(global_ids):
+        pairs += [qb_id, local_ids[-1 - i]]
+    if async_swap:
+        backend.start_swap_qubits(pairs)
+    else:
+        backend.swap_qubits(pairs)
+    apply_clusters(backend, global_ids, local_ids)
+    backend.wait_swap_qubits()
+
+    state = _logical_state(sim, qubits)
+    overlapped = backend.get_overlapped_clusters()
+    All(Measure) | qubits
+    eng.flush()
+    return state, overlapped
+
+
+def test_simulator_async_swap():
+    if MPI.COMM_WORLD.Get_size() == 1:
+        pytest.skip("a single process has no global qubits to swap")
+
+    # single-qubit clusters on a qubit brought in by the swap and on the
+    # lowest local qubit are applied while the swap is pending
+    def apply_clusters(backend, global_ids, local_ids):
+        for qb_id in (global_ids[0], local_ids[0]):
+            backend.apply_controlled_gate(Rx(0.7).matrix.tolist(), [qb_id],
+                                          [])
+            backend.run()
+
+    state, overlapped = _run_during_swap(True, apply_clusters)
+    sync_state, sync_overlapped = _run_during_swap(False, apply_clusters)
+    assert overlapped >= 2
+    assert sync_overlapped == 0
+    assert numpy.allclose(state, sync_state)
+
+
+def test_simulator_async_swap_dense_cluster():
+    if MPI.COMM_WORLD.Get_size() == 1:
+        pytest.skip("a single process has no global qubits to swap")
+
+    rng = numpy.random.RandomState(11)
+    a = rng.randn(8, 8) + 1j * rng.randn(8, 8)
+    unitary = numpy.linalg.qr(a)[0]
+
+    # a dense 3-qubit cluster on a qubit brought in by the swap (an upper
+    # bit of the swap chunks) and on the two lowest local qubits
+    def apply_clusters(backend, global_ids, local_ids):
+        backend.apply_controlled_gate(unitary.tolist(),
+                                      [global_ids[0]] + local_ids[:2], [])
+        backend.run()
+
+    state, overlapped = _run_during_swap(True, apply_clusters)
+    sync_state, sync_overlapped = _run_during_swap(False, apply_clusters)
+    assert overlapped == 1
+    assert sync_overlapped == 0
+    assert numpy.allclose(state, sync_state)
+
+
+def test_simulator_memory_budget():
+    from hiq.projectq.backends import SimulatorMPI
+    sim = SimulatorMPI(memory_budget=1 << 20)
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(10)
+    H | qubits[0]
+    eng.flush()
+    with pytest.raises(RuntimeError):
+        eng.allocate_qureg(20)
+        eng.flush()
+
+
+def test_simulator_out_of_core(tmpdir):
+    from hiq.projectq.backends import SimulatorMPI
+    path = MPI.COMM_WORLD.bcast(str(tmpdir), root=0)
+    sim = SimulatorMPI(num_local_qubits=20, out_of_core_dir=path)
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(18)
+    All(H) | qubits
+    CNOT | (qubits[0], qubits[17])
+    eng.flush()
+    assert eng.backend.get_probability('1', [qubits[17]]) == pytest.approx(.5)
+    All(Measure) | qubits
+    eng.flush()
+
+    with pytest.raises(RuntimeError):
+        SimulatorMPI(out_of_core_dir=str(tmpdir.join('missing')))
+
+
+def test_simulator_out_of_core_per_simulator(tmpdir):
+    from hiq.projectq.backends import SimulatorMPI
+    try:
+        open('/proc/self/maps').close()
+    except IOError:
+        pytest.skip("needs /proc/self/maps")
+
+    def mapped_files(path):
+        with open('/proc/self/maps') as f:
+            return sum(1 for line in f if path in line)
+
+    path = MPI.COMM_WORLD.bcast(str(tmpdir), root=0)
+    sim = SimulatorMPI(num_local_qubits=20, out_of_core_dir=path)
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(18)
+    eng.flush()
+    assert mapped_files(path) > 0
+
+    # another simulator in memory leaves the first one on disk, also once
+    # emulate_math has replaced its state vector
+    other = SimulatorMPI(num_local_qubits=20)
+    other_eng = HiQMainEngine(other, [GreedyScheduler()])
+    other_qubits = other_eng.allocate_qureg(18)
+    other_eng.flush()
+    X | qubits[0]
+    AddConstant(3) | qubits[:4]
+    eng.flush()
+    assert mapped_files(path) > 0
+    assert sim.get_probability('0010', qubits[:4]) == pytest.approx(1.)
+    All(Measure) | qubits
+    All(Measure) | other_qubits
+    eng.flush()
+    other_eng.flush()
+
+
+def test_simulator_trace(tmpdir):
+    from hiq.projectq.backends import SimulatorMPI
+    path = MPI.COMM_WORLD.bcast(str(tmpdir.join('run.trace')), root=0)
+    sim = SimulatorMPI(trace=path)
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(4)
+    H | qubits[0]
+    CNOT | (qubits[0], qubits[3])
+    All(Measure) | qubits
+    eng.flush()
+    sim.stop_trace()
+    if MPI.COMM_WORLD.Get_rank() == 0:
+        with open(path, 'rb') as f:
+            assert f.read(8) == b'HiQTRCE\0'
+
+
+def test_simulator_execution_plan():
+    from hiq.projectq.backends import SimulatorMPI
+
+    def circuit(qubits, angles):
+        for qb, angle in zip(qubits, angles):
+            Rx(angle) | qb
+        for qb in qubits[1:]:
+            CNOT | (qubits[0], qb)
+        H | qubits[2]
+        Rz(angles[-1]) | qubits[4]
+        with Control(qubits[0].engine, qubits[1]):
+            Ry(angles[0]) | qubits[3]
+
+    def final_state(angles):
+        sim = SimulatorMPI(gate_fusion=True)
+        eng = HiQMainEngine(sim, [GreedyScheduler()])
+        qubits = eng.allocate_qureg(5)
+        circuit(qubits, angles)
+        eng.flush()
+        amplitudes = sim.get_amplitudes([format(i, '05b')[::-1]
+                                         for i in range(32)], qubits)
+        All(Measure) | qubits
+        return amplitudes
+
+    angles = [.1, .2, .3, .4, .5, .6]
+    sim = SimulatorMPI(gate_fusion=True)
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(5)
+    eng.flush()
+    sim.start_plan()
+    circuit(qubits, angles)
+    eng.flush()
+    plan = sim.stop_plan()
+    assert plan.parameters == pytest.approx(angles)
+
+    for new_angles in ([.7, -.1, 2., 0., 1.3, -2.5], angles):
+        sim.set_basis_state('00000', qubits)
+        sim.run_plan(plan, new_angles)
+        amplitudes = sim.get_amplitudes([format(i, '05b')[::-1]
+                                         for i in range(32)], qubits)
+        assert numpy.allclose(amplitudes, final_state(new_angles))
+
+    with pytest.raises(RuntimeError):
+        sim.run_plan(plan, angles[:2])
+    All(Measure) | qubits
+
+
+def test_simulator_execution_plan_constant_rotation():
+    from hiq.projectq.backends import SimulatorMPI
+    from projectq.ops import BasicRotationGate
+
+    class ScaledRx(BasicRotationGate):
+        # can't be rebuilt from its angle alone: recorded as a constant
+        def __init__(self, angle, scale):
+            BasicRotationGate.__init__(self, angle)
+            self.scale = scale
+
+        @property
+        def matrix(self):
+            return Rx(self.scale * self.angle).matrix
+
+    def circuit(qubits, angles):
+        Rx(angles[0]) | qubits[0]
+        ScaledRx(.2, 3.) | qubits[1]
+        Rz(angles[1]) | qubits[1]
+
+    sim = SimulatorMPI(gate_fusion=True)
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(2)
+    eng.flush()
+    sim.start_plan()
+    circuit(qubits, [.1, .3])
+    eng.flush()
+    plan = sim.stop_plan()
+    assert plan.parameters == pytest.approx([.1, .3])
+
+    sim.set_basis_state('00', qubits)
+    sim.run_plan(plan, [.5, -.4])
+    amplitudes = sim.get_amplitudes(['00', '10', '01', '11'], qubits)
+    sim.set_basis_state('00', qubits)
+    circuit(qubits, [.5, -.4])
+    eng.flush()
+    expected = sim.get_amplitudes(['00', '10', '01', '11'], qubits)
+    assert numpy.allclose(amplitudes, expected)
+    All(Measure) | qubits
+
+
+def test_simulator_global_qubits_swap_cost(sim):
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(5)
+    eng.flush()
+
+    cost = sim.get_global_qubits_swap_cost()
+    assert len(cost) == len(sim.get_global_qubits_ids())
+    assert all(c > 0 for c in cost)
+    assert cost == sorted(cost)
+    All(Measure) | qubits
+
+
+def test_simulator_global_qubits_swap_cost_relabeled(sim):
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(5)
+    for i, qb in enumerate(qubits):
+        Ry(0.3 + 0.4 * i) | qb
+    CNOT | (qubits[0], qubits[3])
+    eng.flush()
+    glob = sim.get_global_qubits_ids()
+    if len(glob) < 2:
+        pytest.skip("needs two global qubits")
+
+    def amplitudes():
+        return [sim.get_amplitude(format(i, '05b')[::-1], qubits)
+                for i in range(32)]
+
+    def apply(gate, qubit, ctrl=()):
+        # straight to the backend, so that the gate acts on the global qubits
+        cmd = Command(eng, gate, ([qubit],), controls=list(ctrl))
+        sim.receive([cmd, Command(eng, FlushGate(), ([qubit],))])
+
+    pos = [[qb.id for qb in qubits].index(i) for i in glob[:2]]
+    a, b = qubits[pos[0]], qubits[pos[1]]
+    cost = sim.get_global_qubits_swap_cost()
+    amps = amplitudes()
+
+    # the ranks are relabeled, so the costs follow the qubits
+    sim.receive([Command(eng, Swap, ([a], [b])),
+                 Command(eng, FlushGate(), ([a],))])
+    expected = [amps[i ^ ((i >> pos[0] ^ i >> pos[1]) & 1) *
+                     (1 << pos[0] | 1 << pos[1])] for i in range(32)]
+    assert numpy.allclose(amplitudes(), expected)
+    assert sim.get_global_qubits_swap_cost() == [cost[1], cost[0]] + cost[2:]
+
+    # a CNOT keeps the target's partners but mixes them into the control's
+    apply(X, b, [a])
+    expected = [expected[i ^ (i >> pos[0] & 1) << pos[1]] for i in range(32)]
+    assert numpy.allclose(amplitudes(), expected)
+    new_cost = sim.get_global_qubits_swap_cost()
+    assert new_cost[0] == max(cost) and new_cost[1] == cost[0]
+    All(Measure) | qubits
+
+
 def test_simulator_convert_logical_to_mapped_qubits(sim):
     mapper = BasicMapperEngine()
 
@@ -720,3 +1440,102 @@ def test_simulator_convert_logical_to_mapped_qubits(sim):
                               qubit1[0].id: qubit0[0].id}
     assert (sim._convert_logical_to_mapped_qureg(qubit0 + qubit1) ==
             qubit1 + qubit0)
+
+
+def test_greedy_scheduler_many_qubit_ids(sim):
+    # the ids of the ancillas keep growing past 64 while few are alive
+    eng = HiQMainEngine(sim, [GreedyScheduler()])
+    qubits = eng.allocate_qureg(3)
+    H | qubits[0]
+    for i in range(80):
+        ancilla = eng.allocate_qubit()
+        CNOT | (qubits[0], ancilla)
+        CNOT | (qubits[i % 2 + 1], ancilla)
+        CNOT | (qubits[0], ancilla)
+        CNOT | (qubits[i % 2 + 1], ancilla)
+        eng.flush()
+        last_id = ancilla[0].id
+        eng.deallocate_qubit(ancilla[0])
+    eng.flush()
+    assert last_id >= 64
+    assert sim.get_probability('1', [qubits[0]]) == pytest.approx(.5)
+    assert sim.get_probability('00', qubits[1:]) == pytest.approx(1.)
+    All(Measure) | qubits
+
+
+def test_greedy_scheduler_wide():
+    # 70 live qubits need more than 64 bits of mask
+    from hiq.projectq.cengines._sched_cpp import GreedyScheduler as Cpp
+
+    num_qubits, num_globals, cluster_size = 70, 4, 4
+    ids = [1000 + 3 * i for i in range(num_qubits)]
+    locals_ = ids[:num_qubits - num_globals]
+    globals_ = ids[num_qubits - num_globals:]
+    rnd = random.Random(5)
+    gates, ctrls, diags = [], [], []
+    for i in range(60):
+        qubits = rnd.sample(ids, 3)
+        gates.append(qubits[:1 + i % 2])
+        ctrls.append(qubits[2:] if i % 3 == 0 else [])
+        diags.append(i % 4 == 0)
+
+    scheduler = Cpp(1000, cluster_size)
+    scheduler.AddGates(gates, ctrls, diags, [False] * len(gates))
+    plan = scheduler.Schedule(locals_, globals_, [1.] * num_globals)
+
+    seen = [0] * len(gates)
+    for step in plan:
+        if step.type == Cpp.kPermute:
+            locals_ = list(step.data[:len(locals_)])
+            globals_ = list(step.data[len(locals_):])
+        elif step.type == Cpp.kSwap:
+            for g, l in zip(step.data[::2], step.data[1::2]):
+                i, j = globals_.index(g), locals_.index(l)
+                globals_[i], locals_[j] = l, g
+        else:
+            involved = set()
+            for i in step.data:
+                seen[i] += 1
+                for q in gates[i]:
+                    assert q in locals_ or diags[i]
+                involved.update(q for q in gates[i] + ctrls[i]
+                                if q in locals_)
+            assert len(involved) <= cluster_size or len(step.data) == 1
+    assert seen == [1] * len(gates)
+
+
+def test_greedy_scheduler_add_gates_lengths():
+    from hiq.projectq.cengines._sched_cpp import GreedyScheduler as Cpp
+
+    scheduler = Cpp(0, 4)
+    with pytest.raises(ValueError):
+        scheduler.AddGates([[0], [1]], [[]], [False, False], [False, False])
+    with pytest.raises(ValueError):
+        scheduler.AddGates([[0]], [[]], [False], [])
+
+
+def test_greedy_scheduler_state():
+    from hiq.projectq.backends import SimulatorMPI
+    from projectq.backends import Simulator
+
+    # with several processes, the gates on the global qubits make the
+    # scheduler swap them in
+    def run(eng):
+        qubits = eng.allocate_qureg(12)
+        rnd = random.Random(7)
+        for _ in range(80):
+            a, b = rnd.sample(range(len(qubits)), 2)
+            gate = rnd.choice([H, Rx(0.3), Ry(1.1), Rz(0.7), S])
+            gate | qubits[a]
+            if rnd.random() < .5:
+                CNOT | (qubits[a], qubits[b])
+        eng.flush()
+        state = _logical_state(eng.backend, qubits)
+        All(Measure) | qubits
+        eng.flush()
+        return state
+
+    state = run(HiQMainEngine(SimulatorMPI(gate_fusion=True),
+                              [GreedyScheduler()]))
+    expected = run(MainEngine(Simulator(), []))
+    assert numpy.allclose(state, expected)
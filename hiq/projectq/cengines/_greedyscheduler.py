@@ -14,11 +14,11 @@
 
 from projectq.cengines import BasicEngine
 from projectq.ops import AllocateQubitGate, FastForwardingGate, ZGate, Command, FlushGate, BasicGate, \
-    DeallocateQubitGate
+    DeallocateQubitGate, TimeEvolution, BasicMathGate
 from projectq.types import BasicQubit, WeakQubitRef
 
-from hiq.projectq.cengines import SwapScheduler, ClusterScheduler
-from hiq.projectq.ops import MetaSwap, AllocateQuregGate
+from hiq.projectq.cengines._sched_cpp import GreedyScheduler as _GreedySchedulerCpp
+from hiq.projectq.ops import MetaSwap, AllocateQuregGate, ParameterTag
 """
 Contains the projectq interface to a C++-based simulator, which has to be
 built first. If the c++ simulator is not exported to python, a (slow) python
@@ -79,7 +79,7 @@ class GreedyScheduler(BasicEngine):
         """
         BasicEngine.__init__(self)
         self._cmd_list = []
-        self._was_scheduling = False
+        self._scheduler = _GreedySchedulerCpp(num_splits, cluster_size)
         self._init = False
         self._supremacy_circuit = supremacy_circuit
         self.NUM_SPLITS = num_splits
@@ -90,64 +90,26 @@ class GreedyScheduler(BasicEngine):
         return BasicQubit(self.main_engine, id)
 
     def _cache_cmd(self, cmd):
+        # the angles of a recorded execution plan follow the order of the circuit, not the scheduled one
+        backend = self.main_engine.backend
+        if getattr(backend, 'recording_plan', False):
+            index = backend.next_plan_parameter(cmd.gate)
+            if index is not None:
+                cmd.tags.append(ParameterTag(index))
         self._cmd_list.append(cmd)
 
-    def _prepare_ctrlz(self):
-        local_qubits = self._get_local_ids_list_from_backend()
-        global_qubits = self._get_global_ids_list_from_backend()
-
-        for cmd in self._cmd_list:
-            if isinstance(cmd.gate, ZGate):
-                assert len(cmd.qubits) == 1 and len(cmd.qubits[0]) == 1
-                ctrls = cmd.control_qubits
-                other = cmd.qubits[0]
-
-                if other[0].id in global_qubits:
-                    for i in range(len(ctrls)):
-                        if ctrls[i].id in local_qubits:
-                            ctrls[i], other[0] = other[0], ctrls[i]
-                            break
-
-                cmd.qubits = (other,)
-                cmd.control_qubits = ctrls
-
-    def _get_commands(self):
-        return [[qubit.id for sublist in cmd.qubits for qubit in sublist] for cmd in self._cmd_list], \
-               [[qubit.id for qubit in cmd.control_qubits] for cmd in self._cmd_list], \
-               [cmd.gate.is_diagonal() for cmd in self._cmd_list]
-
-    def _call_cluster_scheduler(self):
-        self._prepare_ctrlz()
-        local_qubits = self._get_local_ids_list_from_backend()
-        global_qubits = self._get_global_ids_list_from_backend()
-        while True:
-            gate, gate_ctrl, gate_diag = self._get_commands()
-            cluster_scheduler = ClusterScheduler(gate, gate_ctrl, gate_diag, local_qubits, global_qubits,
-                                                 self.CLUSTER_SIZE)
-            avail = cluster_scheduler.ScheduleCluster()
-            if len(avail) == 0:
-                return
-            for i in avail:
-                self.send([self._cmd_list[i]])
-
-            self.send([Command(self, FlushGate(), ([WeakQubitRef(self, -1)],))])
-
-            for i in reversed(sorted(avail)):
-                del self._cmd_list[i]
-            # print("in", len(self._cmd_list))
-
-    def _get_ids_list_from_backend(self):
-        if hasattr(self.main_engine.backend, 'qubits_ids'):
-            return self.main_engine.backend.qubits_ids
-        else:
-            return self.main_engine.backend.get_qubits_ids()
-
     def _get_local_ids_list_from_backend(self):
         return self.main_engine.backend.get_local_qubits_ids()
 
     def _get_global_ids_list_from_backend(self):
         return self.main_engine.backend.get_global_qubits_ids()
 
+    def _get_swap_cost_from_backend(self):
+        backend = self.main_engine.backend
+        if not hasattr(backend, 'get_global_qubits_swap_cost'):
+            return []
+        return backend.get_global_qubits_swap_cost()
+
     def _remove_ending_cz(self):
         # print(len(self._cmd_list))
         i = len(self._cmd_list) - 1
@@ -172,33 +134,26 @@ class GreedyScheduler(BasicEngine):
             i -= 1
         # print(len(self._cmd_list))
 
-    def _call_swap_scheduler(self):
-        local_qubits = self._get_local_ids_list_from_backend()
-        gate, gate_ctrl, gate_diag = self._get_commands()
-        swap_scheduler = SwapScheduler(gate, gate_ctrl, gate_diag, self.NUM_SPLITS, len(local_qubits), True)
-        new_locals = swap_scheduler.ScheduleSwap()
-
-        if len(new_locals) == 0:
-            swap_scheduler = SwapScheduler(gate, gate_ctrl, gate_diag, self.NUM_SPLITS, len(local_qubits), False)
-            new_locals = swap_scheduler.ScheduleSwap()
-
-        g_to_l = sorted(list(set(new_locals) - set(local_qubits)))
-        l_to_g = []
-
-        if len(g_to_l) > 0:
-            lst = sorted(list(set(local_qubits) - set(new_locals)))
-            assert len(lst) >= len(g_to_l)
-            l_to_g = lst[:len(g_to_l)]
-
-        return g_to_l, l_to_g
-
     def _check_commands(self):
         locals_size = len(self._get_local_ids_list_from_backend())
-        for gate in self._get_commands()[0]:
-            if locals_size < len(gate):
-                raise Exception("Can't apply {}-qubits gate (only {} local qubits)".format(len(gate), locals_size))
-            if len(gate) > 5:
-                raise Exception("Can't apply {}-qubits gate (no more that 5 qubits allowed)".format(len(gate)))
+        for cmd in self._cmd_list:
+            size = sum(len(qureg) for qureg in cmd.qubits)
+            if locals_size < size:
+                raise Exception("Can't apply {}-qubits gate (only {} local qubits)".format(size, locals_size))
+            if size > 5:
+                raise Exception("Can't apply {}-qubits gate (no more that 5 qubits allowed)".format(size))
+
+    def _send_cluster(self, indices):
+        for i in indices:
+            cmd = self._cmd_list[i]
+            if isinstance(cmd.gate, ZGate):
+                # the scheduler may have exchanged the target with a local control
+                qubits = {qubit.id: qubit for qubit in list(cmd.qubits[0]) + list(cmd.control_qubits)}
+                cmd.qubits = ([qubits[id] for id in self._scheduler.GateIds(i)],)
+                cmd.control_qubits = [qubits[id] for id in self._scheduler.GateCtrl(i)]
+            self.send([cmd])
+
+        self.send([Command(self, FlushGate(), ([WeakQubitRef(self, -1)],))])
 
     def _force_scheduling(self):
         if len(self._cmd_list) == 0:
@@ -209,37 +164,25 @@ class GreedyScheduler(BasicEngine):
         if self._supremacy_circuit:
             self._remove_ending_cz()
 
-        if not self._was_scheduling:
-            self._was_scheduling = True
-            ids_list = self._get_ids_list_from_backend()
-            g_to_l, l_to_g = self._call_swap_scheduler()
-
-            for i in range(len(l_to_g)):
-                p1 = ids_list.index(g_to_l[i])
-                p2 = ids_list.index(l_to_g[i])
-                ids_list[p1], ids_list[p2] = ids_list[p2], ids_list[p1]
-
-            self.main_engine.backend.set_qubits_perm(ids_list)
-
-        self._call_cluster_scheduler()
-
-        while len(self._cmd_list) > 0:
-            g_to_l, l_to_g = self._call_swap_scheduler()
-            assert len(g_to_l) > 0
-
-            pairs = []
-            for i in range(len(g_to_l)):
-                q0 = self._from_id_to_qubit(l_to_g[i])
-                q1 = self._from_id_to_qubit(g_to_l[i])
-                pairs += [q1, q0]
-
-            new_cmd = MetaSwap.generate_command(pairs)
-            self.send([new_cmd])
-
-            self._call_cluster_scheduler()
-            # print("out", len(self._cmd_list))
+        # the whole swap and cluster plan is computed at once in C++
+        self._scheduler.AddGates([[qubit.id for qureg in cmd.qubits for qubit in qureg] for cmd in self._cmd_list],
+                                 [[qubit.id for qubit in cmd.control_qubits] for cmd in self._cmd_list],
+                                 [cmd.gate.is_diagonal() for cmd in self._cmd_list],
+                                 [isinstance(cmd.gate, ZGate) for cmd in self._cmd_list])
+        plan = self._scheduler.Schedule(self._get_local_ids_list_from_backend(),
+                                        self._get_global_ids_list_from_backend(),
+                                        self._get_swap_cost_from_backend())
+
+        for step in plan:
+            if step.type == _GreedySchedulerCpp.kPermute:
+                self.main_engine.backend.set_qubits_perm(step.data)
+            elif step.type == _GreedySchedulerCpp.kSwap:
+                pairs = [self._from_id_to_qubit(id) for id in step.data]
+                self.send([MetaSwap.generate_command(pairs)])
+            else:
+                self._send_cluster(step.data)
 
-        assert len(self._cmd_list) == 0
+        del self._cmd_list[:]
 
     def _send_deallocations(self):
         for c in sorted(self._deallocations_cache, key=lambda cmd: cmd.qubits[0][0].id, reverse=True):
@@ -254,7 +197,9 @@ class GreedyScheduler(BasicEngine):
         for cmd in command_list:
             if isinstance(cmd.gate, DeallocateQubitGate):
                 self._deallocations_cache.append(cmd)
-            elif isinstance(cmd.gate, (AllocateQubitGate, AllocateQuregGate, FastForwardingGate)):
+            elif isinstance(cmd.gate, (AllocateQubitGate, AllocateQuregGate, FastForwardingGate, TimeEvolution,
+                                       BasicMathGate)):
+                # the backend applies time evolutions and math gates on any qubits directly
                 self._force_scheduling()
                 self._send_deallocations()
                 self.send([cmd])
@@ -40,6 +40,23 @@ class AllocateQuregGate(ClassicalInstructionGate):
         return "AllocateQureg"
 
 
+class ParameterTag(object):
+    """
+    Tag of a rotation gate recorded in an execution plan (see
+    SimulatorMPI.start_plan()): index of the angle of the gate in the
+    parameters of the plan.
+    """
+
+    def __init__(self, index):
+        self.index = index
+
+    def __eq__(self, other):
+        return isinstance(other, ParameterTag) and self.index == other.index
+
+    def __ne__(self, other):
+        return not self.__eq__(other)
+
+
 def _hiq_add_cmd(resource_counter, cmd):
     """
     Add a gate to the count.
@@ -58,6 +58,7 @@ class CMakeBuild(build_ext):
     def build_extension(self, ext):
         extdir = os.path.abspath(os.path.dirname(self.get_ext_fullpath(ext.name)))
         cmake_args = ['-DCMAKE_LIBRARY_OUTPUT_DIRECTORY=' + extdir,
+                      '-DCMAKE_RUNTIME_OUTPUT_DIRECTORY=' + extdir,
                       '-DPYTHON_EXECUTABLE=' + sys.executable,
                       '-DBoost_NO_BOOST_CMAKE=ON',
                       '-DBUILD_TESTING=OFF',
@@ -106,6 +107,14 @@ scheduler = Feature(
     ext_modules=[CMakeExtension('_sched_cpp', 'hiq/projectq/cengines/_sched_cpp')]
 )
 
+# hiq-run and hiq-replay are built into hiq/bin of the package
+tools = Feature(
+    "Command-line tools running OpenQASM circuits and replaying traces",
+    standard=True,
+    ext_modules=[CMakeExtension('hiq-run', 'hiq/bin/hiq-run'),
+                 CMakeExtension('hiq-replay', 'hiq/bin/hiq-replay')]
+)
+
 
 if on_rtd:
     setup(
@@ -134,7 +143,8 @@ else:
         description='A high performance distributed quantum simulator',
         long_description=long_description,
         url="https://github.com/Huawei-HiQ/HiQsimulator",
-        features={'cppsim-mpi': cppsim_mpi, 'scheduler': scheduler, 'cppstabsim': cppstabsim},
+        features={'cppsim-mpi': cppsim_mpi, 'scheduler': scheduler, 'cppstabsim': cppstabsim,
+                  'tools': tools},
         install_requires=get_install_requires(),
         cmdclass=dict(build_ext=CMakeBuild),
         zip_safe=False,
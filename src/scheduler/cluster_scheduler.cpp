@@ -26,20 +26,48 @@ ClusterScheduler::ClusterScheduler(
     const std::vector<std::vector<id_num_t>>& gate_ctrl,
     std::vector<bool> gate_diag, const std::vector<id_num_t>& locals,
     const std::vector<id_num_t>& globals, const int cluster_size)
+{
+     CHECK(gate.size() == gate_ctrl.size() && gate.size() == gate_diag.size())
+         << "ctor():";
+     // the qubits no gate acts on can't change the clusters: they don't take
+     // up bits of the masks
+     std::vector<id_num_t> pos_to_id;
+     std::map<id_num_t, int> id_to_pos;
+     tie(pos_to_id, id_to_pos) = CalcPos(gate, gate_ctrl, {}, {});
+     impl_ = MakeMasked<Impl, ClusterSchedulerImpl>(
+         pos_to_id.size(), gate, gate_ctrl, std::move(gate_diag), locals,
+         globals, cluster_size, std::move(pos_to_id), std::move(id_to_pos));
+}
+
+ClusterScheduler::~ClusterScheduler()
+{}
+
+std::vector<int> ClusterScheduler::ScheduleCluster()
+{
+     return impl_->ScheduleCluster();
+}
+
+template <class Mask>
+ClusterSchedulerImpl<Mask>::ClusterSchedulerImpl(
+    const std::vector<std::vector<id_num_t>>& gate,
+    const std::vector<std::vector<id_num_t>>& gate_ctrl,
+    std::vector<bool> gate_diag, const std::vector<id_num_t>& locals,
+    const std::vector<id_num_t>& globals, const int cluster_size,
+    std::vector<id_num_t> pos_to_id, std::map<id_num_t, int> id_to_pos)
     : cluster_size_(cluster_size),
       best_ans_(0),
       best_cluster_(0),
-      gate_diag_(std::move(gate_diag))
+      gate_diag_(std::move(gate_diag)),
+      pos_to_id_(std::move(pos_to_id)),
+      id_to_pos_(std::move(id_to_pos))
 {
-     CHECK(gate.size() == gate_ctrl.size() && gate.size() == gate_diag_.size())
-         << "ctor():";
-     tie(pos_to_id_, id_to_pos_) = CalcPos(gate, gate_ctrl, locals, globals);
-     tie(gate_, gate_ctrl_) = CalcGates(gate, gate_ctrl, id_to_pos_);
-     locals_ = IdsToMsk(locals, id_to_pos_);
-     globals_ = IdsToMsk(globals, id_to_pos_);
+     tie(gate_, gate_ctrl_) = CalcGates<Mask>(gate, gate_ctrl, id_to_pos_);
+     locals_ = IdsToMsk<Mask>(locals, id_to_pos_);
+     globals_ = IdsToMsk<Mask>(globals, id_to_pos_);
 }
 
-std::vector<int> ClusterScheduler::ScheduleCluster()
+template <class Mask>
+std::vector<int> ClusterSchedulerImpl<Mask>::ScheduleCluster()
 {
      VLOG(3) << "ScheduleCluster(): started scheduling cluster: gates_no = "
              << gate_.size();
@@ -77,7 +105,8 @@ std::vector<int> ClusterScheduler::ScheduleCluster()
      return {};
 }
 
-void ClusterScheduler::Rec(msk_t cur_cluster, msk_t bit)
+template <class Mask>
+void ClusterSchedulerImpl<Mask>::Rec(Mask cur_cluster, Mask bit)
 {
      CalcCombination(cur_cluster);
 
@@ -92,8 +121,13 @@ void ClusterScheduler::Rec(msk_t cur_cluster, msk_t bit)
 
      if (submask(bit, locals_) && !inter(bit, cur_cluster)
          && count_bits(cur_cluster) < cluster_size_) {
-          Rec(unite(cur_cluster, bit), bit << 1UL);
+          Rec(unite(cur_cluster, bit), bit << 1);
      }
 
-     Rec(cur_cluster, bit << 1UL);
+     Rec(cur_cluster, bit << 1);
 }
+
+template class ClusterSchedulerImpl<msk_t>;
+template class ClusterSchedulerImpl<WideMask<2>>;
+template class ClusterSchedulerImpl<WideMask<4>>;
+template class ClusterSchedulerImpl<WideMask<16>>;
@@ -19,6 +19,7 @@
 
 #include <iostream>
 #include <map>
+#include <memory>
 #include <vector>
 
 #include "definitions.h"
@@ -53,32 +54,59 @@ public:
                       const std::vector<id_num_t>& globals, int cluster_size);
 
      //! Destructor
-     ~ClusterScheduler()
-     {}
+     ~ClusterScheduler();
+
+     // Interface of the implementations for the masks of every width
+     class Impl
+     {
+     public:
+          virtual ~Impl()
+          {}
+          virtual std::vector<int> ScheduleCluster() = 0;
+     };
+
+private:
+     std::unique_ptr<Impl> impl_;
+};
+
+// Implementation with qubit masks of type Mask (see MakeMasked())
+template <class Mask>
+class ClusterSchedulerImpl : public ClusterScheduler::Impl
+{
+public:
+     ClusterSchedulerImpl(const std::vector<std::vector<id_num_t>>& gate,
+                          const std::vector<std::vector<id_num_t>>& gate_ctrl,
+                          std::vector<bool> gate_diag,
+                          const std::vector<id_num_t>& locals,
+                          const std::vector<id_num_t>& globals,
+                          int cluster_size, std::vector<id_num_t> pos_to_id,
+                          std::map<id_num_t, int> id_to_pos);
+
+     std::vector<int> ScheduleCluster() override;
 
 private:
      const int cluster_size_;
      int best_ans_;
-     msk_t best_cluster_;
-     msk_t locals_;
-     msk_t globals_;
-     std::map<msk_t, msk_t> used_;
-     std::vector<msk_t> gate_, gate_ctrl_;
+     Mask best_cluster_;
+     Mask locals_;
+     Mask globals_;
+     std::map<Mask, Mask> used_;
+     std::vector<Mask> gate_, gate_ctrl_;
      std::vector<bool> gate_diag_;
      std::vector<id_num_t> pos_to_id_;
      std::map<id_num_t, int> id_to_pos_;
 
      // Generates qubits combinations, containing no more than ClusterSize
      // qubits
-     void Rec(msk_t cur_cluster, msk_t bit);
+     void Rec(Mask cur_cluster, Mask bit);
 
      // Tries to improve answer by given qubits combination
-     inline void CalcCombination(msk_t cur_cluster)
+     inline void CalcCombination(Mask cur_cluster)
      {
-          if (used_[cur_cluster] != 0) {
+          if (used_[cur_cluster] != Mask(0)) {
                return;
           }
-          msk_t cur_bad = 0;
+          Mask cur_bad = 0;
           int cur_ans = 0;
 
           for (int i = 0; i < static_cast<int>(gate_.size()); ++i) {
@@ -101,7 +129,7 @@ private:
      // Returns gates to be used in current cluster
      inline std::vector<int> GetComamndsFromMsk() const
      {
-          msk_t cur_bad = 0;
+          Mask cur_bad = 0;
 
           std::vector<int> ans;
           for (int i = 0; i < static_cast<int>(gate_.size()); ++i) {
@@ -121,7 +149,7 @@ private:
      // Returns huge gate to be used in current cluster if possible
      inline std::vector<int> GetCommandsFromLocals() const
      {
-          msk_t cur_bad = 0;
+          Mask cur_bad = 0;
 
           for (int i = 0; i < static_cast<int>(gate_.size()); ++i) {
                if (CanTake(i, locals_, cur_bad)) {
@@ -144,10 +172,10 @@ private:
      }
 
      // Determines if is it possible to apply pos-th gate in given situation.
-     inline bool CanTake(const int pos, const msk_t cur_cluster,
-                         const msk_t cur_bad) const
+     inline bool CanTake(const int pos, const Mask cur_cluster,
+                         const Mask cur_bad) const
      {
-          msk_t gate_all = unite(gate_ctrl_[pos], gate_[pos]);
+          Mask gate_all = unite(gate_ctrl_[pos], gate_[pos]);
           if (inter(gate_all, cur_bad)
               || !submask(inter(gate_all, locals_), cur_cluster)) {
                return false;
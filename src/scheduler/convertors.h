@@ -16,25 +16,91 @@
 #define SCHEDULER_FUNCS_H
 
 #include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include "definitions.h"
 
-std::vector<id_num_t> MskToIds(msk_t msk,
-                               const std::vector<id_num_t> &pos_to_id);
+template <class Mask>
+std::vector<id_num_t> MskToIds(const Mask &msk,
+                               const std::vector<id_num_t> &pos_to_id)
+{
+     std::vector<id_num_t> ans;
+     for (size_t i = 0; i < pos_to_id.size(); ++i) {
+          if (test_bit(msk, i)) {
+               ans.push_back(pos_to_id[i]);
+          }
+     }
 
-msk_t IdsToMsk(const std::vector<id_num_t> &vec,
-               const std::map<id_num_t, int> &id_to_pos);
+     return ans;
+}
 
+// The IDs which have no position are left out.
+template <class Mask>
+Mask IdsToMsk(const std::vector<id_num_t> &vec,
+              const std::map<id_num_t, int> &id_to_pos)
+{
+     Mask msk = 0;
+     for (id_num_t i: vec) {
+          auto it = id_to_pos.find(i);
+          if (it != id_to_pos.end()) {
+               set_bit(msk, it->second);
+          }
+     }
+     return msk;
+}
+
+// Gives positions (bits of the masks) to the qubits of the gates, locals and
+// globals in increasing order of ID.
 std::tuple<std::vector<id_num_t>, std::map<id_num_t, int>> CalcPos(
     const std::vector<std::vector<id_num_t>> &gate,
     const std::vector<std::vector<id_num_t>> &gate_ctrl,
     const std::vector<id_num_t> &locals, const std::vector<id_num_t> &globals);
 
-std::tuple<std::vector<msk_t>, std::vector<msk_t>> CalcGates(
+template <class Mask>
+std::tuple<std::vector<Mask>, std::vector<Mask>> CalcGates(
     const std::vector<std::vector<id_num_t>> &gate,
     const std::vector<std::vector<id_num_t>> &gate_ctrl,
-    const std::map<id_num_t, int> &id_to_pos);
+    const std::map<id_num_t, int> &id_to_pos)
+{
+     std::vector<Mask> gate_new(gate.size());
+     std::vector<Mask> gate_ctrl_new(gate.size());
+
+     for (size_t i = 0; i < gate.size(); ++i) {
+          gate_new[i] = IdsToMsk<Mask>(gate[i], id_to_pos);
+          gate_ctrl_new[i] = IdsToMsk<Mask>(gate_ctrl[i], id_to_pos);
+     }
+
+     return std::make_tuple(gate_new, gate_ctrl_new);
+}
+
+// Returns a new Impl<Mask>(args...) as a Base, Mask being the narrowest mask
+// with more bits than num_pos (uint64_t in the common case).
+template <class Base, template <class> class Impl, class... Args>
+std::unique_ptr<Base> MakeMasked(size_t num_pos, Args &&... args)
+{
+     if (num_pos < 64) {
+          return std::unique_ptr<Base>(
+              new Impl<msk_t>(std::forward<Args>(args)...));
+     }
+     if (num_pos < 128) {
+          return std::unique_ptr<Base>(
+              new Impl<WideMask<2>>(std::forward<Args>(args)...));
+     }
+     if (num_pos < 256) {
+          return std::unique_ptr<Base>(
+              new Impl<WideMask<4>>(std::forward<Args>(args)...));
+     }
+     if (num_pos < 1024) {
+          return std::unique_ptr<Base>(
+              new Impl<WideMask<16>>(std::forward<Args>(args)...));
+     }
+     throw std::runtime_error("MakeMasked(): can't schedule gates on "
+                              + std::to_string(num_pos) + " qubits");
+}
 
 #endif  // SCHEDULER_FUNCS_H
@@ -15,7 +15,9 @@
 #ifndef SCHEDULER_DEFS_H
 #define SCHEDULER_DEFS_H
 
+#include <cstddef>
 #include <cstdint>
+#include <ostream>
 #ifdef _MSC_VER
 #     include <intrin.h>
 #     define __builtin_popcountll __popcnt64
@@ -24,11 +26,162 @@
 typedef uint64_t msk_t;
 typedef int64_t id_num_t;
 
-#define set_bit(x, y) (x |= static_cast<msk_t>(1) << static_cast<msk_t>(y))
-#define test_bit(x, y) ((x >> y) & 1UL)
-#define count_bits(x) (__builtin_popcountll(static_cast<uint64_t>(x)))
-#define inter(x, y) (x & y)
-#define unite(x, y) (x | y)
-#define submask(x, y) (!(x & ~y))
+// Mask of W * 64 bits with the operations of an unsigned integer used by the
+// schedulers, for the scheduling of gates on 64 or more qubits
+template <int W>
+class WideMask
+{
+public:
+     WideMask(uint64_t x = 0) : w_{x}
+     {}
+
+     friend WideMask operator&(WideMask x, const WideMask& y)
+     {
+          for (int i = 0; i < W; ++i) {
+               x.w_[i] &= y.w_[i];
+          }
+          return x;
+     }
+     friend WideMask operator|(WideMask x, const WideMask& y)
+     {
+          for (int i = 0; i < W; ++i) {
+               x.w_[i] |= y.w_[i];
+          }
+          return x;
+     }
+     friend WideMask operator^(WideMask x, const WideMask& y)
+     {
+          for (int i = 0; i < W; ++i) {
+               x.w_[i] ^= y.w_[i];
+          }
+          return x;
+     }
+     WideMask operator~() const
+     {
+          WideMask x;
+          for (int i = 0; i < W; ++i) {
+               x.w_[i] = ~w_[i];
+          }
+          return x;
+     }
+     WideMask& operator|=(const WideMask& y)
+     {
+          return *this = *this | y;
+     }
+     WideMask& operator^=(const WideMask& y)
+     {
+          return *this = *this ^ y;
+     }
+     WideMask operator<<(size_t n) const
+     {
+          WideMask x;
+          const size_t words = n / 64, bits = n % 64;
+          for (size_t i = W; i-- > words;) {
+               x.w_[i] = w_[i - words] << bits;
+               if (bits && i > words) {
+                    x.w_[i] |= w_[i - words - 1] >> (64 - bits);
+               }
+          }
+          return x;
+     }
+     WideMask operator>>(size_t n) const
+     {
+          WideMask x;
+          const size_t words = n / 64, bits = n % 64;
+          for (size_t i = 0; i + words < W; ++i) {
+               x.w_[i] = w_[i + words] >> bits;
+               if (bits && i + words + 1 < W) {
+                    x.w_[i] |= w_[i + words + 1] << (64 - bits);
+               }
+          }
+          return x;
+     }
+     friend bool operator<(const WideMask& x, const WideMask& y)
+     {
+          for (int i = W - 1; i >= 0; --i) {
+               if (x.w_[i] != y.w_[i]) {
+                    return x.w_[i] < y.w_[i];
+               }
+          }
+          return false;
+     }
+     friend bool operator>(const WideMask& x, const WideMask& y)
+     {
+          return y < x;
+     }
+     friend bool operator==(const WideMask& x, const WideMask& y)
+     {
+          for (int i = 0; i < W; ++i) {
+               if (x.w_[i] != y.w_[i]) {
+                    return false;
+               }
+          }
+          return true;
+     }
+     friend bool operator!=(const WideMask& x, const WideMask& y)
+     {
+          return !(x == y);
+     }
+     explicit operator bool() const
+     {
+          return *this != WideMask();
+     }
+     bool operator!() const
+     {
+          return *this == WideMask();
+     }
+
+     friend int count_bits(const WideMask& x)
+     {
+          int n = 0;
+          for (int i = 0; i < W; ++i) {
+               n += __builtin_popcountll(x.w_[i]);
+          }
+          return n;
+     }
+     friend bool test_bit(const WideMask& x, size_t y)
+     {
+          return (x.w_[y / 64] >> (y % 64)) & 1UL;
+     }
+     friend std::ostream& operator<<(std::ostream& out, const WideMask& x)
+     {
+          for (int i = W - 1; i >= 0; --i) {
+               out << (i == W - 1 ? "" : ":") << x.w_[i];
+          }
+          return out;
+     }
+
+private:
+     uint64_t w_[W];
+};
+
+inline int count_bits(uint64_t x)
+{
+     return __builtin_popcountll(x);
+}
+inline bool test_bit(uint64_t x, size_t y)
+{
+     return (x >> y) & 1UL;
+}
+template <class Mask>
+inline void set_bit(Mask& x, size_t y)
+{
+     x |= Mask(1) << y;
+}
+template <class Mask>
+inline Mask inter(const Mask& x, const Mask& y)
+{
+     return x & y;
+}
+template <class Mask>
+inline Mask unite(const Mask& x, const Mask& y)
+{
+     return x | y;
+}
+template <class Mask>
+inline bool submask(const Mask& x, const Mask& y)
+{
+     return !(x & ~y);
+}
 
 #endif  // SCHEDULER_DEFS_H
@@ -0,0 +1,239 @@
+//   Copyright 2019 <Huawei Technologies Co., Ltd>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "greedy_scheduler.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+#include "cluster_scheduler.h"
+#include "swap_scheduler.h"
+
+GreedyScheduler::GreedyScheduler(const int num_splits, const int cluster_size)
+    : num_splits_(num_splits),
+      cluster_size_(cluster_size),
+      scheduled_(false),
+      was_scheduling_(false)
+{}
+
+int GreedyScheduler::AddGate(std::vector<id_num_t> ids,
+                             std::vector<id_num_t> ctrl, bool diag,
+                             bool symmetric)
+{
+     if (scheduled_) {
+          Clear();
+          scheduled_ = false;
+     }
+     gate_.push_back(std::move(ids));
+     gate_ctrl_.push_back(std::move(ctrl));
+     gate_diag_.push_back(diag);
+     gate_symmetric_.push_back(symmetric && gate_.back().size() == 1);
+     return static_cast<int>(gate_.size()) - 1;
+}
+
+std::vector<GreedyScheduler::Step> GreedyScheduler::Schedule(
+    std::vector<id_num_t> locals, std::vector<id_num_t> globals,
+    const std::vector<double>& swap_cost)
+{
+     std::vector<Step> plan;
+     if (scheduled_) {
+          Clear();
+     }
+     scheduled_ = true;
+     if (gate_.empty()) {
+          return plan;
+     }
+
+     for (auto& ids: gate_) {
+          if (ids.size() > locals.size()) {
+               throw std::runtime_error(
+                   "Schedule(): can't apply " + std::to_string(ids.size())
+                   + "-qubits gate (only " + std::to_string(locals.size())
+                   + " local qubits)");
+          }
+          if (ids.size() > 5) {
+               throw std::runtime_error(
+                   "Schedule(): can't apply " + std::to_string(ids.size())
+                   + "-qubits gate (no more that 5 qubits allowed)");
+          }
+     }
+
+     pending_.resize(gate_.size());
+     std::iota(pending_.begin(), pending_.end(), 0);
+
+     // a swap of global qubits with local ones follows the pairs
+     auto swap = [&locals, &globals](const std::vector<id_num_t>& pairs) {
+          for (size_t i = 0; i < pairs.size(); i += 2) {
+               auto g = std::find(globals.begin(), globals.end(), pairs[i]);
+               auto l = std::find(locals.begin(), locals.end(), pairs[i + 1]);
+               CHECK(g != globals.end() && l != locals.end())
+                   << "Schedule(): Internal error: invalid swap pair";
+               std::swap(*g, *l);
+          }
+     };
+
+     if (!was_scheduling_) {
+          was_scheduling_ = true;
+          auto pairs = NextSwap(locals, globals, swap_cost);
+          if (!pairs.empty()) {
+               swap(pairs);
+               Step step{kPermute, locals};
+               step.data.insert(step.data.end(), globals.begin(),
+                                globals.end());
+               plan.push_back(std::move(step));
+          }
+     }
+
+     ScheduleClusters(locals, globals, plan);
+     while (!pending_.empty()) {
+          auto pairs = NextSwap(locals, globals, swap_cost);
+          CHECK(!pairs.empty())
+              << "Schedule(): Internal error: no qubits to swap; "
+              << pending_.size() << " gates left";
+          swap(pairs);
+          plan.push_back(Step{kSwap, std::move(pairs)});
+          ScheduleClusters(locals, globals, plan);
+     }
+
+     VLOG(1) << "Schedule(): " << gate_.size() << " gates in " << plan.size()
+             << " steps";
+     return plan;
+}
+
+std::vector<id_num_t> GreedyScheduler::NextSwap(
+    const std::vector<id_num_t>& locals, const std::vector<id_num_t>& globals,
+    const std::vector<double>& swap_cost)
+{
+     std::vector<std::vector<id_num_t>> gate, gate_ctrl;
+     std::vector<bool> gate_diag;
+     for (int i: pending_) {
+          gate.push_back(gate_[i]);
+          gate_ctrl.push_back(gate_ctrl_[i]);
+          gate_diag.push_back(gate_diag_[i]);
+     }
+     std::map<id_num_t, double> cost;
+     for (size_t i = 0; i < swap_cost.size() && i < globals.size(); ++i) {
+          if (globals[i] != -1) {
+               cost[globals[i]] = swap_cost[i];
+          }
+     }
+
+     const int num_locals = static_cast<int>(locals.size());
+     auto new_locals = SwapScheduler(gate, gate_ctrl, gate_diag, num_splits_,
+                                     num_locals, true, cost)
+                           .ScheduleSwap();
+     if (new_locals.empty()) {
+          new_locals = SwapScheduler(gate, gate_ctrl, gate_diag, num_splits_,
+                                     num_locals, false, cost)
+                           .ScheduleSwap();
+     }
+
+     std::vector<id_num_t> sorted_locals(locals);
+     std::sort(sorted_locals.begin(), sorted_locals.end());
+     std::sort(new_locals.begin(), new_locals.end());
+     std::vector<id_num_t> g_to_l, l_to_g;
+     std::set_difference(new_locals.begin(), new_locals.end(),
+                         sorted_locals.begin(), sorted_locals.end(),
+                         std::back_inserter(g_to_l));
+     std::set_difference(sorted_locals.begin(), sorted_locals.end(),
+                         new_locals.begin(), new_locals.end(),
+                         std::back_inserter(l_to_g));
+     CHECK(l_to_g.size() >= g_to_l.size())
+         << "NextSwap(): Internal error: too many new local qubits";
+
+     std::vector<id_num_t> pairs;
+     for (size_t i = 0; i < g_to_l.size(); ++i) {
+          pairs.push_back(g_to_l[i]);
+          pairs.push_back(l_to_g[i]);
+     }
+     return pairs;
+}
+
+void GreedyScheduler::ScheduleClusters(const std::vector<id_num_t>& locals,
+                                       const std::vector<id_num_t>& globals,
+                                       std::vector<Step>& plan)
+{
+     PrepareSymmetric(locals, globals);
+
+     std::vector<id_num_t> used_globals;
+     std::copy_if(globals.begin(), globals.end(),
+                  std::back_inserter(used_globals),
+                  [](id_num_t id) { return id != -1; });
+
+     while (true) {
+          std::vector<std::vector<id_num_t>> gate, gate_ctrl;
+          std::vector<bool> gate_diag;
+          for (int i: pending_) {
+               gate.push_back(gate_[i]);
+               gate_ctrl.push_back(gate_ctrl_[i]);
+               gate_diag.push_back(gate_diag_[i]);
+          }
+          auto avail = ClusterScheduler(gate, gate_ctrl, gate_diag, locals,
+                                        used_globals, cluster_size_)
+                           .ScheduleCluster();
+          if (avail.empty()) {
+               return;
+          }
+
+          Step step{kCluster, {}};
+          std::vector<bool> taken(pending_.size(), false);
+          for (int i: avail) {
+               step.data.push_back(pending_[i]);
+               taken[i] = true;
+          }
+          plan.push_back(std::move(step));
+
+          size_t j = 0;
+          for (size_t i = 0; i < pending_.size(); ++i) {
+               if (!taken[i]) {
+                    pending_[j++] = pending_[i];
+               }
+          }
+          pending_.resize(j);
+     }
+}
+
+void GreedyScheduler::Clear()
+{
+     gate_.clear();
+     gate_ctrl_.clear();
+     gate_diag_.clear();
+     gate_symmetric_.clear();
+}
+
+void GreedyScheduler::PrepareSymmetric(const std::vector<id_num_t>& locals,
+                                       const std::vector<id_num_t>& globals)
+{
+     auto contains = [](const std::vector<id_num_t>& v, id_num_t id) {
+          return std::find(v.begin(), v.end(), id) != v.end();
+     };
+
+     for (int i: pending_) {
+          if (!gate_symmetric_[i] || !contains(globals, gate_[i][0])) {
+               continue;
+          }
+          for (auto& ctrl: gate_ctrl_[i]) {
+               if (contains(locals, ctrl)) {
+                    std::swap(ctrl, gate_[i][0]);
+                    break;
+               }
+          }
+     }
+}
@@ -0,0 +1,128 @@
+//   Copyright 2019 <Huawei Technologies Co., Ltd>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef SCHEDULER_GREEDY_SCHEDULER_H
+#define SCHEDULER_GREEDY_SCHEDULER_H
+
+#include <vector>
+
+#include "definitions.h"
+
+class GreedyScheduler
+{
+public:
+     // Same algorithm as the GreedyScheduler engine in Python: the gates are
+     // split into stages by SwapScheduler and every stage into clusters by
+     // ClusterScheduler, the qubit permutation being tracked in between.
+
+     //! Kind of a step of the plan returned by Schedule()
+     enum StepType
+     {
+          //! Set the permutation of all qubits to data (locals, then globals)
+          //! without moving the state vector
+          kPermute,
+          //! Swap global and local qubits, data holds the (global, local) pairs
+          kSwap,
+          //! Apply the gates whose indices are in data, then run them
+          kCluster
+     };
+
+     struct Step
+     {
+          StepType type;
+          std::vector<id_num_t> data;
+     };
+
+     //! Constructor
+     /*!
+      * \param num_splits Number of branch splits of SwapScheduler
+      * \param cluster_size Maximum number of qubits in fused multi-qubit gate
+      */
+     GreedyScheduler(int num_splits, int cluster_size);
+
+     //! Add a gate to the ones to schedule
+     /*!
+      * \param ids Qubits on which the gate acts
+      * \param ctrl Control qubits of the gate
+      * \param diag **true** if the gate is diagonal
+      * \param symmetric **true** if the gate has a single target which may be
+               exchanged with any of its controls (e.g. a controlled Z or phase
+               gate), so that it can act on a local qubit
+      * \return Index of the gate
+      */
+     int AddGate(std::vector<id_num_t> ids, std::vector<id_num_t> ctrl,
+                 bool diag, bool symmetric);
+
+     //! Schedule all gates added since the previous call
+     /*!
+      * \brief The first call which has gates starts with a kPermute step (as
+               the qubits may then be relabeled for free, they all have to be
+               in the same state, e.g. just allocated).
+      * \param locals Local qubits, see
+               SimulatorMPI::GetLocalQubitsPermutation()
+      * \param globals Global qubits, see
+               SimulatorMPI::GetGlobalQubitsPermutation()
+      * \param swap_cost Cost of each global qubit in the order of globals
+               (e.g. from SimulatorMPI::GetGlobalQubitsSwapCost()), may be empty
+      * \return Steps to execute in order
+      * \throw std::runtime_error if a gate acts on more qubits than can be
+               local or than 5
+      */
+     std::vector<Step> Schedule(std::vector<id_num_t> locals,
+                                std::vector<id_num_t> globals,
+                                const std::vector<double>& swap_cost);
+
+     //! Qubits of a gate, in which a symmetric gate may have had its target
+     //! exchanged with a control by Schedule()
+     const std::vector<id_num_t>& GateIds(int i) const
+     {
+          return gate_[i];
+     }
+
+     //! Control qubits of a gate, see GateIds()
+     const std::vector<id_num_t>& GateCtrl(int i) const
+     {
+          return gate_ctrl_[i];
+     }
+
+private:
+     const int num_splits_;
+     const int cluster_size_;
+     std::vector<std::vector<id_num_t>> gate_, gate_ctrl_;
+     std::vector<bool> gate_diag_;
+     std::vector<bool> gate_symmetric_;
+     // Indices of the gates which are not in any cluster yet
+     std::vector<int> pending_;
+     bool scheduled_;
+     bool was_scheduling_;
+
+     // Returns the (global, local) pairs to swap before the next stage.
+     std::vector<id_num_t> NextSwap(const std::vector<id_num_t>& locals,
+                                    const std::vector<id_num_t>& globals,
+                                    const std::vector<double>& swap_cost);
+
+     // Appends the clusters of the current stage to the plan.
+     void ScheduleClusters(const std::vector<id_num_t>& locals,
+                           const std::vector<id_num_t>& globals,
+                           std::vector<Step>& plan);
+
+     // Forgets the gates of the previous call to Schedule().
+     void Clear();
+
+     // Puts the target of the symmetric gates on a local qubit if possible.
+     void PrepareSymmetric(const std::vector<id_num_t>& locals,
+                           const std::vector<id_num_t>& globals);
+};
+
+#endif  // SCHEDULER_GREEDY_SCHEDULER_H
@@ -27,24 +27,69 @@ SwapScheduler::SwapScheduler(
     const std::vector<std::vector<id_num_t>>& gate_ctrl,
     std::vector<bool> gate_diag, const int num_splits, const int num_locals,
     bool fuse)
+    : SwapScheduler(gate, gate_ctrl, std::move(gate_diag), num_splits,
+                    num_locals, fuse, {})
+{}
+
+SwapScheduler::SwapScheduler(
+    const std::vector<std::vector<id_num_t>>& gate,
+    const std::vector<std::vector<id_num_t>>& gate_ctrl,
+    std::vector<bool> gate_diag, const int num_splits, const int num_locals,
+    bool fuse, const std::map<id_num_t, double>& swap_cost)
+{
+     CHECK(gate.size() == gate_ctrl.size() && gate.size() == gate_diag.size())
+         << "ctor():";
+     std::vector<id_num_t> pos_to_id;
+     std::map<id_num_t, int> id_to_pos;
+     tie(pos_to_id, id_to_pos) = CalcPos(gate, gate_ctrl, {}, {});
+     impl_ = MakeMasked<Impl, SwapSchedulerImpl>(
+         pos_to_id.size(), gate, gate_ctrl, std::move(gate_diag), num_splits,
+         num_locals, fuse, swap_cost, std::move(pos_to_id),
+         std::move(id_to_pos));
+}
+
+SwapScheduler::~SwapScheduler()
+{}
+
+std::vector<id_num_t> SwapScheduler::ScheduleSwap()
+{
+     return impl_->ScheduleSwap();
+}
+
+template <class Mask>
+SwapSchedulerImpl<Mask>::SwapSchedulerImpl(
+    const std::vector<std::vector<id_num_t>>& gate,
+    const std::vector<std::vector<id_num_t>>& gate_ctrl,
+    std::vector<bool> gate_diag, const int num_splits, const int num_locals,
+    bool fuse, const std::map<id_num_t, double>& swap_cost,
+    std::vector<id_num_t> pos_to_id, std::map<id_num_t, int> id_to_pos)
     : num_splits_(num_splits),
       num_locals_(num_locals),
       gate_diag_(std::move(gate_diag)),
       gate_weight_(gate.size(), 1),
+      pos_to_id_(std::move(pos_to_id)),
+      id_to_pos_(std::move(id_to_pos)),
       best_ans_(0),
-      best_locals_(0)
+      best_locals_(0),
+      best_cost_(0)
 {
-     CHECK(gate.size() == gate_ctrl.size() && gate.size() == gate_diag_.size())
-         << "ctor():";
-     tie(pos_to_id_, id_to_pos_) = CalcPos(gate, gate_ctrl, {}, {});
-     tie(gate_, gate_ctrl_) = CalcGates(gate, gate_ctrl, id_to_pos_);
+     tie(gate_, gate_ctrl_) = CalcGates<Mask>(gate, gate_ctrl, id_to_pos_);
+
+     pos_cost_.resize(pos_to_id_.size(), 0.);
+     for (const auto& it: swap_cost) {
+          auto pos = id_to_pos_.find(it.first);
+          if (pos != id_to_pos_.end()) {
+               pos_cost_[pos->second] = it.second;
+          }
+     }
 
      if (fuse) {
           FuseSingleQubitGates();
      }
 }
 
-void SwapScheduler::FuseSingleQubitGates()
+template <class Mask>
+void SwapSchedulerImpl<Mask>::FuseSingleQubitGates()
 {
      for (int i = static_cast<int>(gate_.size()) - 1; i >= 0; --i) {
           bool remove = false;
@@ -67,7 +112,8 @@ void SwapScheduler::FuseSingleQubitGates()
      }
 }
 
-std::vector<id_num_t> SwapScheduler::ScheduleSwap()
+template <class Mask>
+std::vector<id_num_t> SwapSchedulerImpl<Mask>::ScheduleSwap()
 {
      VLOG(1) << "ScheduleSwap(): started scheduling swap: gates_no = "
              << gate_.size() << " real gates_no = "
@@ -80,6 +126,7 @@ std::vector<id_num_t> SwapScheduler::ScheduleSwap()
 
      best_ans_ = 0;
      best_locals_ = 0;
+     best_cost_ = 0;
      int splits_left = Rec(0, 0, 0, 0, num_splits_);
      VLOG(1) << "ScheduleSwap(): finished scheduling swap: expected gates_no = "
              << best_ans_ << "; used " << num_splits_ - splits_left << "/"
@@ -87,12 +134,22 @@ std::vector<id_num_t> SwapScheduler::ScheduleSwap()
      return MskToIds(best_locals_, pos_to_id_);
 }
 
-int SwapScheduler::Rec(const int pos, const msk_t cur_locals,
-                       const msk_t cur_bad, const int cur_ans, int splits_left)
+template <class Mask>
+int SwapSchedulerImpl<Mask>::Rec(const int pos, const Mask cur_locals,
+                                 const Mask cur_bad, const int cur_ans,
+                                 int splits_left)
 {
      if (cur_ans > best_ans_) {
           best_ans_ = cur_ans;
           best_locals_ = cur_locals;
+          best_cost_ = SwapCost(cur_locals);
+     }
+     else if (cur_ans == best_ans_) {
+          auto cost = SwapCost(cur_locals);
+          if (cost < best_cost_) {
+               best_locals_ = cur_locals;
+               best_cost_ = cost;
+          }
      }
 
      if (pos == static_cast<int>(gate_.size())) {
@@ -168,3 +225,8 @@ int SwapScheduler::Rec(const int pos, const msk_t cur_locals,
      CHECK(cnt_take == 0) << "Rec(): Internal error: invalid branch number";
      return splits_left;
 }
+
+template class SwapSchedulerImpl<msk_t>;
+template class SwapSchedulerImpl<WideMask<2>>;
+template class SwapSchedulerImpl<WideMask<4>>;
+template class SwapSchedulerImpl<WideMask<16>>;
@@ -16,6 +16,7 @@
 #define SCHEDULER_SWAP_SCHEDULER_H
 
 #include <map>
+#include <memory>
 #include <vector>
 
 #include "definitions.h"
@@ -47,20 +48,78 @@ public:
                    const std::vector<std::vector<id_num_t>>& gate_ctrl,
                    std::vector<bool> gate_diag, int num_splits, int num_locals,
                    bool fuse);
-      //! Destructor
-     ~SwapScheduler()
-     {}
+
+     //! Constructor
+     /*!
+      * \param gate For each gate (from the analyzed quantum circuit) a list of qubits on which it acts
+      * \param gate_ctrl For each gate a list of control qubits on which it acts
+      * \param gate_diag For each gate **false** (if non-diagonal gate) or **true** (if diagonal gate)
+      * \param num_splits Number of branch splits
+      * \param num_locals Number of local qubits
+      * \param fuse If True then of single-qubit gates will be fused
+      * \param swap_cost Cost of making each global qubit local (e.g. from
+               SimulatorMPI::GetGlobalQubitsSwapCost()); among the choices which allow
+               the same number of gates, the cheapest one is taken
+      */
+     SwapScheduler(const std::vector<std::vector<id_num_t>>& gate,
+                   const std::vector<std::vector<id_num_t>>& gate_ctrl,
+                   std::vector<bool> gate_diag, int num_splits, int num_locals,
+                   bool fuse, const std::map<id_num_t, double>& swap_cost);
+     //! Destructor
+     ~SwapScheduler();
+
+     // Interface of the implementations for the masks of every width
+     class Impl
+     {
+     public:
+          virtual ~Impl()
+          {}
+          virtual std::vector<id_num_t> ScheduleSwap() = 0;
+     };
+
+private:
+     std::unique_ptr<Impl> impl_;
+};
+
+// Implementation with qubit masks of type Mask (see MakeMasked())
+template <class Mask>
+class SwapSchedulerImpl : public SwapScheduler::Impl
+{
+public:
+     SwapSchedulerImpl(const std::vector<std::vector<id_num_t>>& gate,
+                       const std::vector<std::vector<id_num_t>>& gate_ctrl,
+                       std::vector<bool> gate_diag, int num_splits,
+                       int num_locals, bool fuse,
+                       const std::map<id_num_t, double>& swap_cost,
+                       std::vector<id_num_t> pos_to_id,
+                       std::map<id_num_t, int> id_to_pos);
+
+     std::vector<id_num_t> ScheduleSwap() override;
 
 private:
      const int num_splits_;
      const int num_locals_;
-     std::vector<msk_t> gate_, gate_ctrl_;
+     std::vector<Mask> gate_, gate_ctrl_;
      std::vector<bool> gate_diag_;
      std::vector<int> gate_weight_;
      std::vector<id_num_t> pos_to_id_;
      std::map<id_num_t, int> id_to_pos_;
+     std::vector<double> pos_cost_;
      int best_ans_;
-     msk_t best_locals_;
+     Mask best_locals_;
+     double best_cost_;
+
+     // Returns the cost of making local all qubits from the mask.
+     inline double SwapCost(Mask locals) const
+     {
+          double cost = 0;
+          for (int pos = 0; pos < static_cast<int>(pos_cost_.size()); ++pos) {
+               if (test_bit(locals, pos)) {
+                    cost += pos_cost_[pos];
+               }
+          }
+          return cost;
+     }
 
      // Returns pos-th gate type.
      // 0 - not diagonal
@@ -71,8 +130,8 @@ private:
      }
 
      // Determines is it possible to apply pos-th gate in given situation.
-     inline bool CanTake(const int pos, const msk_t cur_locals,
-                         const msk_t cur_bad) const
+     inline bool CanTake(const int pos, const Mask cur_locals,
+                         const Mask cur_bad) const
      {
           if (inter(unite(gate_ctrl_[pos], gate_[pos]), cur_bad)) {
                return false;
@@ -131,7 +190,7 @@ private:
      }
 
      // Backtracking method to choose local and global qubits.
-     int Rec(int pos, msk_t cur_locals, msk_t cur_bad, int cur_ans,
+     int Rec(int pos, Mask cur_locals, Mask cur_bad, int cur_ans,
              int splits_left);
 
      // Tries to fuse single qubit gates with next/prev gate containing this
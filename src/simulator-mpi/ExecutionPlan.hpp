@@ -0,0 +1,180 @@
+//   Copyright 2019 <Huawei Technologies Co., Ltd>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef EXECUTIONPLAN_HPP
+#define EXECUTIONPLAN_HPP
+
+#include <complex>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "simulator-mpi/alignedallocator.hpp"
+
+// Swaps and clusters of gates executed by SimulatorMPI, recorded once (e.g. by
+// the Python backend while the scheduler runs a circuit) and replayed by
+// SimulatorMPI::RunPlan() with other values of the parameters of the gates,
+// without scheduling them again. The matrix of a parametric gate is
+//
+//     sum_k exp(i * frequencies[k] * params[param]) * terms[k]
+//
+// and the fused matrix of the clusters without parametric gates is kept from
+// one replay to the next.
+class ExecutionPlan
+{
+public:
+     using Index = int64_t;
+     using IndexVector = std::vector<Index>;
+     using Complex = std::complex<double>;
+     using Matrix
+         = std::vector<std::vector<Complex, aligned_allocator<Complex, 64>>>;
+
+     enum StepType
+     {
+          kArrange,  // make ids the global qubits (-1 for a free slot)
+          kSwap,     // swap the (global, local) pairs of ids
+          kCluster   // apply the gates, then run them
+     };
+
+     struct Gate
+     {
+          IndexVector ids;
+          IndexVector ctrl;
+          int64_t param;  // -1 for a constant matrix, which is terms[0]
+          std::vector<double> frequencies;
+          std::vector<Matrix> terms;
+
+          Matrix Evaluate(const std::vector<double>& params) const
+          {
+               if (param < 0) {
+                    return terms[0];
+               }
+               Matrix m(terms[0].size());
+               for (auto& row: m) {
+                    row.resize(m.size());
+               }
+               for (size_t k = 0; k < terms.size(); ++k) {
+                    auto c = std::polar(1., frequencies[k] * params[param]);
+                    for (size_t i = 0; i < m.size(); ++i) {
+                         for (size_t j = 0; j < m.size(); ++j) {
+                              m[i][j] += c * terms[k][i][j];
+                         }
+                    }
+               }
+               return m;
+          }
+     };
+
+     // Fused matrix of a cluster without parametric gates, valid for the
+     // logical rank and the global qubits it was computed with
+     struct FusedCluster
+     {
+          bool valid = false;
+          int rank;
+          IndexVector globals;
+          Matrix m;
+          IndexVector ids;
+          IndexVector ctrls;
+          uint64_t flags;
+     };
+
+     struct Step
+     {
+          StepType type;
+          IndexVector ids;
+          bool async;
+          std::vector<Gate> gates;
+          bool parametric;
+          FusedCluster fused;
+     };
+
+     //! Make ids (in the order of SimulatorMPI::GetGlobalQubitsPermutation())
+     //! the global qubits
+     void AddArrange(IndexVector ids)
+     {
+          EndCluster();
+          steps_.push_back(
+              Step{kArrange, std::move(ids), false, {}, false, {}});
+     }
+
+     //! Swap global and local qubits, see SimulatorMPI::SwapQubits()
+     void AddSwap(IndexVector pairs, bool async)
+     {
+          EndCluster();
+          steps_.push_back(Step{kSwap, std::move(pairs), async, {}, false, {}});
+     }
+
+     //! Add a gate to the current cluster
+     void AddGate(Matrix m, IndexVector ids, IndexVector ctrl)
+     {
+          OpenCluster().gates.push_back(
+              Gate{std::move(ids), std::move(ctrl), -1, {0.}, {std::move(m)}});
+     }
+
+     //! Add a gate whose matrix depends on the parameter param (which has
+     //! the value value in the recorded run) to the current cluster
+     void AddParametricGate(int64_t param, double value,
+                            std::vector<double> frequencies,
+                            std::vector<Matrix> terms, IndexVector ids,
+                            IndexVector ctrl)
+     {
+          if (param < 0 || terms.empty()
+              || frequencies.size() != terms.size()) {
+               throw std::invalid_argument(
+                   "AddParametricGate(): invalid parametric gate");
+          }
+          if (static_cast<size_t>(param) >= parameters_.size()) {
+               parameters_.resize(param + 1, 0.);
+          }
+          parameters_[param] = value;
+          auto& step = OpenCluster();
+          step.parametric = true;
+          step.gates.push_back(Gate{std::move(ids), std::move(ctrl), param,
+                                    std::move(frequencies), std::move(terms)});
+     }
+
+     //! End the current cluster (the gates added next form a new one)
+     void EndCluster()
+     {
+          open_ = false;
+     }
+
+     //! Values of the parameters in the recorded run
+     const std::vector<double>& parameters() const
+     {
+          return parameters_;
+     }
+
+     std::vector<Step>& steps()
+     {
+          return steps_;
+     }
+
+private:
+     std::vector<Step> steps_;
+     std::vector<double> parameters_;
+     bool open_ = false;
+
+     Step& OpenCluster()
+     {
+          if (!open_) {
+               steps_.push_back(Step{kCluster, {}, false, {}, false, {}});
+               open_ = true;
+          }
+          return steps_.back();
+     }
+};
+
+#endif
@@ -16,7 +16,13 @@
 
 #include <glog/logging.h>
 
+#include <bitset>
+#include <boost/serialization/map.hpp>
 #include <cmath>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <sstream>
 #ifdef _OPENMP
 #     include <omp.h>
 #endif  // _OPENMP
@@ -41,6 +47,7 @@ using intrin::kernelK_diag1;
 #endif
 
 constexpr size_t SimulatorMPI::kNotFound_;
+constexpr size_t SimulatorMPI::kMaxMarginalQubits_;
 
 class GlogSingleton
 {
@@ -63,22 +70,106 @@ private:
      }
 };
 
+// Communicator of the processes sharing memory with this one
+static mpi::communicator NodeComm(const mpi::communicator &world)
+{
+     MPI_Comm node;
+     MPI_Comm_split_type(world, MPI_COMM_TYPE_SHARED, world.rank(),
+                         MPI_INFO_NULL, &node);
+     return mpi::communicator(node, mpi::comm_take_ownership);
+}
+
+// Number of low rank bits that only split processes within a node (0 if the
+// nodes are not uniform), the ranks must be ordered by OrderRanksByNode()
+static size_t IntraNodeBits(const mpi::communicator &world)
+{
+     int node_size = NodeComm(world).size();
+     auto min_size = mpi::all_reduce(world, node_size, mpi::minimum<int>());
+     auto max_size = mpi::all_reduce(world, node_size, mpi::maximum<int>());
+     if (min_size != max_size || (node_size & (node_size - 1)) != 0) {
+          return 0;
+     }
+
+     size_t bits = 0;
+     while ((2 << bits) <= node_size) {
+          ++bits;
+     }
+     return bits;
+}
+
+// Removes the qubit at bit pos in state val from vec, keeping the amplitudes
+// in the lower half; the destinations [2^l, 2^(l+1)) are filled in turn from
+// sources that are all above 2^(l+1), so that each of these ranges can be
+// copied in place by a static parallel loop
+template <class V>
+static void CompactHalf(V &vec, size_t pos, bool val)
+{
+     size_t half = vec.size() / 2;
+     uint64_t low = (1ul << pos) - 1;
+     uint64_t bit = static_cast<uint64_t>(val) << pos;
+
+     size_t begin = 0;
+     size_t end = 1ul << pos;
+     if (!val) {  // [0, 2^pos) is already in place
+          begin = end;
+          end *= 2;
+     }
+     while (begin < half) {
+          end = std::min(end, half);
+#pragma omp parallel for schedule(static) if (end - begin >= (1ul << 14))
+          for (size_t j = begin; j < end; ++j) {
+               vec[j] = vec[(j >> pos << (pos + 1)) | bit | (j & low)];
+          }
+          begin = end;
+          end *= 2;
+     }
+}
+
+// Renumber the processes node by node, so that the low rank bits stay within
+// a node whatever the placement of the processes is
+static mpi::communicator OrderRanksByNode(const mpi::communicator &world)
+{
+     auto node = NodeComm(world);
+     auto node_size = node.size();
+     auto min_size = mpi::all_reduce(world, node_size, mpi::minimum<int>());
+     auto max_size = mpi::all_reduce(world, node_size, mpi::maximum<int>());
+     if (min_size != max_size) {
+          VLOG(1) << "OrderRanksByNode(): nodes are not uniform";
+          return world;
+     }
+
+     auto leaders = world.split(node.rank() == 0 ? 0 : 1);
+     int node_idx = leaders.rank();
+     mpi::broadcast(node, node_idx, 0);
+
+     return world.split(0, node_idx * node_size + node.rank());
+}
+
 SimulatorMPI::SimulatorMPI(uint64_t seed, size_t max_local,
-                           size_t max_cluster_size)
-    : SimulatorMPI(mpi::communicator(), seed, max_local, max_cluster_size)
+                           size_t max_cluster_size, size_t max_memory,
+                           const std::string &out_of_core_dir)
+    : SimulatorMPI(mpi::communicator(), seed, max_local, max_cluster_size,
+                   max_memory, out_of_core_dir)
 {}
 
 SimulatorMPI::SimulatorMPI(mpi::communicator aWorld, uint64_t seed,
-                           size_t max_local, size_t max_cluster_size)
-    : env_(boost::mpi::threading::level::funneled),
-      world_(aWorld),
+                           size_t max_local, size_t max_cluster_size,
+                           size_t max_memory,
+                           const std::string &out_of_core_dir)
+    : env_(boost::mpi::threading::level::multiple),
+      world_(OrderRanksByNode(aWorld)),
+      vec_(StateVector::allocator_type::state_vector(out_of_core_dir)),
       kMaxFloatError_(1e-12),
       kMinLocal_(max_cluster_size),
       kMaxLocal_(max_local),
+      kMaxMemory_(max_memory),
       kMaxGlobal_(static_cast<int>(log2(world_.size()))),
+      kInterNodeSwapCost_(4.),
+      intra_node_bits_(IntraNodeBits(world_)),
       kMaxClusterSize_(max_cluster_size),
       globals_(static_cast<Index>(kMaxGlobal_), kNotFound_),
       rank_(world_.rank()),
+      rank_map_(world_.size()),
       buffs_(4)
 {
      start_time = Clock::now();
@@ -89,10 +180,35 @@ SimulatorMPI::SimulatorMPI(mpi::communicator aWorld, uint64_t seed,
 
      VLOG(0) << boost::format(
                     "ctor(): rank = %d; seed = %u; max_local = %d; "
-                    "max_cluster_size = %d")
-                    % rank_ % seed % max_local % max_cluster_size;
+                    "max_cluster_size = %d; max_memory = %u")
+                    % rank_ % seed % max_local % max_cluster_size % max_memory;
+     if (!out_of_core_dir.empty()) {
+          VLOG(0) << "ctor(): out-of-core state vector in " << out_of_core_dir;
+     }
+     VLOG(1) << boost::format("ctor(): world rank = %d; intra-node bits = %d")
+                    % aWorld.rank() % intra_node_bits_;
+
+     std::iota(rank_map_.begin(), rank_map_.end(), 0);
 
-     vec_.reserve(1ul << kMaxLocal_);
+     // only address space, the pages are backed once the qubits are allocated
+     // (by memory, or by disk blocks in out-of-core mode)
+     bool mapped = true;
+     try {
+          vec_.reserve(MaxStateVectorSize());
+     }
+     catch (const std::bad_alloc &) {
+          mapped = false;
+     }
+     if (!mpi::all_reduce(world_, mapped, std::logical_and<bool>())) {
+          auto message = (boost::format("ctor(): can't map the state vector "
+                                        "in %s")
+                          % (out_of_core_dir.empty() ? "memory"
+                                                     : out_of_core_dir))
+                             .str();
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
      vec_.resize(1);
      if (rank_ == 0)
           vec_[0] = 1.;  // all-zero initial state
@@ -105,6 +221,7 @@ SimulatorMPI::SimulatorMPI(mpi::communicator aWorld, uint64_t seed,
 
 SimulatorMPI::~SimulatorMPI()
 {
+     WaitSwapQubits();
      EndStage();
 
      auto total_duration = Duration(Clock::now() - start_time).count();
@@ -145,15 +262,24 @@ inline void FillVector(typename V::iterator start, typename V::iterator end,
      }
 }
 
-inline void SimulatorMPI::CheckNorm()
+// copies src into the storage of dst (of the same size), so that the views
+// on the state vector given by cheat_local() stay valid
+template <class V>
+inline void CopyVector(const V &src, V &dst)
 {
-     Float local_norm = norm(vec_.begin(), vec_.end());
+     uint64_t sz = src.size();
 
-     Float norm = 0.0;
-     mpi::all_reduce(world_, local_norm, norm, std::plus<Float>());
+#pragma omp parallel for schedule(static)
+     for (size_t i = 0; i < sz; ++i) {
+          dst[i] = src[i];
+     }
+}
 
-     VLOG(4) << boost::format("CheckNorm(): norm = %.3lf; local_norm = %.3lf")
-                    % norm % local_norm;
+inline void SimulatorMPI::CheckNorm()
+{
+     auto norm = reduce_internal(1, {{0, 0, 0}}, {})[0];
+
+     VLOG(4) << boost::format("CheckNorm(): norm = %.3lf") % norm;
      VLOG(4) << boost::format("CheckNorm(): local state vector: ")
              << print(vec_);
 
@@ -165,12 +291,43 @@ inline void SimulatorMPI::CheckNorm()
      }
 }
 
+size_t SimulatorMPI::MaxStateVectorSize() const
+{
+     size_t size = 1ul << kMaxLocal_;
+     while (kMaxMemory_ != 0 && size > 1
+            && size * sizeof(Complex) > kMaxMemory_) {
+          size /= 2;
+     }
+     return size;
+}
+
 void SimulatorMPI::AllocateLocalQubit(Index id)
 {
      VLOG(1) << boost::format("AllocateLocalQubit(): id = %u; bit = %u") % id
                     % locals_.size();
+
+     auto size = vec_.size() * 2;
+     if (kMaxMemory_ != 0 && size * sizeof(Complex) > kMaxMemory_) {
+          auto message
+              = (boost::format(
+                     "AllocateLocalQubit(): %u local qubits need %u bytes per "
+                     "process, over the memory budget of %u bytes")
+                 % (locals_.size() + 1) % (size * sizeof(Complex))
+                 % kMaxMemory_)
+                    .str();
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     // grow in place, the reservation may have been given away by a swap of
+     // vec_ with a smaller vector
+     if (vec_.capacity() < size) {
+          vec_.reserve(std::max(size, MaxStateVectorSize()));
+     }
+
      locals_.push_back(id);
-     vec_.resize(vec_.size() * 2);
+     vec_.resize(size);
 }
 
 void SimulatorMPI::AllocateGlobalQubit(Index id)
@@ -183,6 +340,10 @@ void SimulatorMPI::AllocateGlobalQubit(Index id)
 
 void SimulatorMPI::AllocateQubit(Index id)
 {
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kAllocateQubit, id);
+     WaitSwapQubits();
+     FlushNormalization();
      auto start_alloc_time = Clock::now();
      VLOG(1) << boost::format("AllocateQubit(): id = %u") % id;
 
@@ -217,6 +378,9 @@ void SimulatorMPI::AllocateQubit(Index id)
 
 void SimulatorMPI::AllocateQureg(const std::vector<Index> &ids, Complex init)
 {
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kAllocateQureg, ids, init);
+
      VLOG(1) << boost::format("AllocateQureg(): ids = ") << print(ids);
      VLOG(1) << boost::format("AllocateQureg(): init = %f") % init;
 
@@ -275,18 +439,35 @@ size_t SimulatorMPI::ArrayFindSure(const std::vector<Index> &v, Index val) const
      return pos;
 }
 
+int SimulatorMPI::PhysicalRank(uint64_t logical) const
+{
+     return rank_map_[logical];
+}
+
+template <class F>
+void SimulatorMPI::RelabelRanks(F sigma)
+{
+     // sigma is a permutation of the logical ranks, the amplitudes held by
+     // logical rank l become those of logical rank sigma(l)
+     std::vector<int> rank_map(rank_map_.size());
+     for (size_t l = 0; l < rank_map_.size(); ++l) {
+          rank_map[sigma(l)] = rank_map_[l];
+     }
+     rank_map_.swap(rank_map);
+     rank_ = static_cast<int>(sigma(static_cast<uint64_t>(rank_)));
+
+     VLOG(2) << boost::format("RelabelRanks(): logical rank = %d") % rank_;
+}
+
 void SimulatorMPI::DeallocateLocalQubit(Index id)
-{  // TODO make parallel
+{
      VLOG(1) << boost::format("DeallocateLocalQubit(): id = %u") % id;
 
-     Float sum[] = {0.0, 0.0};
      auto pos = ArrayFindSure(locals_, id);
-     for (size_t i = 0; i < vec_.size(); ++i) {
-          sum[i >> pos & 1] += std::norm(vec_[i]);
-     }
-
-     Float all[] = {0.0, 0.0};
-     mpi::all_reduce(world_, sum, 2, all, std::plus<Float>());
+     Reduction r;
+     r.AddProbability({false}, {id});
+     r.AddProbability({true}, {id});
+     auto all = Reduce(r);
 
      VLOG(1) << boost::format(
                     "DeallocateLocalQubit(): norm(0) = %.3lf; norm(1) = %.3lf")
@@ -301,38 +482,21 @@ void SimulatorMPI::DeallocateLocalQubit(Index id)
           throw std::runtime_error(message);
      }
 
-     if (all[0] > kMaxFloatError_) {
-          for (size_t i = (1ul << (pos)); (i << 1) < vec_.size();
-               i += (1ul << (pos))) {
-               for (size_t j = 0; j < (1ul << pos); ++j) {
-                    vec_[i + j] = vec_[(i << 1) + j];
-               }
-          }
-     }
-     else {
-          for (size_t i = 0; i < vec_.size(); i += (1ul << (pos + 1))) {
-               for (size_t j = 0; j < (1ul << pos); ++j) {
-                    vec_[(i >> 1) + j] = vec_[i + j + (1ul << (pos))];
-               }
-          }
-     }
+     CompactHalf(vec_, pos, all[1] > kMaxFloatError_);
 
      locals_.erase(locals_.begin() + pos);
      vec_.resize(vec_.size() / 2);
 }
 
 void SimulatorMPI::DeallocateGlobalQubit(Index id)
-{  // TODO make parallel
+{
      VLOG(1) << boost::format("DeallocateGlobalQubit(): id = %u") % id;
 
-     Float sum[] = {0.0, 0.0};
      auto pos = ArrayFindSure(globals_, id);
-     for (size_t i = 0; i < vec_.size(); ++i) {
-          sum[rank_ >> pos & 1] += std::norm(vec_[i]);
-     }
-
-     Float all[] = {0.0, 0.0};
-     mpi::all_reduce(world_, sum, 2, all, std::plus<Float>());
+     Reduction r;
+     r.AddProbability({false}, {id});
+     r.AddProbability({true}, {id});
+     auto all = Reduce(r);
 
      VLOG(1) << boost::format(
                     "DeallocateGlobalQubit(): norm(0) = %.3lf; norm(1) = %.3lf")
@@ -352,12 +516,9 @@ void SimulatorMPI::DeallocateGlobalQubit(Index id)
                          "DeallocateGlobalQubit(): deallocating qubit %u in "
                          "|1> state")
                          % id;
-          auto local_qubit = locals_.back();
-          SwapQubits({id, local_qubit});
-          Matrix x_gate = {{Complex{0}, Complex{1}}, {Complex{1}, Complex{0}}};
-          ApplyGate(x_gate, {id}, {});
-          Run();
-          SwapQubits({local_qubit, id});
+          // the processes holding the |1> half take over the logical ranks of
+          // the |0> half, no amplitude is moved
+          RelabelRanks([pos](uint64_t l) { return l ^ (1ul << pos); });
      }
 
      globals_[pos] = static_cast<Index>(-1);
@@ -368,6 +529,10 @@ void SimulatorMPI::DeallocateGlobalQubit(Index id)
 
 void SimulatorMPI::DeallocateQubit(Index id)
 {
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kDeallocateQubit, id);
+     WaitSwapQubits();
+     FlushNormalization();
      auto start_dealloc_time = Clock::now();
      VLOG(1) << boost::format("DeallocateQubit(): id = %u") % id;
 
@@ -425,6 +590,67 @@ void SimulatorMPI::DeallocateQubit(Index id)
      total_dealloc_duration += dealloc_duration;
 }
 
+// Applies a fused cluster to psi with the kernel matching its number of qubits
+template <class V>
+void ApplyKernel(V &psi, const SimulatorMPI::Matrix &m,
+                 const std::vector<uint32_t> &ids_pos, uint64_t ctrl_mask,
+                 bool diag, bool parallel)
+{
+     using Matrix = SimulatorMPI::Matrix;
+     using Complex = SimulatorMPI::Complex;
+
+     switch (ids_pos.size()) {
+          case 0:
+               if (m[0][0] != Complex(1)) {
+#pragma omp parallel if (parallel)
+                    kernelK_diag1<V, Complex>(psi, m[0][0]);
+               }
+               break;
+          case 1:
+#pragma omp parallel if (parallel)
+               diag ? kernelK<V, Matrix, kernel_core_diag>(psi, ids_pos[0], m,
+                                                          ctrl_mask)
+                    : kernelK<V, Matrix, kernel_core>(psi, ids_pos[0], m,
+                                                     ctrl_mask);
+               break;
+          case 2:
+#pragma omp parallel if (parallel)
+               diag ? kernelK<V, Matrix, kernel_core_diag>(
+                   psi, ids_pos[1], ids_pos[0], m, ctrl_mask)
+                    : kernelK<V, Matrix, kernel_core>(psi, ids_pos[1],
+                                                     ids_pos[0], m, ctrl_mask);
+               break;
+          case 3:
+#pragma omp parallel if (parallel)
+               diag ? kernelK<V, Matrix, kernel_core_diag>(
+                   psi, ids_pos[2], ids_pos[1], ids_pos[0], m, ctrl_mask)
+                    : kernelK<V, Matrix, kernel_core>(psi, ids_pos[2],
+                                                     ids_pos[1], ids_pos[0], m,
+                                                     ctrl_mask);
+               break;
+          case 4:
+#pragma omp parallel if (parallel)
+               diag ? kernelK<V, Matrix, kernel_core_diag>(
+                   psi, ids_pos[3], ids_pos[2], ids_pos[1], ids_pos[0], m,
+                   ctrl_mask)
+                    : kernelK<V, Matrix, kernel_core>(
+                        psi, ids_pos[3], ids_pos[2], ids_pos[1], ids_pos[0], m,
+                        ctrl_mask);
+               break;
+          case 5:
+#pragma omp parallel if (parallel)
+               diag ? kernelK<V, Matrix, kernel_core_diag>(
+                   psi, ids_pos[4], ids_pos[3], ids_pos[2], ids_pos[1],
+                   ids_pos[0], m, ctrl_mask)
+                    : kernelK<V, Matrix, kernel_core>(
+                        psi, ids_pos[4], ids_pos[3], ids_pos[2], ids_pos[1],
+                        ids_pos[0], m, ctrl_mask);
+               break;
+          default:
+               break;
+     }
+}
+
 uint64_t SimulatorMPI::IdsToBits(const std::vector<Index> &ids,
                                  const std::vector<Index> &perm) const
 {
@@ -440,6 +666,8 @@ uint64_t SimulatorMPI::IdsToBits(const std::vector<Index> &ids,
 
 void SimulatorMPI::Run()
 {
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kRun);
      auto start_run_time = Clock::now();
 
      Matrix m;
@@ -447,6 +675,15 @@ void SimulatorMPI::Run()
 
      uint64_t flags = 0;
      fused_gates_.perform_fusion(m, ids, ctrls, flags);
+     RunFused(std::move(m), std::move(ids), std::move(ctrls), flags,
+              start_run_time);
+}
+
+void SimulatorMPI::RunFused(Matrix m, std::vector<Index> ids,
+                            std::vector<Index> ctrls, uint64_t flags,
+                            Clock::time_point start_run_time)
+{
+     pending_normalization_ = false;
 
      VLOG(1) << "Run(): ids = " << print(ids);
      VLOG(1) << "Run(): ctrls = " << print(ctrls);
@@ -467,67 +704,41 @@ void SimulatorMPI::Run()
           ids_pos[i] = static_cast<uint32_t>(ArrayFindSure(locals_, ids[i]));
      }
 
-     switch (ids.size()) {
-          case 0:
-               if (m[0][0] != static_cast<StateVector::value_type>(1)) {
-                    kernelK_diag1<StateVector, StateVector::value_type>(
-                        vec_, m[0][0]);
-               }
-               break;
-          case 1:
-#pragma omp parallel
-               diag ? kernelK<StateVector, Matrix, kernel_core_diag>(
-                   vec_, ids_pos[0], m, ctrl_mask)
-                    : kernelK<StateVector, Matrix, kernel_core>(
-                        vec_, ids_pos[0], m, ctrl_mask);
-               break;
-          case 2:
-#pragma omp parallel
-               diag ? kernelK<StateVector, Matrix, kernel_core_diag>(
-                   vec_, ids_pos[1], ids_pos[0], m, ctrl_mask)
-                    : kernelK<StateVector, Matrix, kernel_core>(
-                        vec_, ids_pos[1], ids_pos[0], m, ctrl_mask);
-               break;
-          case 3:
-#pragma omp parallel
-               diag ? kernelK<StateVector, Matrix, kernel_core_diag>(
-                   vec_, ids_pos[2], ids_pos[1], ids_pos[0], m, ctrl_mask)
-                    : kernelK<StateVector, Matrix, kernel_core>(
-                        vec_, ids_pos[2], ids_pos[1], ids_pos[0], m, ctrl_mask);
-               break;
-          case 4:
-#pragma omp parallel
-               diag ? kernelK<StateVector, Matrix, kernel_core_diag>(
-                   vec_, ids_pos[3], ids_pos[2], ids_pos[1], ids_pos[0], m,
-                   ctrl_mask)
-                    : kernelK<StateVector, Matrix, kernel_core>(
-                        vec_, ids_pos[3], ids_pos[2], ids_pos[1], ids_pos[0], m,
-                        ctrl_mask);
-               break;
-          case 5:
-#pragma omp parallel
-               diag ? kernelK<StateVector, Matrix, kernel_core_diag>(
-                   vec_, ids_pos[4], ids_pos[3], ids_pos[2], ids_pos[1],
-                   ids_pos[0], m, ctrl_mask)
-                    : kernelK<StateVector, Matrix, kernel_core>(
-                        vec_, ids_pos[4], ids_pos[3], ids_pos[2], ids_pos[1],
-                        ids_pos[0], m, ctrl_mask);
-               break;
-          default:
-               auto message
-                   = (boost::format("Run(): cannot apply %u qubits gate")
-                      % ids.size())
-                         .str();
-               LOG(ERROR) << message;
-               world_.barrier();
-               throw std::runtime_error(message);
+     if (ids.size() > 5) {
+          auto message = (boost::format("Run(): cannot apply %u qubits gate")
+                          % ids.size())
+                             .str();
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     // which clusters go with the swap differs between the ranks, so the
+     // (collective) norm check is left out of the runs made during a swap
+     bool swapping = !pending_swap_.empty();
+     if (swapping) {
+          if (OverlapWithSwap(m, ids_pos, ctrl_mask, diag)) {
+               VLOG(2) << "Run(): cluster deferred to the pending swap";
+               fused_gates_ = Fusion();
+               fused_qubits_.clear();
+               ++stage_runs;
+               ++total_runs;
+               run_gates = 0;
+               return;
+          }
+          WaitSwapQubits();
      }
 
+     ApplyKernel(vec_, m, ids_pos, ctrl_mask, diag, true);
+
 #ifndef NDEBUG
-     CheckNorm();
+     if (!swapping) {
+          CheckNorm();
+     }
 #endif
 
      fused_gates_ = Fusion();
+     fused_qubits_.clear();
 
      auto end_run_time = Clock::now();
      auto run_duration = Duration(end_run_time - start_run_time).count();
@@ -543,6 +754,8 @@ void SimulatorMPI::Run()
 std::tuple<std::map<int, int>, SimulatorMPI::StateVector &>
 SimulatorMPI::cheat_local()
 {
+     WaitSwapQubits();
+     FlushNormalization();
      std::map<int, int> id2pos;
      for (size_t pos = 0; pos < locals_.size(); ++pos) {
           auto id = locals_[pos];
@@ -558,151 +771,1428 @@ SimulatorMPI::cheat_local()
      return make_tuple(id2pos, std::ref(vec_));
 }
 
-SimulatorMPI::Float SimulatorMPI::GetProbability(
-    const std::vector<bool> &bit_string, const std::vector<Index> &ids)
+SimulatorMPI::StateVector SimulatorMPI::GatherStateVector(int root)
 {
-     VLOG(1) << "GetProbability(): ids = " << print(ids);
-     VLOG(1) << "GetProbability(): bit_string = " << print(bit_string);
-     VLOG(3) << "GetProbability(): locals = " << print(locals_);
-     VLOG(3) << "GetProbability(): globals = " << print(globals_);
-
-     uint64_t local_msk = 0;
-     uint64_t local_val = 0;
-     uint64_t global_msk = 0;
-     uint64_t global_val = 0;
-
-     if (ids.size() != bit_string.size()) {
-          auto message = "GetProbability(): ids.size() != bit_string.size()";
-          LOG(ERROR) << message;
-          world_.barrier();
-          throw std::runtime_error(message);
-     }
-
-     for (size_t i = 0; i < ids.size(); ++i) {
-          auto id = ids[i];
-          bool v = bit_string[i];
-          auto pos = ArrayFind(locals_, id);
-          if (pos != kNotFound_) {
-               local_msk |= 1ul << pos;
-               if (v)
-                    local_val |= 1ul << pos;
-          }
-          else {
-               pos = ArrayFindSure(globals_, id);
-               global_msk |= 1ul << pos;
-               if (v)
-                    global_val |= 1ul << pos;
+     VLOG(1) << boost::format("GatherStateVector(): root = %d") % root;
+     WaitSwapQubits();
+     FlushNormalization();
+
+     // the parts are sent as blocks of up to 2^20 amplitudes, so that the
+     // counts and displacements fit an int whatever the local size is
+     size_t block = std::min(vec_.size(), std::size_t(1ul << 20));
+     int count = static_cast<int>(vec_.size() / block);
+     MPI_Datatype block_type;
+     MPI_Type_contiguous(static_cast<int>(block),
+                         mpi::get_mpi_datatype<Complex>(), &block_type);
+     MPI_Type_commit(&block_type);
+
+     StateVector res;
+     std::vector<int> counts, displs;
+     if (world_.rank() == root) {
+          res.resize(vec_.size() * world_.size());
+          counts.assign(world_.size(), count);
+          displs.resize(world_.size());
+          for (size_t l = 0; l < rank_map_.size(); ++l) {
+               displs[rank_map_[l]] = static_cast<int>(l) * count;
           }
      }
+     MPI_Gatherv(vec_.data(), count, block_type, res.data(), counts.data(),
+                 displs.data(), block_type, root, world_);
+     MPI_Type_free(&block_type);
 
-     return getProbability_internal(local_msk, local_val, global_msk,
-                                    global_val);
+     return res;
 }
 
-SimulatorMPI::Complex SimulatorMPI::GetAmplitude(
-    const std::vector<bool> &bit_string, const std::vector<Index> &ids) const
+void SimulatorMPI::CheckLoading(const std::vector<Index> &ids,
+                                const char *caller) const
 {
-     VLOG(1) << "GetAmplitude(): bit_string = " << print(bit_string);
-     VLOG(1) << "GetAmplitude(): ids = " << print(ids);
-     VLOG(3) << "GetAmplitude(): locals = " << print(locals_);
-     VLOG(3) << "GetAmplitude(): globals = " << print(globals_);
-
-     auto qureg_size = locals_.size() + globals_.size()
-                       - count(globals_.begin(), globals_.end(), kNotFound_);
-     if (bit_string.size() != qureg_size || bit_string.size() != ids.size()) {
-          auto message = "GetAmplitude(): ids.size() != number of qubits";
+     bool ok = ids.size() == TotalQubitsCount();
+     for (auto id: ids) {
+          ok &= ArrayFind(locals_, id) != kNotFound_
+                || ArrayFind(globals_, id) != kNotFound_;
+     }
+     ok &= std::set<Index>(ids.begin(), ids.end()).size() == ids.size();
+     if (!ok) {
+          auto message = (boost::format("%s: ids must be a permutation of all "
+                                        "allocated qubits")
+                          % caller)
+                             .str();
           LOG(ERROR) << message;
           world_.barrier();
           throw std::runtime_error(message);
      }
+}
 
-     Index rank = 0;
-     size_t num = 0;
-     size_t check = 0;
+void SimulatorMPI::StartLoading(const std::vector<Index> &ids,
+                                const char *caller)
+{
+     // the arguments are checked before anything changes, so that a rejected
+     // load leaves the state as it was
+     WaitSwapQubits();
+     CheckLoading(ids, caller);
 
-     for (size_t i = 0; i < ids.size(); ++i) {
-          auto id = ids[i];
+     // the gates waiting for Run() would act on the replaced state
+     fused_gates_ = Fusion();
+     fused_qubits_.clear();
+     pending_normalization_ = false;
+}
 
-          auto pos = ArrayFind(locals_, id);
-          if (pos != kNotFound_) {
-               num |= bit_string[i] * (1ul << pos);
-               check |= (1ul << pos);
-          }
-          else {
-               pos = ArrayFindSure(globals_, id);
-               rank |= bit_string[i] * (1ul << pos);
-               check |= (1ul << (pos + locals_.size()));
-          }
+uint64_t SimulatorMPI::LoadingSlice(const std::vector<Index> &ids,
+                                    const char *caller)
+{
+     // the first ids become the local qubits and the next ones take the used
+     // global slots in order, so that the wavefunction is split into
+     // contiguous slices; returns the slice of this process (kNotFound_ if
+     // it holds zeros)
+     StartLoading(ids, caller);
+
+     auto it = ids.begin();
+     for (auto &id: locals_) {
+          id = *it++;
      }
-
-     if ((1ul << qureg_size) - 1 != check) {
-          auto message
-              = "GetAmplitude(): the second argument must be a permutation of "
-                "all allocated qubits.";
-          LOG(ERROR) << message;
-          world_.barrier();
-          throw std::runtime_error(message);
+     for (auto &id: globals_) {
+          if (static_cast<size_t>(id) != kNotFound_) {
+               id = *it++;
+          }
      }
 
-     Complex value = vec_[num];
-     mpi::broadcast(world_, value, static_cast<int>(rank));
-     return value;
+     auto slice = CompressedRank();
+     VLOG(2) << boost::format("LoadingSlice(): slice = %d") % slice;
+     return slice;
 }
 
-std::vector<SimulatorMPI::Index> SimulatorMPI::GetQubitsPermutation() const
+uint64_t SimulatorMPI::CompressedRank() const
 {
-     auto res = locals_;
-     res.insert(res.end(), globals_.begin(), globals_.end());
-
-     VLOG(4) << "GetQubitsPermutation(): ids = " << print(res);
-     return res;
+     // the logical rank without the bits of the free global slots, i.e. the
+     // slice of the state held by this process (kNotFound_ if it holds zeros)
+     uint64_t slice = 0;
+     size_t i = 0;
+     for (size_t pos = 0; pos < globals_.size(); ++pos) {
+          if (static_cast<size_t>(globals_[pos]) == kNotFound_) {
+               if (rank_ >> pos & 1) {
+                    return kNotFound_;
+               }
+               continue;
+          }
+          slice |= static_cast<uint64_t>(rank_ >> pos & 1) << i++;
+     }
+     return slice;
 }
 
-void SimulatorMPI::SetQubitsPermutation(const std::vector<Index> p)
+bool SimulatorMPI::FileSlice(MPI_File file, MPI_Offset offset, uint64_t slice,
+                             bool write)
 {
-     VLOG(1) << "SetQubitsPermutation(): ids = " << print(p);
-
-     locals_ = std::vector<Index>(p.begin(), p.begin() + locals_.size());
-     globals_ = std::vector<Index>(p.end() - globals_.size(), p.end());
+     // collective transfer of the slice between vec_ and a file holding the
+     // whole state from offset on, as blocks of up to 2^20 amplitudes (see
+     // GatherStateVector()); the processes holding zeros take no part in it
+     size_t block = std::min(vec_.size(), std::size_t(1ul << 20));
+     MPI_Datatype block_type;
+     MPI_Type_contiguous(static_cast<int>(block),
+                         mpi::get_mpi_datatype<Complex>(), &block_type);
+     MPI_Type_commit(&block_type);
+
+     int count = slice == kNotFound_ ? 0
+                                     : static_cast<int>(vec_.size() / block);
+     if (slice != kNotFound_) {
+          offset += slice * vec_.size() * sizeof(Complex);
+     }
+     int err = write ? MPI_File_write_at_all(file, offset, vec_.data(), count,
+                                             block_type, MPI_STATUS_IGNORE)
+                     : MPI_File_read_at_all(file, offset, vec_.data(), count,
+                                            block_type, MPI_STATUS_IGNORE);
+     MPI_Type_free(&block_type);
+
+     if (!write && slice == kNotFound_) {
+          FillVector<StateVector>(vec_.begin(), vec_.end(), 0.);
+     }
+     return mpi::all_reduce(world_, err == MPI_SUCCESS,
+                            std::logical_and<bool>());
 }
 
-std::vector<SimulatorMPI::Index> SimulatorMPI::GetLocalQubitsPermutation()
+void SimulatorMPI::SetWavefunction(const Complex *wavefunction, size_t size,
+                                   const std::vector<Index> &ids)
 {
-     VLOG(4) << "GetLocalQubitsPermutation(): ids = " << print(locals_);
-     return locals_;
+     SetWavefunction(size, ids,
+                     [wavefunction](size_t begin, Complex *dst, size_t count) {
+                          auto src = wavefunction + begin;
+#pragma omp parallel for schedule(static)
+                          for (size_t i = 0; i < count; ++i) {
+                               dst[i] = src[i];
+                          }
+                     });
 }
 
-std::vector<SimulatorMPI::Index> SimulatorMPI::GetGlobalQubitsPermutation()
+void SimulatorMPI::SetWavefunction(
+    size_t size, const std::vector<Index> &ids,
+    const std::function<void(size_t, Complex *, size_t)> &read)
 {
-     VLOG(4) << "GetGlobalQubitsPermutation(): ids = " << print(globals_);
-     return globals_;
-}
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kUnsupported, std::string("SetWavefunction"));
 
-SimulatorMPI::Float SimulatorMPI::Entropy()
-{
-     Float e = 0;
+     VLOG(1) << "SetWavefunction(): ids = " << print(ids);
 
-#pragma omp parallel for schedule(static) reduction(+ : e)
-     for (size_t i = 0; i < vec_.size(); ++i) {
-          Float pr = abs(vec_[i]) * abs(vec_[i]);
-          if (pr > 0)
-               e += pr * log2(pr);
+     if (size != vec_.size() << GlobalQubitsCount()) {
+          auto message = (boost::format("SetWavefunction(): %u amplitudes "
+                                        "expected, got %u")
+                          % (vec_.size() << GlobalQubitsCount()) % size)
+                             .str();
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
      }
+     auto slice = LoadingSlice(ids, "SetWavefunction()");
 
-     e = mpi::all_reduce(world_, e, std::plus<Float>());
-     return -e;
+     if (slice == kNotFound_) {
+          FillVector<StateVector>(vec_.begin(), vec_.end(), 0.);
+     }
+     else {
+          read(slice * vec_.size(), vec_.data(), vec_.size());
+     }
+
+#ifndef NDEBUG
+     CheckNorm();
+#endif
 }
 
-std::vector<SimulatorMPI::Index> SimulatorMPI::ExtractLocalCtrls(
-    const std::vector<Index> &ctrl) const
+void SimulatorMPI::SetWavefunctionFromFile(const std::string &path,
+                                           const std::vector<Index> &ids)
 {
-     std::vector<Index> new_ctrl;
-     for (auto i: ctrl) {
-          auto pos = ArrayFind(locals_, i);
-          if (pos != kNotFound_) {
-               new_ctrl.push_back(i);
-          }
-     }
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kUnsupported,
+            std::string("SetWavefunctionFromFile"));
+
+     VLOG(1) << "SetWavefunctionFromFile(): path = " << path
+             << "; ids = " << print(ids);
+
+     CheckLoading(ids, "SetWavefunctionFromFile()");
+
+     MPI_File file;
+     int err = MPI_File_open(world_, path.c_str(), MPI_MODE_RDONLY,
+                             MPI_INFO_NULL, &file);
+     MPI_Offset file_size = 0;
+     if (err == MPI_SUCCESS) {
+          MPI_File_get_size(file, &file_size);
+     }
+     auto size = (vec_.size() << GlobalQubitsCount()) * sizeof(Complex);
+     if (err != MPI_SUCCESS || static_cast<size_t>(file_size) != size) {
+          if (err == MPI_SUCCESS) {
+               MPI_File_close(&file);
+          }
+          auto message = (boost::format("SetWavefunctionFromFile(): can't "
+                                        "read %u bytes from %s")
+                          % size % path)
+                             .str();
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     auto slice = LoadingSlice(ids, "SetWavefunctionFromFile()");
+     bool ok = FileSlice(file, 0, slice, false);
+     MPI_File_close(&file);
+     if (!ok) {
+          auto message = (boost::format("SetWavefunctionFromFile(): can't "
+                                        "read %u bytes from %s")
+                          % size % path)
+                             .str();
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+#ifndef NDEBUG
+     CheckNorm();
+#endif
+}
+
+void SimulatorMPI::SetBasisState(const std::vector<bool> &bit_string,
+                                 const std::vector<Index> &ids)
+{
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kUnsupported, std::string("SetBasisState"));
+
+     VLOG(1) << "SetBasisState(): ids = " << print(ids);
+     VLOG(1) << "SetBasisState(): bit_string = " << print(bit_string);
+
+     if (bit_string.size() != ids.size()) {
+          auto message = "SetBasisState(): ids.size() != bit_string.size()";
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+     StartLoading(ids, "SetBasisState()");
+
+     uint64_t local = 0;
+     bool here = true;
+     for (size_t i = 0; i < ids.size(); ++i) {
+          auto pos = ArrayFind(locals_, ids[i]);
+          if (pos != kNotFound_) {
+               local |= static_cast<uint64_t>(bit_string[i]) << pos;
+          }
+          else {
+               pos = ArrayFindSure(globals_, ids[i]);
+               here &= (rank_ >> pos & 1) == bit_string[i];
+          }
+     }
+     for (size_t pos = 0; pos < globals_.size(); ++pos) {
+          if (static_cast<size_t>(globals_[pos]) == kNotFound_) {
+               here &= (rank_ >> pos & 1) == 0;
+          }
+     }
+
+     FillVector<StateVector>(vec_.begin(), vec_.end(), 0.);
+     if (here) {
+          vec_[local] = 1.;
+     }
+}
+
+void SimulatorMPI::SetUniformSuperposition()
+{
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kUnsupported,
+            std::string("SetUniformSuperposition"));
+
+     VLOG(1) << "SetUniformSuperposition()";
+
+     auto ids = locals_;
+     for (auto id: globals_) {
+          if (static_cast<size_t>(id) != kNotFound_) {
+               ids.push_back(id);
+          }
+     }
+     StartLoading(ids, "SetUniformSuperposition()");
+
+     bool here = true;
+     for (size_t pos = 0; pos < globals_.size(); ++pos) {
+          if (static_cast<size_t>(globals_[pos]) == kNotFound_) {
+               here &= (rank_ >> pos & 1) == 0;
+          }
+     }
+
+     auto amplitude = 1. / std::sqrt(static_cast<Float>(
+                               vec_.size() << GlobalQubitsCount()));
+     FillVector<StateVector>(vec_.begin(), vec_.end(),
+                             here ? amplitude : 0.);
+}
+
+void SimulatorMPI::SetProductState(
+    const std::vector<std::array<Complex, 2>> &states,
+    const std::vector<Index> &ids)
+{
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kUnsupported, std::string("SetProductState"));
+
+     VLOG(1) << "SetProductState(): ids = " << print(ids);
+
+     if (states.size() != ids.size()) {
+          auto message = "SetProductState(): ids.size() != states.size()";
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+     StartLoading(ids, "SetProductState()");
+
+     // the global qubits give a factor per rank, the local ones are split
+     // into a low and a high half whose products are tabulated
+     Complex factor = 1.;
+     std::vector<std::array<Complex, 2>> local_states(locals_.size());
+     for (size_t i = 0; i < ids.size(); ++i) {
+          auto pos = ArrayFind(locals_, ids[i]);
+          if (pos != kNotFound_) {
+               local_states[pos] = states[i];
+          }
+          else {
+               pos = ArrayFindSure(globals_, ids[i]);
+               factor *= states[i][rank_ >> pos & 1];
+          }
+     }
+     for (size_t pos = 0; pos < globals_.size(); ++pos) {
+          if (static_cast<size_t>(globals_[pos]) == kNotFound_
+              && (rank_ >> pos & 1)) {
+               factor = 0.;
+          }
+     }
+
+     auto table = [&](size_t begin, size_t end) {
+          std::vector<Complex> t(1ul << (end - begin), 1.);
+          for (size_t k = 0; k < t.size(); ++k) {
+               for (size_t pos = begin; pos < end; ++pos) {
+                    t[k] *= local_states[pos][k >> (pos - begin) & 1];
+               }
+          }
+          return t;
+     };
+     size_t low_bits = locals_.size() / 2;
+     auto low = table(0, low_bits);
+     auto high = table(low_bits, locals_.size());
+     for (auto &h: high) {
+          h *= factor;
+     }
+
+     uint64_t low_msk = (1ul << low_bits) - 1;
+#pragma omp parallel for schedule(static)
+     for (size_t i = 0; i < vec_.size(); ++i) {
+          vec_[i] = high[i >> low_bits] * low[i & low_msk];
+     }
+
+#ifndef NDEBUG
+     CheckNorm();
+#endif
+}
+
+// Fixed part of the checkpoint files, followed by the qubit IDs (bit i of the
+// amplitude index is the state of the i-th one) and the state of the random
+// engine as text; the amplitudes start at data_offset
+struct CheckpointHeader
+{
+     char magic[8];
+     uint64_t version;
+     uint64_t data_offset;
+     uint64_t num_qubits;
+     uint64_t rng_size;
+     int64_t counters[6];
+     double durations[5];
+};
+
+static const char kCheckpointMagic[8] = {'H', 'i', 'Q', 'C', 'K', 'P', 'T', 0};
+static const uint64_t kCheckpointVersion = 1;
+
+void SimulatorMPI::SaveCheckpoint(const std::string &path)
+{
+     VLOG(1) << "SaveCheckpoint(): path = " << path;
+     if (fused_gates_.size() > 0 || pending_normalization_) {
+          Run();
+     }
+     WaitSwapQubits();
+     auto start_save_time = Clock::now();
+
+     auto ids = locals_;
+     for (auto id: globals_) {
+          if (static_cast<size_t>(id) != kNotFound_) {
+               ids.push_back(id);
+          }
+     }
+     std::ostringstream rng;
+     rng << rnd_eng_;
+
+     CheckpointHeader header = {};
+     std::copy(kCheckpointMagic, kCheckpointMagic + 8, header.magic);
+     header.version = kCheckpointVersion;
+     header.num_qubits = ids.size();
+     header.rng_size = rng.str().size();
+     int64_t counters[] = {run_gates,  stage_gates, total_gates,
+                           stage_runs, total_runs,  total_stages};
+     std::copy(counters, counters + 6, header.counters);
+     Float durations[] = {total_runs_duration, total_swap_duration,
+                          total_measure_duration, total_alloc_duration,
+                          total_dealloc_duration};
+     std::copy(durations, durations + 5, header.durations);
+
+     std::string head(reinterpret_cast<const char *>(&header), sizeof(header));
+     head.append(reinterpret_cast<const char *>(ids.data()),
+                 ids.size() * sizeof(Index));
+     head += rng.str();
+     // the amplitudes are aligned on file system blocks
+     header.data_offset = (head.size() + 4095) / 4096 * 4096;
+     head.replace(0, sizeof(header),
+                  reinterpret_cast<const char *>(&header), sizeof(header));
+     auto size = (vec_.size() << GlobalQubitsCount()) * sizeof(Complex);
+
+     MPI_File file;
+     int err = MPI_File_open(world_, path.c_str(),
+                             MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL,
+                             &file);
+     bool ok = err == MPI_SUCCESS;
+     if (ok) {
+          ok = MPI_File_set_size(file, header.data_offset + size)
+               == MPI_SUCCESS;
+          if (world_.rank() == 0) {
+               ok &= MPI_File_write_at(file, 0, &head[0],
+                                       static_cast<int>(head.size()), MPI_BYTE,
+                                       MPI_STATUS_IGNORE)
+                     == MPI_SUCCESS;
+          }
+          ok &= FileSlice(file, header.data_offset, CompressedRank(), true);
+          MPI_File_close(&file);
+     }
+     if (!mpi::all_reduce(world_, ok, std::logical_and<bool>())) {
+          auto message = (boost::format("SaveCheckpoint(): can't write %u "
+                                        "bytes to %s")
+                          % (header.data_offset + size) % path)
+                             .str();
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     auto save_duration = Duration(Clock::now() - start_save_time).count();
+     VLOG(1) << boost::format("SaveCheckpoint(): %u bytes in %.3lf s")
+                    % (header.data_offset + size) % save_duration;
+}
+
+void SimulatorMPI::LoadCheckpoint(const std::string &path)
+{
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kUnsupported, std::string("LoadCheckpoint"));
+
+     VLOG(1) << "LoadCheckpoint(): path = " << path;
+
+     auto fail = [&](MPI_File *file) {
+          if (file) {
+               MPI_File_close(file);
+          }
+          auto message = (boost::format("LoadCheckpoint(): %s is not a "
+                                        "readable checkpoint")
+                          % path)
+                             .str();
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     };
+
+     MPI_File file;
+     if (MPI_File_open(world_, path.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL,
+                       &file)
+         != MPI_SUCCESS) {
+          fail(nullptr);
+     }
+     MPI_Offset file_size = 0;
+     MPI_File_get_size(file, &file_size);
+
+     CheckpointHeader header = {};
+     if (static_cast<size_t>(file_size) >= sizeof(header)) {
+          MPI_File_read_at_all(file, 0, &header, sizeof(header), MPI_BYTE,
+                               MPI_STATUS_IGNORE);
+     }
+     auto n = header.num_qubits;
+     if (!std::equal(kCheckpointMagic, kCheckpointMagic + 8, header.magic)
+         || header.version != kCheckpointVersion || n >= 64
+         || header.data_offset
+                < sizeof(header) + n * sizeof(Index) + header.rng_size
+         || static_cast<size_t>(file_size)
+                != header.data_offset + (sizeof(Complex) << n)) {
+          fail(&file);
+     }
+
+     std::vector<Index> ids(n);
+     std::string rng(header.rng_size, ' ');
+     MPI_File_read_at_all(file, sizeof(header), ids.data(),
+                          static_cast<int>(n * sizeof(Index)), MPI_BYTE,
+                          MPI_STATUS_IGNORE);
+     MPI_File_read_at_all(file, sizeof(header) + n * sizeof(Index), &rng[0],
+                          static_cast<int>(rng.size()), MPI_BYTE,
+                          MPI_STATUS_IGNORE);
+
+     uint64_t slice;
+     try {
+          if (TotalQubitsCount() == 0) {
+               AllocateQureg(ids);
+          }
+          slice = LoadingSlice(ids, "LoadCheckpoint()");
+     }
+     catch (...) {
+          MPI_File_close(&file);
+          throw;
+     }
+     if (!FileSlice(file, header.data_offset, slice, false)) {
+          fail(&file);
+     }
+     MPI_File_close(&file);
+
+     SetRandomState(rng);
+     run_gates = header.counters[0];
+     stage_gates = header.counters[1];
+     total_gates = header.counters[2];
+     stage_runs = header.counters[3];
+     total_runs = header.counters[4];
+     total_stages = header.counters[5];
+     total_runs_duration = header.durations[0];
+     total_swap_duration = header.durations[1];
+     total_measure_duration = header.durations[2];
+     total_alloc_duration = header.durations[3];
+     total_dealloc_duration = header.durations[4];
+
+#ifndef NDEBUG
+     CheckNorm();
+#endif
+}
+
+void SimulatorMPI::StartTrace(const std::string &path)
+{
+     VLOG(1) << "StartTrace(): path = " << path;
+     StopTrace();
+
+     if (TotalQubitsCount() != 0) {
+          auto message = "StartTrace(): a trace must start with no qubits";
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     bool ok = true;
+     if (world_.rank() == 0) {
+          TraceHeader header = {};
+          header.world_size = world_.size();
+          header.max_local = kMaxLocal_;
+          header.max_cluster_size = kMinLocal_;
+          header.max_memory = kMaxMemory_;
+          std::ostringstream rng;
+          rng << rnd_eng_;
+          try {
+               trace_.reset(new TraceWriter(path, header, rng.str()));
+          }
+          catch (const std::runtime_error &) {
+               ok = false;
+          }
+     }
+     if (!mpi::all_reduce(world_, ok, std::logical_and<bool>())) {
+          auto message
+              = (boost::format("StartTrace(): can't write %s") % path).str();
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+}
+
+void SimulatorMPI::StopTrace()
+{
+     trace_.reset();
+}
+
+void SimulatorMPI::SetRandomState(const std::string &state)
+{
+     std::istringstream(state) >> rnd_eng_;
+}
+
+void SimulatorMPI::RunPlan(ExecutionPlan &plan,
+                           const std::vector<Float> &params)
+{
+     VLOG(1) << "RunPlan(): " << plan.steps().size() << " steps";
+
+     if (params.size() < plan.parameters().size()) {
+          auto message = (boost::format("RunPlan(): %u values given for %u "
+                                        "parameters")
+                          % params.size() % plan.parameters().size())
+                             .str();
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     // nothing is recorded here: the calls below are, so that the trace can
+     // be replayed without the plan (and the fused matrices are not reused)
+     for (auto &step: plan.steps()) {
+          switch (step.type) {
+               case ExecutionPlan::kArrange:
+                    ArrangeGlobals(step.ids);
+                    break;
+               case ExecutionPlan::kSwap:
+                    if (step.async) {
+                         StartSwapQubits(step.ids);
+                    }
+                    else {
+                         SwapQubits(step.ids);
+                    }
+                    break;
+               case ExecutionPlan::kCluster: {
+                    auto &fused = step.fused;
+                    bool cache = !trace_ && !step.parametric
+                                 && fused_gates_.size() == 0
+                                 && !pending_normalization_;
+                    if (cache && fused.valid && fused.rank == rank_
+                        && fused.globals == globals_) {
+                         RunFused(fused.m, fused.ids, fused.ctrls, fused.flags,
+                                  Clock::now());
+                         break;
+                    }
+
+                    // the fused matrix can't be kept if a gate is applied
+                    // by relabeling the ranks or flushes the fusion
+                    auto start_run_time = Clock::now();
+                    auto runs = total_runs;
+                    for (auto &gate: step.gates) {
+                         auto m = gate.Evaluate(params);
+                         if (cache && IdsToBits(gate.ids, globals_) != 0) {
+                              cache = static_cast<bool>(
+                                  get_matrix_props(m, m.size(), m.size())
+                                  & MatProps::IS_DIAG);
+                         }
+                         ApplyGate(std::move(m), gate.ids, gate.ctrl);
+                    }
+                    if (!cache || total_runs != runs) {
+                         fused.valid = false;
+                         Run();
+                         break;
+                    }
+
+                    fused.valid = true;
+                    fused.rank = rank_;
+                    fused.globals = globals_;
+                    fused.ids.clear();
+                    fused.ctrls.clear();
+                    fused_gates_.perform_fusion(fused.m, fused.ids,
+                                                fused.ctrls, fused.flags);
+                    RunFused(fused.m, fused.ids, fused.ctrls, fused.flags,
+                             start_run_time);
+                    break;
+               }
+          }
+     }
+}
+
+void SimulatorMPI::ArrangeGlobals(const std::vector<Index> &target)
+{
+     VLOG(1) << "ArrangeGlobals(): target = " << print(target);
+
+     bool ok = target.size() == globals_.size()
+               && std::set<Index>(target.begin(), target.end()).size()
+                      == target.size();
+     for (size_t i = 0; ok && i < target.size(); ++i) {
+          ok = (target[i] == -1) == (globals_[i] == -1);
+          ok &= target[i] == -1 || ArrayFind(locals_, target[i]) != kNotFound_
+                || ArrayFind(globals_, target[i]) != kNotFound_;
+     }
+     if (!ok) {
+          auto message = "RunPlan(): the allocated qubits differ from the ones "
+                         "of the plan";
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     // brings in the wanted qubits that are local
+     auto swap_local_targets = [&]() {
+          std::vector<Index> pairs;
+          for (size_t i = 0; i < target.size(); ++i) {
+               if (globals_[i] != target[i]
+                   && ArrayFind(locals_, target[i]) != kNotFound_) {
+                    pairs.push_back(globals_[i]);
+                    pairs.push_back(target[i]);
+               }
+          }
+          if (!pairs.empty()) {
+               SwapQubits(pairs);
+          }
+     };
+
+     swap_local_targets();
+
+     // the remaining wanted qubits are global in other slots: they go through
+     // local qubits (none of which is wanted any more)
+     std::vector<Index> pairs;
+     size_t next = 0;
+     for (size_t i = 0; i < target.size(); ++i) {
+          if (globals_[i] == target[i]) {
+               continue;
+          }
+          while (next < locals_.size() && locals_[next] == -1) {
+               ++next;
+          }
+          CHECK(next < locals_.size())
+              << "ArrangeGlobals(): Internal error: not enough local qubits";
+          pairs.push_back(globals_[i]);
+          pairs.push_back(locals_[next++]);
+     }
+     if (!pairs.empty()) {
+          SwapQubits(pairs);
+          swap_local_targets();
+     }
+}
+
+SimulatorMPI::Float SimulatorMPI::GetProbability(
+    const std::vector<bool> &bit_string, const std::vector<Index> &ids)
+{
+     VLOG(1) << "GetProbability(): ids = " << print(ids);
+     VLOG(1) << "GetProbability(): bit_string = " << print(bit_string);
+     VLOG(3) << "GetProbability(): locals = " << print(locals_);
+     VLOG(3) << "GetProbability(): globals = " << print(globals_);
+
+     WaitSwapQubits();
+     FlushNormalization();
+
+     uint64_t local_msk = 0;
+     uint64_t local_val = 0;
+     uint64_t global_msk = 0;
+     uint64_t global_val = 0;
+
+     if (ids.size() != bit_string.size()) {
+          auto message = "GetProbability(): ids.size() != bit_string.size()";
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     for (size_t i = 0; i < ids.size(); ++i) {
+          auto id = ids[i];
+          bool v = bit_string[i];
+          auto pos = ArrayFind(locals_, id);
+          if (pos != kNotFound_) {
+               local_msk |= 1ul << pos;
+               if (v)
+                    local_val |= 1ul << pos;
+          }
+          else {
+               pos = ArrayFindSure(globals_, id);
+               global_msk |= 1ul << pos;
+               if (v)
+                    global_val |= 1ul << pos;
+          }
+     }
+
+     return getProbability_internal(local_msk, local_val, global_msk,
+                                    global_val);
+}
+
+std::vector<SimulatorMPI::Float> SimulatorMPI::GetMarginalDistribution(
+    const std::vector<Index> &ids)
+{
+     VLOG(1) << "GetMarginalDistribution(): ids = " << print(ids);
+
+     WaitSwapQubits();
+     FlushNormalization();
+
+     if (ids.size() > kMaxMarginalQubits_) {
+          auto message = (boost::format("GetMarginalDistribution(): can't "
+                                        "compute distribution of more than %d "
+                                        "qubits")
+                          % kMaxMarginalQubits_)
+                             .str();
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     auto local = getMarginal_internal(ids);
+     std::vector<Float> res(local.size());
+     mpi::all_reduce(world_, local.data(), static_cast<int>(local.size()),
+                     res.data(), std::plus<Float>());
+     return res;
+}
+
+std::vector<SimulatorMPI::Float> SimulatorMPI::GetProbabilities(
+    const std::vector<std::vector<bool>> &bit_strings,
+    const std::vector<Index> &ids)
+{
+     VLOG(1) << boost::format("GetProbabilities(): %d bit strings; ids = ")
+                    % bit_strings.size()
+             << print(ids);
+
+     WaitSwapQubits();
+     FlushNormalization();
+
+     for (auto &bit_string: bit_strings) {
+          if (ids.size() != bit_string.size()) {
+               auto message
+                   = "GetProbabilities(): ids.size() != bit_string.size()";
+               LOG(ERROR) << message;
+               world_.barrier();
+               throw std::runtime_error(message);
+          }
+     }
+
+     std::vector<Float> local(bit_strings.size(), 0.);
+     if (ids.size() <= kMaxMarginalQubits_) {
+          auto dist = getMarginal_internal(ids);
+          for (size_t b = 0; b < bit_strings.size(); ++b) {
+               uint64_t key = 0;
+               for (size_t i = 0; i < ids.size(); ++i) {
+                    key |= static_cast<uint64_t>(bit_strings[b][i]) << i;
+               }
+               local[b] = dist[key];
+          }
+     }
+     else {
+          // too many qubits for a histogram: match every bit string in the
+          // same sweep
+          std::vector<uint64_t> local_msk(bit_strings.size(), 0);
+          std::vector<uint64_t> local_val(bit_strings.size(), 0);
+          std::vector<bool> here(bit_strings.size(), true);
+          for (size_t b = 0; b < bit_strings.size(); ++b) {
+               for (size_t i = 0; i < ids.size(); ++i) {
+                    bool v = bit_strings[b][i];
+                    auto pos = ArrayFind(locals_, ids[i]);
+                    if (pos != kNotFound_) {
+                         local_msk[b] |= 1ul << pos;
+                         local_val[b] |= static_cast<uint64_t>(v) << pos;
+                    }
+                    else {
+                         pos = ArrayFindSure(globals_, ids[i]);
+                         if ((rank_ >> pos & 1) != v) {
+                              here[b] = false;
+                         }
+                    }
+               }
+          }
+
+#pragma omp parallel
+          {
+               std::vector<Float> sums(bit_strings.size(), 0.);
+#pragma omp for schedule(static)
+               for (size_t i = 0; i < vec_.size(); ++i) {
+                    auto pr = std::norm(vec_[i]);
+                    for (size_t b = 0; b < sums.size(); ++b) {
+                         if (here[b] && (i & local_msk[b]) == local_val[b]) {
+                              sums[b] += pr;
+                         }
+                    }
+               }
+#pragma omp critical
+               for (size_t b = 0; b < sums.size(); ++b) {
+                    local[b] += sums[b];
+               }
+          }
+     }
+
+     std::vector<Float> res(local.size());
+     mpi::all_reduce(world_, local.data(), static_cast<int>(local.size()),
+                     res.data(), std::plus<Float>());
+     return res;
+}
+
+SimulatorMPI::Complex SimulatorMPI::GetAmplitude(
+    const std::vector<bool> &bit_string, const std::vector<Index> &ids) const
+{
+     VLOG(1) << "GetAmplitude(): bit_string = " << print(bit_string);
+     VLOG(1) << "GetAmplitude(): ids = " << print(ids);
+
+     return GetAmplitudes({bit_string}, ids)[0];
+}
+
+SimulatorMPI::StateVector SimulatorMPI::GetAmplitudes(
+    const std::vector<std::vector<bool>> &bit_strings,
+    const std::vector<Index> &ids) const
+{
+     VLOG(1) << boost::format("GetAmplitudes(): %d bit strings; ids = ")
+                    % bit_strings.size()
+             << print(ids);
+     VLOG(3) << "GetAmplitudes(): locals = " << print(locals_);
+     VLOG(3) << "GetAmplitudes(): globals = " << print(globals_);
+
+     // the pending swap doesn't change the state, only where it is stored
+     const_cast<SimulatorMPI *>(this)->WaitSwapQubits();
+     const_cast<SimulatorMPI *>(this)->FlushNormalization();
+
+     auto qureg_size = locals_.size() + globals_.size()
+                       - count(globals_.begin(), globals_.end(), kNotFound_);
+     if (ids.size() != qureg_size) {
+          auto message = "GetAmplitudes(): ids.size() != number of qubits";
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     // bit of the full (rank and local) index of every qubit
+     std::vector<size_t> bits(ids.size());
+     size_t check = 0;
+     for (size_t i = 0; i < ids.size(); ++i) {
+          auto pos = ArrayFind(locals_, ids[i]);
+          if (pos == kNotFound_) {
+               pos = locals_.size() + ArrayFindSure(globals_, ids[i]);
+          }
+          bits[i] = pos;
+          check |= (1ul << pos);
+     }
+
+     // global slots of de-allocated qubits may leave holes in check
+     if (std::bitset<64>(check).count() != qureg_size) {
+          auto message
+              = "GetAmplitudes(): the second argument must be a permutation of "
+                "all allocated qubits.";
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     std::vector<int> owners(bit_strings.size());
+     std::vector<int> counts(world_.size(), 0);
+     StateVector mine;
+     for (size_t b = 0; b < bit_strings.size(); ++b) {
+          if (bit_strings[b].size() != ids.size()) {
+               auto message
+                   = "GetAmplitudes(): ids.size() != bit_string.size()";
+               LOG(ERROR) << message;
+               world_.barrier();
+               throw std::runtime_error(message);
+          }
+
+          uint64_t index = 0;
+          for (size_t i = 0; i < ids.size(); ++i) {
+               index |= static_cast<uint64_t>(bit_strings[b][i]) << bits[i];
+          }
+          owners[b] = PhysicalRank(index >> locals_.size());
+          ++counts[owners[b]];
+          if (owners[b] == world_.rank()) {
+               mine.push_back(vec_[index & ((1ul << locals_.size()) - 1)]);
+          }
+     }
+
+     // every rank knows the owners, so the counts need not be exchanged
+     std::vector<int> displs(world_.size(), 0);
+     for (int r = 1; r < world_.size(); ++r) {
+          displs[r] = displs[r - 1] + counts[r - 1];
+     }
+
+     StateVector gathered(bit_strings.size());
+     MPI_Allgatherv(mine.data(), static_cast<int>(mine.size()),
+                    mpi::get_mpi_datatype<Complex>(), gathered.data(),
+                    counts.data(), displs.data(),
+                    mpi::get_mpi_datatype<Complex>(), world_);
+
+     // back to the order of the requests
+     StateVector res(bit_strings.size());
+     for (size_t b = 0; b < bit_strings.size(); ++b) {
+          res[b] = gathered[displs[owners[b]]++];
+     }
+     return res;
+}
+
+std::vector<SimulatorMPI::Index> SimulatorMPI::GetQubitsPermutation() const
+{
+     auto res = locals_;
+     res.insert(res.end(), globals_.begin(), globals_.end());
+
+     VLOG(4) << "GetQubitsPermutation(): ids = " << print(res);
+     return res;
+}
+
+void SimulatorMPI::SetQubitsPermutation(const std::vector<Index> p)
+{
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kSetQubitsPermutation, p);
+
+     VLOG(1) << "SetQubitsPermutation(): ids = " << print(p);
+
+     WaitSwapQubits();
+     FlushNormalization();
+
+     locals_ = std::vector<Index>(p.begin(), p.begin() + locals_.size());
+     globals_ = std::vector<Index>(p.end() - globals_.size(), p.end());
+}
+
+std::vector<SimulatorMPI::Index> SimulatorMPI::GetLocalQubitsPermutation()
+{
+     VLOG(4) << "GetLocalQubitsPermutation(): ids = " << print(locals_);
+     return locals_;
+}
+
+std::vector<SimulatorMPI::Index> SimulatorMPI::GetGlobalQubitsPermutation()
+{
+     VLOG(4) << "GetGlobalQubitsPermutation(): ids = " << print(globals_);
+     return globals_;
+}
+
+std::vector<SimulatorMPI::Float> SimulatorMPI::GetGlobalQubitsSwapCost() const
+{
+     // the partners of a global position are the logical ranks differing in
+     // its bit; once RelabelRanks() has permuted the ranks they may sit on
+     // another node for some ranks only, so every pair is checked
+     std::vector<Float> res(globals_.size(), 1.);
+     for (size_t pos = 0; pos < res.size(); ++pos) {
+          for (size_t l = 0; l < 1ul << globals_.size(); ++l) {
+               auto partner = rank_map_[l ^ (1ul << pos)];
+               if ((rank_map_[l] ^ partner) >> intra_node_bits_) {
+                    res[pos] = kInterNodeSwapCost_;
+                    break;
+               }
+          }
+     }
+
+     VLOG(4) << "GetGlobalQubitsSwapCost(): cost = " << print(res);
+     return res;
+}
+
+SimulatorMPI::PauliMasks SimulatorMPI::GetPauliMasks(
+    const Term &term, const std::vector<Index> &ids) const
+{
+     PauliMasks res{0, 0, 0, 0, 0};
+     for (auto &op: term) {
+          if (op.first >= ids.size()) {
+               auto message = "GetPauliMasks(): term acts on more qubits than "
+                              "contained in ids";
+               LOG(ERROR) << message;
+               world_.barrier();
+               throw std::runtime_error(message);
+          }
+
+          auto pos = ArrayFind(locals_, ids[op.first]);
+          bool local = pos != kNotFound_;
+          if (!local) {
+               pos = ArrayFindSure(globals_, ids[op.first]);
+          }
+          auto &x = local ? res.local_x : res.global_x;
+          auto &z = local ? res.local_z : res.global_z;
+
+          switch (op.second) {
+               case 'X':
+                    x |= 1ul << pos;
+                    break;
+               case 'Y':
+                    x |= 1ul << pos;
+                    z |= 1ul << pos;
+                    ++res.num_y;
+                    break;
+               case 'Z':
+                    z |= 1ul << pos;
+                    break;
+               default:
+                    auto message = (boost::format("GetPauliMasks(): unknown "
+                                                  "Pauli operator %c")
+                                    % op.second)
+                                       .str();
+                    LOG(ERROR) << message;
+                    world_.barrier();
+                    throw std::runtime_error(message);
+          }
+     }
+     return res;
+}
+
+template <class F>
+void SimulatorMPI::ExchangeChunks(const Complex *data, size_t size,
+                                  int partner, F f)
+{
+     // f(chunk, begin, end) gets entries [begin, end) of the data of the
+     // (logical) partner rank
+     partner = PhysicalRank(static_cast<uint64_t>(partner));
+     size_t chunk = std::min(size, std::size_t(1ul << 20));
+     std::vector<Complex> buffer(chunk);
+     for (size_t begin = 0; begin < size; begin += chunk) {
+          MPI_Sendrecv(data + begin, static_cast<int>(chunk),
+                       mpi::get_mpi_datatype<Complex>(), partner, 0,
+                       buffer.data(), static_cast<int>(chunk),
+                       mpi::get_mpi_datatype<Complex>(), partner, 0, world_,
+                       MPI_STATUS_IGNORE);
+          f(buffer.data(), begin, begin + chunk);
+     }
+}
+
+void SimulatorMPI::PauliPass(const Complex *other, size_t begin, size_t end,
+                             uint64_t local_x,
+                             const std::vector<uint64_t> &local_z,
+                             std::vector<Complex> &sums) const
+{
+     // other[j - begin] is the amplitude that the Pauli strings map the local
+     // index j ^ local_x to; sums[t] accumulates conj(other) * P_t psi
+#pragma omp parallel
+     {
+          std::vector<Complex> part(sums.size(), 0.);
+#pragma omp for schedule(static)
+          for (size_t j = begin; j < end; ++j) {
+               auto i = j ^ local_x;
+               auto v = std::conj(other[j - begin]) * vec_[i];
+               for (size_t t = 0; t < local_z.size(); ++t) {
+                    if (std::bitset<64>(i & local_z[t]).count() & 1) {
+                         part[t] -= v;
+                    }
+                    else {
+                         part[t] += v;
+                    }
+               }
+          }
+#pragma omp critical
+          for (size_t t = 0; t < sums.size(); ++t) {
+               sums[t] += part[t];
+          }
+     }
+}
+
+SimulatorMPI::Float SimulatorMPI::GetExpectationValue(
+    const TermsDict &td, const std::vector<Index> &ids)
+{
+     VLOG(1) << boost::format("GetExpectationValue(): %d terms; ids = ")
+                    % td.size()
+             << print(ids);
+
+     WaitSwapQubits();
+     FlushNormalization();
+
+     // P|i> = i^num_y (-1)^|i & z| |i ^ x>, so terms flipping the same bits
+     // share the pass over the state vector
+     std::map<uint64_t, std::map<uint64_t, std::vector<size_t>>> groups;
+     std::vector<PauliMasks> masks;
+     for (size_t t = 0; t < td.size(); ++t) {
+          masks.push_back(GetPauliMasks(td[t].first, ids));
+          groups[masks[t].global_x][masks[t].local_x].push_back(t);
+     }
+
+     const Complex kPowI[4] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+     Complex local_sum = 0.;
+     auto add_group = [&](const std::vector<size_t> &terms,
+                          const std::vector<Complex> &sums) {
+          for (size_t k = 0; k < terms.size(); ++k) {
+               auto &m = masks[terms[k]];
+               Complex factor = td[terms[k]].second * kPowI[m.num_y % 4];
+               if (std::bitset<64>(rank_ & m.global_z).count() & 1) {
+                    factor = -factor;
+               }
+               local_sum += factor * sums[k];
+          }
+     };
+
+     for (auto &global_group: groups) {
+          auto global_x = global_group.first;
+          if (global_x == 0) {
+               for (auto &group: global_group.second) {
+                    std::vector<uint64_t> local_z;
+                    for (auto t: group.second) {
+                         local_z.push_back(masks[t].local_z);
+                    }
+                    std::vector<Complex> sums(local_z.size(), 0.);
+                    PauliPass(vec_.data(), 0, vec_.size(), group.first,
+                              local_z, sums);
+                    add_group(group.second, sums);
+               }
+               continue;
+          }
+
+          // the flipped amplitudes are on the partner rank, every group
+          // uses each of its chunks
+          std::vector<std::vector<Complex>> sums;
+          for (auto &group: global_group.second) {
+               sums.emplace_back(group.second.size(), 0.);
+          }
+
+          ExchangeChunks(
+              vec_.data(), vec_.size(), static_cast<int>(rank_ ^ global_x),
+              [&](const Complex *other, size_t begin, size_t end) {
+                   size_t g = 0;
+                   for (auto &group: global_group.second) {
+                        std::vector<uint64_t> local_z;
+                        for (auto t: group.second) {
+                             local_z.push_back(masks[t].local_z);
+                        }
+                        PauliPass(other, begin, end, group.first, local_z,
+                                  sums[g++]);
+                   }
+              });
+
+          size_t g = 0;
+          for (auto &group: global_group.second) {
+               add_group(group.second, sums[g++]);
+          }
+     }
+
+     Complex sum = mpi::all_reduce(world_, local_sum, std::plus<Complex>());
+     return sum.real();
+}
+
+void SimulatorMPI::ApplyPauliSum(const ComplexTermsDict &td,
+                                 const std::vector<Index> &ids,
+                                 const StateVector &in, StateVector &out)
+{
+     // (P in)[k ^ x] += i^num_y (-1)^|k & z| in[k], the source k lives on
+     // the partner rank if global qubits are flipped
+     std::map<uint64_t, std::map<uint64_t, std::vector<size_t>>> groups;
+     std::vector<PauliMasks> masks;
+     for (size_t t = 0; t < td.size(); ++t) {
+          masks.push_back(GetPauliMasks(td[t].first, ids));
+          groups[masks[t].global_x][masks[t].local_x].push_back(t);
+     }
+
+     const Complex kPowI[4] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+     for (auto &global_group: groups) {
+          auto source_rank = rank_ ^ global_group.first;
+
+          // per-term constants and local sign masks of every group
+          std::vector<std::vector<Complex>> factors;
+          std::vector<std::vector<uint64_t>> local_z;
+          for (auto &group: global_group.second) {
+               factors.emplace_back();
+               local_z.emplace_back();
+               for (auto t: group.second) {
+                    Complex factor = td[t].second * kPowI[masks[t].num_y % 4];
+                    if (std::bitset<64>(source_rank & masks[t].global_z).count()
+                        & 1) {
+                         factor = -factor;
+                    }
+                    factors.back().push_back(factor);
+                    local_z.back().push_back(masks[t].local_z);
+               }
+          }
+
+          auto apply = [&](const Complex *src, size_t begin, size_t end) {
+               size_t g = 0;
+               for (auto &group: global_group.second) {
+                    auto local_x = group.first;
+                    auto &f = factors[g];
+                    auto &z = local_z[g];
+                    ++g;
+#pragma omp parallel for schedule(static)
+                    for (size_t k = begin; k < end; ++k) {
+                         Complex acc = 0.;
+                         for (size_t t = 0; t < f.size(); ++t) {
+                              if (std::bitset<64>(k & z[t]).count() & 1) {
+                                   acc -= f[t];
+                              }
+                              else {
+                                   acc += f[t];
+                              }
+                         }
+                         out[k ^ local_x] += acc * src[k - begin];
+                    }
+               }
+          };
+
+          if (global_group.first == 0) {
+               apply(in.data(), 0, in.size());
+          }
+          else {
+               ExchangeChunks(in.data(), in.size(),
+                              static_cast<int>(source_rank), apply);
+          }
+     }
+}
+
+void SimulatorMPI::ApplyQubitOperator(const ComplexTermsDict &td,
+                                      const std::vector<Index> &ids)
+{
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kUnsupported, std::string("ApplyQubitOperator"));
+
+     VLOG(1) << boost::format("ApplyQubitOperator(): %d terms; ids = ")
+                    % td.size()
+             << print(ids);
+
+     if (fused_gates_.size() > 0 || pending_normalization_) {
+          Run();
+     }
+     WaitSwapQubits();
+
+     StateVector out(vec_.size(), 0., vec_.get_allocator());
+     ApplyPauliSum(td, ids, vec_, out);
+     CopyVector(out, vec_);
+}
+
+void SimulatorMPI::EmulateTimeEvolution(const TermsDict &td, Float time,
+                                        const std::vector<Index> &ids,
+                                        const std::vector<Index> &ctrl)
+{
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kUnsupported, std::string("EmulateTimeEvolution"));
+
+     VLOG(1) << boost::format(
+                    "EmulateTimeEvolution(): %d terms; time = %.3lf; ids = ")
+                    % td.size() % time
+             << print(ids);
+     VLOG(1) << "EmulateTimeEvolution(): ctrl = " << print(ctrl);
+
+     if (fused_gates_.size() > 0 || pending_normalization_) {
+          Run();
+     }
+     WaitSwapQubits();
+
+     // the identity terms only contribute a phase
+     const Complex kI(0., 1.);
+     Float tr = 0.;
+     Float op_nrm = 0.;
+     ComplexTermsDict ctd;
+     for (auto &term: td) {
+          if (term.first.empty()) {
+               tr += term.second;
+          }
+          else {
+               ctd.emplace_back(term.first, term.second);
+               op_nrm += std::abs(term.second);
+          }
+     }
+
+     auto s = static_cast<unsigned>(std::abs(time) * op_nrm + 1.);
+     Complex correction = std::exp(-time * kI * tr / static_cast<Float>(s));
+
+     auto local_ctrl_mask = IdsToBits(ctrl, locals_);
+     auto global_ctrl_mask = IdsToBits(ctrl, globals_);
+     // the other ranks still take part in the exchanges
+     bool active = (rank_ & global_ctrl_mask) == global_ctrl_mask;
+
+     // the terms of the series are summed up in vec_ itself
+     StateVector term(vec_.size(), vec_.get_allocator());
+     StateVector update(vec_.size(), vec_.get_allocator());
+     for (unsigned i = 0; i < s; ++i) {
+          CopyVector(vec_, term);
+          Float nrm_change = 1.;
+          for (unsigned k = 0; nrm_change > 1.e-12; ++k) {
+               auto coeff = (-time * kI) / static_cast<Float>(s * (k + 1));
+               FillVector<StateVector>(update.begin(), update.end(), 0.);
+               ApplyPauliSum(ctd, ids, term, update);
+
+               Float local_change = 0.;
+#pragma omp parallel for reduction(+ : local_change) schedule(static)
+               for (size_t j = 0; j < vec_.size(); ++j) {
+                    update[j] *= coeff;
+                    if (active && (j & local_ctrl_mask) == local_ctrl_mask) {
+                         vec_[j] += update[j];
+                         local_change += std::norm(update[j]);
+                    }
+               }
+               std::swap(term, update);
+               nrm_change = std::sqrt(
+                   mpi::all_reduce(world_, local_change, std::plus<Float>()));
+          }
+
+#pragma omp parallel for schedule(static)
+          for (size_t j = 0; j < vec_.size(); ++j) {
+               if (active && (j & local_ctrl_mask) == local_ctrl_mask) {
+                    vec_[j] *= correction;
+               }
+          }
+     }
+}
+
+SimulatorMPI::Float SimulatorMPI::Entropy()
+{
+     Reduction r;
+     r.AddEntropy();
+     return Reduce(r)[0];
+}
+
+std::vector<SimulatorMPI::Float> SimulatorMPI::Reduce(const Reduction &r)
+{
+     VLOG(1) << boost::format("Reduce(): %d values") % r.size();
+     WaitSwapQubits();
+     FlushNormalization();
+
+     // probabilities that can't be nonzero on this rank are left out
+     std::vector<MaskedSum> sums;
+     for (auto &p: r.probabilities_) {
+          if (p.bit_string.size() != p.ids.size()) {
+               auto message = "Reduce(): ids.size() != bit_string.size()";
+               LOG(ERROR) << message;
+               world_.barrier();
+               throw std::runtime_error(message);
+          }
+
+          MaskedSum sum{p.slot, 0, 0};
+          bool here = true;
+          for (size_t i = 0; i < p.ids.size(); ++i) {
+               auto pos = ArrayFind(locals_, p.ids[i]);
+               if (pos != kNotFound_) {
+                    sum.local_msk |= 1ul << pos;
+                    sum.local_val |= static_cast<uint64_t>(p.bit_string[i])
+                                     << pos;
+               }
+               else {
+                    pos = ArrayFindSure(globals_, p.ids[i]);
+                    here &= (rank_ >> pos & 1) == p.bit_string[i];
+               }
+          }
+          if (here) {
+               sums.push_back(sum);
+          }
+     }
+
+     return reduce_internal(r.size(), sums, r.entropy_);
+}
+
+std::vector<SimulatorMPI::Index> SimulatorMPI::ExtractLocalCtrls(
+    const std::vector<Index> &ctrl) const
+{
+     std::vector<Index> new_ctrl;
+     for (auto i: ctrl) {
+          auto pos = ArrayFind(locals_, i);
+          if (pos != kNotFound_) {
+               new_ctrl.push_back(i);
+          }
+     }
 
      return new_ctrl;
 }
@@ -710,6 +2200,9 @@ std::vector<SimulatorMPI::Index> SimulatorMPI::ExtractLocalCtrls(
 void SimulatorMPI::ApplyGate(Matrix m, std::vector<Index> ids,
                              std::vector<Index> ctrls)
 {
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kApplyGate, m, ids, ctrls);
+
      VLOG(1) << "ApplyGate(): ids = " << print(ids);
      VLOG(1) << "ApplyGate(): ctrls = " << print(ctrls);
      VLOG(3) << "ApplyGate(): globals = " << print(globals_);
@@ -727,10 +2220,33 @@ void SimulatorMPI::ApplyGate(Matrix m, std::vector<Index> ids,
      auto global_ctrl_mask = IdsToBits(ctrls, globals_);
      auto local_ctrls = ExtractLocalCtrls(ctrls);
 
+     if (global_id_mask != 0 && !diag && ApplyGlobalPermutation(m, ids, ctrls)) {
+          return;
+     }
+
      if (ids.size() + local_ctrls.size() > kMaxClusterSize_) {
           VLOG(2) << "ApplyGate(): flushing fusion before huge gate";
           Run();
      }
+     else if (pending_normalization_) {
+          // the pending projection must not make the cluster too large
+          auto qubits = fused_gates_.set_;
+          qubits.insert(fused_gates_.ctrl_set_.begin(),
+                        fused_gates_.ctrl_set_.end());
+          for (auto id: ids) {
+               if (ArrayFind(locals_, id) != kNotFound_) {
+                    qubits.insert(id);
+               }
+          }
+          qubits.insert(local_ctrls.begin(), local_ctrls.end());
+          if (qubits.size() > kMaxClusterSize_) {
+               VLOG(2) << "ApplyGate(): flushing pending normalization";
+               Run();
+          }
+     }
+
+     fused_qubits_.insert(ids.begin(), ids.end());
+     fused_qubits_.insert(ctrls.begin(), ctrls.end());
 
      if ((rank_ & global_ctrl_mask) != global_ctrl_mask) {
           VLOG(3) << "ApplyGate(): don't apply gate at this rank";
@@ -814,6 +2330,80 @@ void SimulatorMPI::ApplyGate(Matrix m, std::vector<Index> ids,
      fused_gates_.insert(m, flags, ids, ctrls);
 }
 
+bool SimulatorMPI::ApplyGlobalPermutation(const Matrix &m,
+                                          const std::vector<Index> &ids,
+                                          const std::vector<Index> &ctrls)
+{
+     // m = P * D, with P a permutation of the basis states of ids and D
+     // diagonal, can be applied to global qubits with global controls by
+     // applying D and then relabeling the ranks
+     std::vector<size_t> ids_pos;
+     for (auto id: ids) {
+          ids_pos.push_back(ArrayFind(globals_, id));
+          if (ids_pos.back() == kNotFound_) {
+               return false;
+          }
+     }
+     if (!ExtractLocalCtrls(ctrls).empty()) {
+          return false;
+     }
+
+     std::vector<uint64_t> perm(m.size(), kNotFound_);
+     Matrix d(m.size());
+     bool phases = false;
+     for (size_t col = 0; col < m.size(); ++col) {
+          d[col].resize(m.size());
+          for (size_t row = 0; row < m.size(); ++row) {
+               if (m[row][col] == Complex(0.)) {
+                    continue;
+               }
+               if (perm[col] != kNotFound_) {
+                    return false;
+               }
+               perm[col] = row;
+               d[col][col] = m[row][col];
+               phases |= m[row][col] != Complex(1.);
+          }
+          if (perm[col] == kNotFound_) {
+               return false;
+          }
+     }
+     std::vector<bool> hit(m.size(), false);
+     for (auto row: perm) {
+          if (hit[row]) {
+               return false;
+          }
+          hit[row] = true;
+     }
+
+     VLOG(2) << "ApplyGlobalPermutation(): perm = " << print(perm);
+
+     WaitSwapQubits();
+     if (phases) {
+          ApplyGate(d, ids, ctrls);
+     }
+
+     auto ctrl_mask = IdsToBits(ctrls, globals_);
+     RelabelRanks([&](uint64_t l) {
+          if ((l & ctrl_mask) != ctrl_mask) {
+               return l;
+          }
+          uint64_t col = 0;
+          for (size_t i = 0; i < ids_pos.size(); ++i) {
+               col |= (l >> ids_pos[i] & 1) << i;
+               l &= ~(1ul << ids_pos[i]);
+          }
+          for (size_t i = 0; i < ids_pos.size(); ++i) {
+               l |= (perm[col] >> i & 1) << ids_pos[i];
+          }
+          return l;
+     });
+
+     ++stage_gates;
+     ++total_gates;
+     return true;
+}
+
 void SimulatorMPI::calcLocalApproxDistribution(const size_t n)
 {
      block_distribution.resize(n, bc::default_init);
@@ -838,6 +2428,76 @@ void SimulatorMPI::calcLocalApproxDistribution(const size_t n)
                       block_distribution.begin());
 }
 
+uint64_t SimulatorMPI::SampleLocalIndex(Float rnd) const
+{
+     // block_distribution holds the prefix sums of the local blocks
+     auto n = block_distribution.size();
+     auto block = static_cast<size_t>(
+         std::upper_bound(block_distribution.begin(), block_distribution.end(),
+                          rnd)
+         - block_distribution.begin());
+     block = std::min(block, n - 1);
+
+     Float shift = block > 0 ? block_distribution[block - 1] : 0.;
+     uint64_t block_size = vec_.size() / n;
+     uint64_t k = block * block_size;
+     uint64_t last = k;
+     for (uint64_t j = 0; j < block_size; ++j, ++k) {
+          auto pr = std::norm(vec_[k]);
+          if (pr > 0) {
+               last = k;
+               shift += pr;
+               if (shift > rnd) {
+                    break;
+               }
+          }
+     }
+
+     return last;
+}
+
+std::vector<SimulatorMPI::Float> SimulatorMPI::reduce_internal(
+    size_t size, const std::vector<MaskedSum> &sums,
+    const std::vector<size_t> &entropy)
+{
+     std::vector<Float> local(size, 0.);
+     Float local_entropy = 0.;
+
+#pragma omp parallel
+     {
+          std::vector<Float> part(sums.size(), 0.);
+          Float e = 0.;
+#pragma omp for schedule(static)
+          for (size_t i = 0; i < vec_.size(); ++i) {
+               auto pr = std::norm(vec_[i]);
+               if (!entropy.empty() && pr > 0) {
+                    e += pr * log2(pr);
+               }
+               for (size_t k = 0; k < sums.size(); ++k) {
+                    if ((i & sums[k].local_msk) == sums[k].local_val) {
+                         part[k] += pr;
+                    }
+               }
+          }
+#pragma omp critical
+          {
+               for (size_t k = 0; k < sums.size(); ++k) {
+                    local[sums[k].slot] += part[k];
+               }
+               local_entropy -= e;
+          }
+     }
+
+     for (auto slot: entropy) {
+          local[slot] = local_entropy;
+     }
+
+     std::vector<Float> res(size, 0.);
+     mpi::all_reduce(world_, local.data(), static_cast<int>(size), res.data(),
+                     std::plus<Float>());
+     return res;
+}
+
 SimulatorMPI::Float SimulatorMPI::getProbability_internal(uint64_t local_msk,
                                                           uint64_t local_val,
                                                           uint64_t global_msk,
@@ -849,24 +2509,77 @@ SimulatorMPI::Float SimulatorMPI::getProbability_internal(uint64_t local_msk,
                     % local_msk % local_val % global_msk % global_val;
      VLOG(4) << boost::format("getProbability_internal(): local state vector: ")
              << print(vec_);
-     Float local_probability = 0.;
+
+     std::vector<MaskedSum> sums;
      if ((rank_ & global_msk) == global_val) {
-#pragma omp parallel for reduction(+ : local_probability) schedule(static)
-          for (size_t i = 0; i < vec_.size(); ++i) {
-               if ((i & local_msk) == local_val) {
-                    local_probability += std::norm(vec_[i]);
+          sums.push_back({0, local_msk, local_val});
+     }
+     Float probability = reduce_internal(1, sums, {})[0];
+
+     VLOG(1) << boost::format("getProbability_internal(): probability = %.3lf")
+                    % probability;
+
+     return probability;
+}
+
+std::vector<SimulatorMPI::Float> SimulatorMPI::getMarginal_internal(
+    const std::vector<Index> &ids)
+{
+     // outcome bits of the low local bits are looked up in a table, the ones
+     // of the high local bits are computed once per row of the table
+     constexpr size_t kLowBits = 12;
+     size_t low_bits = std::min(locals_.size(), kLowBits);
+
+     std::vector<uint64_t> local_key(locals_.size(), 0);
+     uint64_t rank_key = 0;
+     for (size_t i = 0; i < ids.size(); ++i) {
+          auto pos = ArrayFind(locals_, ids[i]);
+          if (pos != kNotFound_) {
+               local_key[pos] = 1ul << i;
+          }
+          else {
+               pos = ArrayFindSure(globals_, ids[i]);
+               if (rank_ >> pos & 1) {
+                    rank_key |= 1ul << i;
+               }
+          }
+     }
+
+     std::vector<uint64_t> low_key(1ul << low_bits, rank_key);
+     for (size_t j = 0; j < low_key.size(); ++j) {
+          for (size_t pos = 0; pos < low_bits; ++pos) {
+               if (j >> pos & 1) {
+                    low_key[j] |= local_key[pos];
                }
           }
      }
 
-     Float probability
-         = mpi::all_reduce(world_, local_probability, std::plus<Float>());
-     VLOG(1) << boost::format(
-                    "getProbability_internal(): local_probability = %.3lf; "
-                    "probability = %.3lf")
-                    % local_probability % probability;
+     std::vector<Float> res(1ul << ids.size(), 0.);
+     size_t rows = vec_.size() >> low_bits;
 
-     return probability;
+#pragma omp parallel
+     {
+          std::vector<Float> hist(res.size(), 0.);
+#pragma omp for schedule(static)
+          for (size_t r = 0; r < rows; ++r) {
+               uint64_t high_key = 0;
+               for (size_t pos = low_bits; pos < locals_.size(); ++pos) {
+                    if (r >> (pos - low_bits) & 1) {
+                         high_key |= local_key[pos];
+                    }
+               }
+               size_t base = r << low_bits;
+               for (size_t j = 0; j < low_key.size(); ++j) {
+                    hist[high_key | low_key[j]] += std::norm(vec_[base + j]);
+               }
+          }
+#pragma omp critical
+          for (size_t k = 0; k < res.size(); ++k) {
+               res[k] += hist[k];
+          }
+     }
+
+     return res;
 }
 
 void SimulatorMPI::normalize(Float norm, uint64_t local_msk, uint64_t local_val,
@@ -874,6 +2587,40 @@ void SimulatorMPI::normalize(Float norm, uint64_t local_msk, uint64_t local_val,
 {
      norm = 1. / std::sqrt(norm);
 
+     std::vector<Index> ids;
+     std::vector<bool> values;
+     for (size_t pos = 0; pos < locals_.size(); ++pos) {
+          if (local_msk >> pos & 1) {
+               ids.push_back(locals_[pos]);
+               values.push_back(local_val >> pos & 1);
+          }
+     }
+     for (size_t pos = 0; pos < globals_.size(); ++pos) {
+          if (global_msk >> pos & 1) {
+               ids.push_back(globals_[pos]);
+               values.push_back(global_val >> pos & 1);
+          }
+     }
+
+     if (ids.size() <= kMaxClusterSize_) {
+          // the projector, scaled by the norm, is fused with the next gates so
+          // that it doesn't need a pass over the state vector of its own
+          Matrix m(1ul << ids.size());
+          for (size_t i = 0; i < m.size(); ++i) {
+               m[i].resize(m.size(), 0.);
+          }
+          size_t k = 0;
+          for (size_t i = 0; i < ids.size(); ++i) {
+               k |= static_cast<size_t>(values[i]) << i;
+          }
+          m[k][k] = norm;
+
+          VLOG(2) << "normalize(): deferred to the next Run()";
+          ApplyGate(m, ids, {});
+          pending_normalization_ = true;
+          return;
+     }
+
      if ((rank_ & global_msk) != global_val) {
           FillVector<StateVector>(vec_.begin(), vec_.end(), 0);
      }
@@ -894,74 +2641,90 @@ void SimulatorMPI::normalize(Float norm, uint64_t local_msk, uint64_t local_val,
 #endif
 }
 
-std::vector<bool> SimulatorMPI::MeasureQubits(std::vector<Index> const &ids)
+void SimulatorMPI::FlushNormalization()
 {
-     VLOG(1) << "MeasureQubits(): ids = " << print(ids);
+     if (pending_normalization_) {
+          Run();
+     }
+}
 
-     auto start_measure_time = Clock::now();
+void SimulatorMPI::FlushNormalizationBeforeSwap(
+    const std::vector<Index> &swap_pairs)
+{
+     if (!pending_normalization_) {
+          return;
+     }
+
+     // the pending projection waits for the cluster following the swap
+     // (which may be applied to the received chunks) unless the swap moves
+     // one of the qubits of the fused gates: a local one would leave this
+     // rank, and the value of a global one is folded into the gates
+     for (auto id: swap_pairs) {
+          if (fused_qubits_.count(id)) {
+               VLOG(2) << "FlushNormalizationBeforeSwap(): swapped qubits";
+               Run();
+               return;
+          }
+     }
+}
 
+uint64_t SimulatorMPI::SampleIndex()
+{
      uint64_t n = std::min(vec_.size(), std::size_t(1ul << 15));
      calcLocalApproxDistribution(n);
 
-     total_block_distribution.resize(n * world_.size(), bc::default_init);
+     // only the per-rank totals are exchanged: the rank owning the sample is
+     // found from their prefix sums and searches its own distribution
+     Float local_total = block_distribution[n - 1];
+     Float inclusive = mpi::scan(world_, local_total, std::plus<Float>());
+     Float exclusive = inclusive - local_total;
+     Float total = mpi::all_reduce(world_, local_total, std::plus<Float>());
 
-     mpi::all_gather(world_, block_distribution.data(), static_cast<int>(n),
-                     total_block_distribution.data());
+     Float rnd = rng_() * total;
 
-     Float shift = 0;
-     for (int i = 0; i < world_.size(); ++i) {
-          Float new_shift = total_block_distribution[i * n + n - 1];
-          for (size_t j = 0, k = i * n; j < n; ++j, ++k) {
-               total_block_distribution[k] += shift;
-          }
-          shift += new_shift;
+     // the second candidate is used if rounding puts rnd past the last sum
+     int candidates[2] = {-1, -1};
+     if (exclusive <= rnd && rnd < inclusive) {
+          candidates[0] = world_.rank();
      }
-
-     Float rnd = rng_();
-     uint64_t i = 0;
-     for (; i < total_block_distribution.size(); ++i) {
-          if (rnd <= total_block_distribution[i])
-               break;
+     if (local_total > 0) {
+          candidates[1] = world_.rank();
      }
+     int owners[2];
+     mpi::all_reduce(world_, candidates, 2, owners, mpi::maximum<int>());
+     int src_rank = owners[0] != -1 ? owners[0] : owners[1];
 
-     uint64_t src_rank = i / n;
-     uint64_t src_index = i % n;
-
-     VLOG(1) << boost::format(
-                    "MeasureQubits(): rnd = %.3lf; src_rank: %u, src_index: %u")
-                    % rnd % src_rank % src_index;
+     VLOG(1) << boost::format("SampleIndex(): rnd = %.3lf; src_rank: %d") % rnd
+                    % src_rank;
 
-     auto res = std::vector<bool>(ids.size());
-     if (static_cast<int>(src_rank) == world_.size()) {
-          auto message
-              = (boost::format("MeasureQubits(): Random number %.3lf > norm "
-                               "partial sum %.3lf")
-                 % rnd % total_block_distribution.back())
-                    .str();
+     if (src_rank == -1) {
+          auto message = "SampleIndex(): state vector has zero norm";
           LOG(ERROR) << message;
           world_.barrier();
           throw std::runtime_error(message);
      }
 
-     uint64_t block_size = vec_.size() / n;
-     uint64_t k = 0;
-     if (rank_ == static_cast<int>(src_rank)) {
-          shift = 0;
-          if (i > 0) {
-               shift = total_block_distribution[i - 1];
-          }
-
-          k = src_index * block_size;
-          for (uint64_t j = 0; j < block_size; ++j, ++k) {
-               shift += std::norm(vec_[k]);
-               if (shift >= rnd) {
-                    break;
-               }
-          }
+     uint64_t res_index = 0;
+     if (world_.rank() == src_rank) {
+          res_index = (static_cast<uint64_t>(rank_) << locals_.size())
+                      + SampleLocalIndex(rnd - exclusive);
      }
+     mpi::broadcast(world_, res_index, src_rank);
+     return res_index;
+}
+
+std::vector<bool> SimulatorMPI::MeasureQubits(std::vector<Index> const &ids)
+{
+     TraceWriter::Scope trace(trace_.get());
+     VLOG(1) << "MeasureQubits(): ids = " << print(ids);
+     WaitSwapQubits();
+     FlushNormalization();
+
+     auto start_measure_time = Clock::now();
 
-     uint64_t res_index = (src_rank << locals_.size()) + k;
-     mpi::broadcast(world_, res_index, static_cast<int>(src_rank));
+     auto res = std::vector<bool>(ids.size());
+     uint64_t res_index = SampleIndex();
+     uint64_t src_rank = res_index >> locals_.size();
 
      VLOG(1) << boost::format("MeasureQubits(): res_index: %u") % res_index;
 
@@ -973,7 +2736,7 @@ std::vector<bool> SimulatorMPI::MeasureQubits(std::vector<Index> const &ids)
      uint64_t global_msk = 0;
      uint64_t global_val = 0;
 
-     for (i = 0; i < ids.size(); ++i) {
+     for (size_t i = 0; i < ids.size(); ++i) {
           auto id = ids[i];
           auto pos = ArrayFind(locals_, id);
           if (pos != kNotFound_) {
@@ -986,7 +2749,7 @@ std::vector<bool> SimulatorMPI::MeasureQubits(std::vector<Index> const &ids)
           else {
                pos = ArrayFindSure(globals_, id);
                global_msk |= 1ul << pos;
-               if (src_rank & (1ul << pos)) {
+               if (static_cast<uint64_t>(src_rank) & (1ul << pos)) {
                     global_val |= 1ul << pos;
                     res[i] = true;
                }
@@ -1004,16 +2767,321 @@ std::vector<bool> SimulatorMPI::MeasureQubits(std::vector<Index> const &ids)
      VLOG(1) << boost::format("MeasureQubits(): duration = %.3lf")
                     % measure_duration;
 
+     Record(trace, TraceOp::kMeasureQubits, ids, res);
+     return res;
+}
+
+std::vector<bool> SimulatorMPI::MeasureAndDeallocate(
+    std::vector<Index> const &ids)
+{
+     TraceWriter::Scope trace(trace_.get());
+     VLOG(1) << "MeasureAndDeallocate(): ids = " << print(ids);
+     WaitSwapQubits();
+     FlushNormalization();
+
+     auto start_measure_time = Clock::now();
+
+     auto res = std::vector<bool>(ids.size());
+     uint64_t res_index = SampleIndex();
+     uint64_t src_rank = res_index >> locals_.size();
+
+     VLOG(1) << boost::format("MeasureAndDeallocate(): res_index: %u")
+                    % res_index;
+
+     // as in DeallocateQubit(), local qubits are only dropped while there are
+     // enough of them
+     size_t max_drop = locals_.size();
+     if (GlobalQubitsCount() != 0) {
+          max_drop = locals_.size() > kMinLocal_ ? locals_.size() - kMinLocal_
+                                                 : 0;
+     }
+
+     std::vector<size_t> drop_pos;
+     uint64_t drop_val = 0;
+     uint64_t keep_msk = 0;
+     uint64_t keep_val = 0;
+     uint64_t global_msk = 0;
+     uint64_t global_val = 0;
+     std::vector<Index> remaining;
+
+     for (size_t i = 0; i < ids.size(); ++i) {
+          auto pos = ArrayFind(locals_, ids[i]);
+          if (pos != kNotFound_) {
+               res[i] = res_index >> pos & 1;
+               if (drop_pos.size() < max_drop) {
+                    drop_pos.push_back(pos);
+                    drop_val |= static_cast<uint64_t>(res[i]) << pos;
+               }
+               else {
+                    keep_msk |= 1ul << pos;
+                    keep_val |= static_cast<uint64_t>(res[i]) << pos;
+                    remaining.push_back(ids[i]);
+               }
+          }
+          else {
+               pos = ArrayFindSure(globals_, ids[i]);
+               res[i] = src_rank >> pos & 1;
+               global_msk |= 1ul << pos;
+               global_val |= static_cast<uint64_t>(res[i]) << pos;
+               remaining.push_back(ids[i]);
+          }
+     }
+     std::sort(drop_pos.begin(), drop_pos.end());
+
+     Float local_norm = 0.;
+     {
+          StateVector out(vec_.size() >> drop_pos.size(), 0.,
+                          vec_.get_allocator());
+          if ((rank_ & global_msk) == global_val) {
+#pragma omp parallel for schedule(static) reduction(+ : local_norm)
+               for (size_t j = 0; j < out.size(); ++j) {
+                    // insert the outcome bits of the dropped qubits
+                    uint64_t i = j;
+                    for (auto pos: drop_pos) {
+                         i = (i >> pos << (pos + 1)) | (i & ((1ul << pos) - 1));
+                    }
+                    i |= drop_val;
+
+                    if ((i & keep_msk) == keep_val) {
+                         out[j] = vec_[i];
+                         local_norm += std::norm(out[j]);
+                    }
+               }
+          }
+          // shrinking keeps the storage of the state vector
+          vec_.resize(out.size());
+          CopyVector(out, vec_);
+     }
+
+     for (auto it = drop_pos.rbegin(); it != drop_pos.rend(); ++it) {
+          locals_.erase(locals_.begin() + *it);
+     }
+
+     auto norm = mpi::all_reduce(world_, local_norm, std::plus<Float>());
+
+     // the renormalisation is applied by the next Run()
+     ApplyGate({{Complex(1. / std::sqrt(norm))}}, {}, {});
+     pending_normalization_ = true;
+
+     auto measure_duration
+         = Duration(Clock::now() - start_measure_time).count();
+     total_measure_duration += measure_duration;
+     VLOG(1) << boost::format("MeasureAndDeallocate(): duration = %.3lf")
+                    % measure_duration;
+
+     for (auto id: remaining) {
+          DeallocateQubit(id);
+     }
+
+     Record(trace, TraceOp::kMeasureAndDeallocate, ids, res);
      return res;
 }
 
+std::map<uint64_t, uint64_t> SimulatorMPI::Sample(
+    std::vector<Index> const &ids, uint64_t shots, uint64_t seed)
+{
+     VLOG(1) << boost::format("Sample(): ids = %s; shots = %u") % print(ids)
+                    % shots;
+     WaitSwapQubits();
+     FlushNormalization();
+
+     if (ids.size() > 64) {
+          auto message = "Sample(): can't sample more than 64 qubits";
+          LOG(ERROR) << message;
+          world_.barrier();
+          throw std::runtime_error(message);
+     }
+
+     // bit of the outcome for each local bit, and the rank part of it
+     std::vector<uint64_t> local_bits(locals_.size(), 0);
+     uint64_t rank_key = 0;
+     for (size_t i = 0; i < ids.size(); ++i) {
+          auto pos = ArrayFind(locals_, ids[i]);
+          if (pos != kNotFound_) {
+               local_bits[pos] = 1ul << i;
+          }
+          else {
+               pos = ArrayFindSure(globals_, ids[i]);
+               if (rank_ >> pos & 1) {
+                    rank_key |= 1ul << i;
+               }
+          }
+     }
+
+     uint64_t n = std::min(vec_.size(), std::size_t(1ul << 15));
+     calcLocalApproxDistribution(n);
+
+     Float local_total = block_distribution[n - 1];
+     Float inclusive = mpi::scan(world_, local_total, std::plus<Float>());
+     Float exclusive = inclusive - local_total;
+     Float total = mpi::all_reduce(world_, local_total, std::plus<Float>());
+     int last_rank = mpi::all_reduce(world_,
+                                     local_total > 0 ? world_.rank() : -1,
+                                     mpi::maximum<int>());
+
+     // every rank draws the same sorted variates and keeps its own range
+     mpi::broadcast(world_, seed, 0);
+     RndEngine eng(seed);
+     std::uniform_real_distribution<Float> dist(0., total);
+     std::vector<Float> variates(shots);
+     for (auto &v: variates) {
+          v = dist(eng);
+     }
+     std::sort(variates.begin(), variates.end());
+
+     auto first = std::lower_bound(variates.begin(), variates.end(), exclusive);
+     auto last = world_.rank() == last_rank
+                     ? variates.end()
+                     : std::lower_bound(first, variates.end(), inclusive);
+     if (local_total <= 0) {
+          last = first;
+     }
+     std::vector<Float> rnds(first, last);
+     for (auto &v: rnds) {
+          v -= exclusive;
+     }
+
+     // each block resolves its own variates, like SampleLocalIndex()
+     std::vector<size_t> block_start(n + 1, rnds.size());
+     block_start[0] = 0;
+     for (size_t b = 1; b < n; ++b) {
+          block_start[b] = std::lower_bound(rnds.begin(), rnds.end(),
+                                            block_distribution[b - 1])
+                           - rnds.begin();
+     }
+
+     std::vector<uint64_t> samples(rnds.size());
+     uint64_t block_size = vec_.size() / n;
+#pragma omp parallel for schedule(dynamic)
+     for (size_t b = 0; b < n; ++b) {
+          auto vi = block_start[b];
+          auto vend = block_start[b + 1];
+          if (vi == vend) {
+               continue;
+          }
+
+          Float shift = b > 0 ? block_distribution[b - 1] : 0.;
+          uint64_t k = b * block_size;
+          uint64_t last_k = k;
+          for (uint64_t j = 0; j < block_size && vi < vend; ++j, ++k) {
+               auto pr = std::norm(vec_[k]);
+               if (pr > 0) {
+                    last_k = k;
+                    shift += pr;
+                    while (vi < vend && rnds[vi] < shift) {
+                         samples[vi++] = k;
+                    }
+               }
+          }
+          while (vi < vend) {
+               samples[vi++] = last_k;
+          }
+     }
+
+     std::map<uint64_t, uint64_t> local_counts;
+     for (auto k: samples) {
+          uint64_t key = rank_key;
+          for (size_t pos = 0; pos < local_bits.size(); ++pos) {
+               if (k >> pos & 1) {
+                    key |= local_bits[pos];
+               }
+          }
+          ++local_counts[key];
+     }
+
+     std::vector<std::map<uint64_t, uint64_t>> all_counts;
+     mpi::all_gather(world_, local_counts, all_counts);
+
+     std::map<uint64_t, uint64_t> counts;
+     for (auto &c: all_counts) {
+          for (auto &it: c) {
+               counts[it.first] += it.second;
+          }
+     }
+
+     return counts;
+}
+
+void SimulatorMPI::MovePermutedAmplitudes(size_t begin,
+                                          const std::vector<uint64_t> &dest,
+                                          StateVector &out)
+{
+     // dest[j] is the full index of the amplitude vec_[begin + j] (or
+     // kNotFound_ if it is zero); the ones of other ranks are sent as
+     // (local index, amplitude) pairs with one all-to-all
+     auto local_bits = locals_.size();
+     uint64_t local_msk = vec_.size() - 1;
+     int size = world_.size();
+
+     std::vector<int> send_counts(size, 0);
+     for (size_t j = 0; j < dest.size(); ++j) {
+          if (dest[j] == kNotFound_) {
+               continue;
+          }
+          auto dst_rank = PhysicalRank(dest[j] >> local_bits);
+          if (dst_rank == world_.rank()) {
+               out[dest[j] & local_msk] += vec_[begin + j];
+          }
+          else {
+               ++send_counts[dst_rank];
+          }
+     }
+
+     std::vector<int> recv_counts(size);
+     MPI_Alltoall(send_counts.data(), 1, MPI_INT, recv_counts.data(), 1,
+                  MPI_INT, world_);
+
+     std::vector<int> send_displs(size + 1, 0);
+     std::vector<int> recv_displs(size + 1, 0);
+     for (int r = 0; r < size; ++r) {
+          send_displs[r + 1] = send_displs[r] + send_counts[r];
+          recv_displs[r + 1] = recv_displs[r] + recv_counts[r];
+     }
+
+     std::vector<uint64_t> send_idx(send_displs[size]);
+     std::vector<Complex> send_val(send_displs[size]);
+     auto pos = send_displs;
+     for (size_t j = 0; j < dest.size(); ++j) {
+          if (dest[j] == kNotFound_) {
+               continue;
+          }
+          auto dst_rank = PhysicalRank(dest[j] >> local_bits);
+          if (dst_rank != world_.rank()) {
+               send_idx[pos[dst_rank]] = dest[j] & local_msk;
+               send_val[pos[dst_rank]] = vec_[begin + j];
+               ++pos[dst_rank];
+          }
+     }
+
+     std::vector<uint64_t> recv_idx(recv_displs[size]);
+     std::vector<Complex> recv_val(recv_displs[size]);
+     MPI_Alltoallv(send_idx.data(), send_counts.data(), send_displs.data(),
+                   mpi::get_mpi_datatype<uint64_t>(), recv_idx.data(),
+                   recv_counts.data(), recv_displs.data(),
+                   mpi::get_mpi_datatype<uint64_t>(), world_);
+     MPI_Alltoallv(send_val.data(), send_counts.data(), send_displs.data(),
+                   mpi::get_mpi_datatype<Complex>(), recv_val.data(),
+                   recv_counts.data(), recv_displs.data(),
+                   mpi::get_mpi_datatype<Complex>(), world_);
+
+     for (size_t k = 0; k < recv_idx.size(); ++k) {
+          out[recv_idx[k]] += recv_val[k];
+     }
+}
+
 void SimulatorMPI::collapseWaveFunction(const std::vector<Index> &ids,
                                         const std::vector<bool> &values)
 {
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kCollapseWavefunction, ids, values);
+
      VLOG(1) << boost::format("collapseWaveFunction(): ids: ") << print(ids);
      VLOG(1) << boost::format("collapseWaveFunction(): values: ")
              << print(values);
 
+     WaitSwapQubits();
+     FlushNormalization();
+
      uint64_t local_msk = 0;
      uint64_t local_val = 0;
      uint64_t global_msk = 0;
@@ -1059,41 +3127,81 @@ void SimulatorMPI::collapseWaveFunction(const std::vector<Index> &ids,
 
 void SimulatorMPI::SwapQubitsWrapper(const std::vector<Index> &swap_pairs)
 {
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kSwapQubits, swap_pairs);
+     StartSwapQubits(swap_pairs);
+     WaitSwapQubits();
+}
+
+void SimulatorMPI::StartSwapQubits(const std::vector<Index> &swap_pairs)
+{
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kStartSwapQubits, swap_pairs);
+     WaitSwapQubits();
+     FlushNormalizationBeforeSwap(swap_pairs);
+     if (swap_pairs.empty()) {
+          return;
+     }
+
      EndStage();
-     auto start_swap_time = Clock::now();
+     start_swap_time = Clock::now();
+
+     VLOG(1) << "StartSwapQubits(): swap_pairs = " << printPairs(swap_pairs);
+
+     // the exchange needs its own thread to make MPI calls
+     BeginSwap(swap_pairs, mpi::environment::thread_level()
+                               == mpi::threading::level::multiple);
+
+     StartStage();
+}
+
+void SimulatorMPI::WaitSwapQubits()
+{
+     if (pending_swap_.empty()) {
+          return;
+     }
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kWaitSwapQubits);
 
-     VLOG(1) << "SwapQubitsWrapper(): swap_pairs = " << printPairs(swap_pairs);
+     int qubits = static_cast<int>(pending_swap_.size() / 2);
+     auto clusters = overlap_clusters_.size();
 
-     SwapQubits(swap_pairs);
+     FinishSwap();
 
      auto swap_duration = Duration(Clock::now() - start_swap_time).count();
      total_swap_duration += swap_duration;
 
-     int qubits = static_cast<int>(swap_pairs.size() / 2);
      Float frac = 1 - Float{1} / (1ul << qubits);
      Float swapped_bytes = 16 * frac * (1ul << locals_.size());
      auto bandwidth
          = (Float{1} / (1ul << 30)) * swapped_bytes * 8 / swap_duration;
      VLOG(1) << boost::format(
-                    "SwapQubitsWrapper(): duration = %.3lf; qubits = %d; "
-                    "bandwidth = %.3lf Gb/s")
-                    % swap_duration % (swap_pairs.size() / 2) % bandwidth;
-
-     StartStage();
+                    "WaitSwapQubits(): duration = %.3lf; qubits = %d; "
+                    "bandwidth = %.3lf Gb/s; overlapped clusters = %d")
+                    % swap_duration % qubits % bandwidth % clusters;
 }
 
 void SimulatorMPI::SwapQubits(const std::vector<Index> &swap_pairs)
 {
-     VLOG(1) << "SwapQubits(): swap_pairs = " << printPairs(swap_pairs);
-     VLOG(3) << "SwapQubits(): locals = " << print(locals_);
-     VLOG(3) << "SwapQubits(): globals = " << print(globals_);
+     TraceWriter::Scope trace(trace_.get());
+     Record(trace, TraceOp::kSwapQubits, swap_pairs);
+     WaitSwapQubits();
+     FlushNormalizationBeforeSwap(swap_pairs);
+     BeginSwap(swap_pairs, false);
+     FinishSwap();
+}
+
+void SimulatorMPI::BeginSwap(const std::vector<Index> &swap_pairs, bool async)
+{
+     VLOG(1) << "BeginSwap(): swap_pairs = " << printPairs(swap_pairs);
+     VLOG(3) << "BeginSwap(): locals = " << print(locals_);
+     VLOG(3) << "BeginSwap(): globals = " << print(globals_);
 
      auto color = static_cast<uint64_t>(rank_);
      for (size_t i = 0; i < swap_pairs.size(); i += 2) {
           color &= ~(1ul << ArrayFindSure(globals_, swap_pairs[i]));
      }
 
-     static std::vector<uint64_t> swapBits;
      std::map<Index, Index> pos;
      for (size_t i = 0; i < swap_pairs.size(); i += 2) {
           pos[swap_pairs[i]] = ArrayFindSure(globals_, swap_pairs[i]);
@@ -1101,40 +3209,207 @@ void SimulatorMPI::SwapQubits(const std::vector<Index> &swap_pairs)
      }
 
      if (pos.size() != swap_pairs.size()) {
-          auto message = "SwapQubits(): each qubit should be unique";
+          auto message = "BeginSwap(): each qubit should be unique";
           LOG(ERROR) << message;
           world_.barrier();
           throw std::runtime_error(message);
      }
 
-     q2bits_ng<uint64_t>(swapBits, swap_pairs, pos);
-     auto comm = world_.split(static_cast<int>(color));
-     VLOG(3) << boost::format("SwapQubits(): color = %d; comm.size() = %d")
-                    % color % comm.size();
+     q2bits_ng<uint64_t>(pending_swap_bits_, swap_pairs, pos);
+
+     buffs_.resize(1ul << 18);
+
+     uint64_t n_bits = swap_pairs.size() / 2;
+     auto n = SwapperMT::calcSendCount(1ul << n_bits, locals_.size(),
+                                       buffs_.size());
+     pending_swap_chunk_bits_ = 0;
+     while ((2ul << pending_swap_chunk_bits_) <= n) {
+          ++pending_swap_chunk_bits_;
+     }
+
+     pending_swap_local_msk_ = 0;
+     for (size_t i = 0; i < swap_pairs.size(); i += 2) {
+          auto pos_global = ArrayFindSure(globals_, swap_pairs[i]);
+          auto pos_local = ArrayFindSure(locals_, swap_pairs[i + 1]);
+          pending_swap_local_msk_ |= 1ul << pos_local;
+          std::swap(locals_[pos_local], globals_[pos_global]);
+     }
+
+     // ordered by logical rank, so that the rank in comm is made of the
+     // swapped global bits
+     swap_comm_ = world_.split(static_cast<int>(color), rank_);
+     VLOG(3) << boost::format("BeginSwap(): color = %d; comm.size() = %d")
+                    % color % swap_comm_.size();
 
      // this check is made to satisfy automated code inspection
-     uint64_t comm_size = comm.size();
+     uint64_t comm_size = swap_comm_.size();
      if (comm_size == 0) {
-          auto message = "SwapQubits(): world.split() returned comm of 0 size";
+          auto message = "BeginSwap(): world.split() returned comm of 0 size";
           LOG(ERROR) << message;
           world_.barrier();
           throw std::runtime_error(message);
      }
 
-     buffs_.resize(1ul << 18);
+     pending_swap_ = swap_pairs;
+     pending_swap_color_ = color;
+
+     swapper_.reset(new SwapperMT(world_, vec_, static_cast<uint64_t>(rank_),
+                                  locals_.size(), comm_size, buffs_, n_bits));
+     swapper_->chunk_handler
+         = [this](SwapperMT::swap_buffers_type::swap_arrays_type &arrs,
+                  size_t size) {
+                if (overlap_clusters_.empty()) {
+                     return false;
+                }
+                ChunkView<Complex> chunk(arrs.rvalues.data(), size);
+                for (auto &c: overlap_clusters_) {
+                     ApplyKernel(chunk, c.m, c.ids_pos, c.ctrl_mask, c.diag,
+                                 true);
+                }
+                return true;
+           };
+
+     if (async) {
+          swap_thread_ = std::thread([this]() {
+               try {
+                    swapper_->doSwap(static_cast<int>(swapper_->rank),
+                                     swap_comm_, pending_swap_color_,
+                                     pending_swap_bits_);
+               }
+               catch (...) {
+                    swap_error_ = std::current_exception();
+               }
+          });
+     }
+
+     VLOG(3) << "BeginSwap(): (processed) locals = " << print(locals_);
+     VLOG(3) << "BeginSwap(): (processed) globals = " << print(globals_);
+}
 
-     SwapperMT s(world_, vec_, static_cast<uint64_t>(rank_), locals_.size(),
-                 comm_size, buffs_, swap_pairs.size() / 2);
-     s.doSwap(rank_, comm, color, swapBits);
+void SimulatorMPI::FinishSwap()
+{
+     if (swap_thread_.joinable()) {
+          swap_thread_.join();
+     }
+     else {
+          swapper_->doSwap(rank_, swap_comm_, pending_swap_color_,
+                           pending_swap_bits_);
+     }
 
-     for (size_t i = 0; i < swap_pairs.size(); i += 2) {
-          auto pos_global = ArrayFindSure(globals_, swap_pairs[i]);
-          auto pos_local = ArrayFindSure(locals_, swap_pairs[i + 1]);
-          std::swap(locals_[pos_local], globals_[pos_global]);
+     pending_swap_.clear();
+     overlap_clusters_.clear();
+     swapper_.reset();
+
+     if (swap_error_) {
+          auto error = swap_error_;
+          swap_error_ = nullptr;
+          std::rethrow_exception(error);
+     }
+}
+
+size_t SimulatorMPI::SwapChunkBit(size_t pos) const
+{
+     // a received swap chunk holds 2^pending_swap_chunk_bits_ consecutive
+     // values of the non-swapped local bits, for every combination of the
+     // swapped ones (which become the upper bits of the chunk)
+     if (pending_swap_local_msk_ >> pos & 1) {
+          uint64_t n_bits = pending_swap_.size() / 2;
+          for (size_t bi = 0; bi < n_bits; ++bi) {
+               auto sw_bit
+                   = pending_swap_bits_[pending_swap_bits_[n_bits + bi]];
+               if (sw_bit == 1ul << pos) {
+                    return pending_swap_chunk_bits_ + bi;
+               }
+          }
+          return kNotFound_;
+     }
+
+     auto below = pending_swap_local_msk_ & ((1ul << pos) - 1);
+     auto chunk_pos = pos - std::bitset<64>(below).count();
+     if (chunk_pos >= pending_swap_chunk_bits_) {
+          return kNotFound_;
+     }
+     return chunk_pos;
+}
+
+bool SimulatorMPI::OverlapWithSwap(Matrix &m,
+                                   const std::vector<uint32_t> &ids_pos,
+                                   uint64_t ctrl_mask, bool diag)
+{
+     // the received chunks wait for their clusters, which keep up with the
+     // exchange up to a dense gate on four qubits; costlier clusters are
+     // better applied by all threads once the swap is complete
+     auto cost = [](size_t num_ids, bool is_diag) {
+          return is_diag ? size_t(1) : size_t(1) << num_ids;
+     };
+     auto total_cost = cost(ids_pos.size(), diag);
+     for (auto &o: overlap_clusters_) {
+          total_cost += cost(o.ids_pos.size(), o.diag);
+     }
+     if (total_cost > kMaxOverlapCost_) {
+          return false;
+     }
+
+     OverlapCluster c{Matrix(), ids_pos, 0, diag};
+
+     for (auto &p: c.ids_pos) {
+          auto chunk_pos = SwapChunkBit(p);
+          if (chunk_pos == kNotFound_) {
+               return false;
+          }
+          p = static_cast<uint32_t>(chunk_pos);
+     }
+
+     for (size_t pos = 0; pos < locals_.size(); ++pos) {
+          if (ctrl_mask >> pos & 1) {
+               auto chunk_pos = SwapChunkBit(pos);
+               if (chunk_pos == kNotFound_) {
+                    return false;
+               }
+               c.ctrl_mask |= 1ul << chunk_pos;
+          }
+     }
+
+     c.m = std::move(m);
+
+     // the swap applies the cluster to the chunks it receives from now on,
+     // the ones it has already scattered are left to this thread
+     size_t chunks = 0;
+     {
+          std::lock_guard<std::mutex> lock(swapper_->chunk_mutex);
+          overlap_clusters_.push_back(c);
+          chunks = swapper_->chunks_done;
      }
+     ApplyToSwappedChunks(c, chunks);
+
+     ++total_overlapped_clusters;
+     return true;
+}
+
+void SimulatorMPI::ApplyToSwappedChunks(const OverlapCluster &c, size_t chunks)
+{
+     VLOG(2) << boost::format("ApplyToSwappedChunks(): %d of %d chunks")
+                    % chunks % swapper_->chunkCount();
+
+     auto size = swapper_->n * swapper_->comm_size;
 
-     VLOG(3) << "SwapQubits(): (processed) locals = " << print(locals_);
-     VLOG(3) << "SwapQubits(): (processed) globals = " << print(globals_);
+     // every chunk is gathered as the swap received it, so that the
+     // cluster's positions are the same
+#pragma omp parallel if (chunks > 1)
+     {
+          std::vector<Complex> values(size);
+          std::vector<uint64_t> indices(size);
+          ChunkView<Complex> chunk(values.data(), size);
+#pragma omp for schedule(static)
+          for (size_t k = 0; k < chunks; ++k) {
+               swapper_->gatherChunk(k, values.data(), indices.data(),
+                                     pending_swap_bits_);
+               ApplyKernel(chunk, c.m, c.ids_pos, c.ctrl_mask, c.diag, false);
+               for (size_t i = 0; i < size; ++i) {
+                    vec_[indices[i]] = values[i];
+               }
+          }
+     }
 }
 
 void SimulatorMPI::StartStage()
@@ -15,17 +15,27 @@
 #ifndef SIMULATORMPI_HPP
 #define SIMULATORMPI_HPP
 
+#include <array>
 #include <boost/container/vector.hpp>
 #include <boost/mpi.hpp>
 #include <chrono>
 #include <complex>
+#include <exception>
 #include <functional>
+#include <initializer_list>
+#include <map>
+#include <memory>
 #include <random>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include "simulator-mpi/ExecutionPlan.hpp"
 #include "simulator-mpi/SwapArrays.hpp"
+#include "simulator-mpi/Trace.hpp"
 #include "simulator-mpi/alignedallocator.hpp"
 #include "simulator-mpi/fusion_mpi.hpp"
+#include "simulator-mpi/mappedallocator.hpp"
 
 namespace mpi = boost::mpi;
 namespace bc = boost::container;
@@ -40,6 +50,8 @@ namespace bc = boost::container;
 #     define EXPORT_API
 #endif  // _WIN32
 
+class SwapperMT;
+
 class EXPORT_API SimulatorMPI
 {
 public:
@@ -48,31 +60,113 @@ public:
      using Complex = std::complex<Float>;
      using Matrix
          = std::vector<std::vector<Complex, aligned_allocator<Complex, 64>>>;
-     using StateVector = bc::vector<Complex, aligned_allocator<Complex, 64>>;
+     using StateVector = bc::vector<Complex, mapped_allocator<Complex, 64>>;
      using RndEngine = std::mt19937;
      using Duration = std::chrono::duration<Float>;
      using Clock = std::chrono::high_resolution_clock;
+     using Term = std::vector<std::pair<unsigned, char>>;
+     using TermsDict = std::vector<std::pair<Term, Float>>;
+     using ComplexTermsDict = std::vector<std::pair<Term, Complex>>;
 
      static constexpr size_t kNotFound_ = static_cast<size_t>(-1);
+
+     //! Set of observables evaluated together by Reduce()
+     /*!
+      * \brief Every Add*() method reserves slots in the array returned by
+               Reduce() and returns the index of the first one.
+      */
+     class Reduction
+     {
+     public:
+          //! Squared norm of the state vector
+          size_t AddNorm()
+          {
+               return AddProbability({}, {});
+          }
+
+          //! Shannon entropy of the measurement outcomes of all qubits
+          size_t AddEntropy()
+          {
+               entropy_.push_back(size_);
+               return size_++;
+          }
+
+          //! Probability of measuring bit_string on the qubits ids
+          size_t AddProbability(const std::vector<bool> &bit_string,
+                                const std::vector<Index> &ids)
+          {
+               probabilities_.push_back({size_, bit_string, ids});
+               return size_++;
+          }
+
+          //! Probability of measuring 1 on each of the qubits ids (one slot each)
+          size_t AddQubitProbabilities(const std::vector<Index> &ids)
+          {
+               auto first = size_;
+               for (auto id: ids) {
+                    AddProbability({true}, {id});
+               }
+               return first;
+          }
+
+          //! Number of slots
+          size_t size() const
+          {
+               return size_;
+          }
+
+     private:
+          friend class SimulatorMPI;
+
+          struct Probability
+          {
+               size_t slot;
+               std::vector<bool> bit_string;
+               std::vector<Index> ids;
+          };
+
+          size_t size_ = 0;
+          std::vector<size_t> entropy_;
+          std::vector<Probability> probabilities_;
+     };
+
      //! Constructor
      /*!
       * \param seed Seed for pseudo-random number generator
       * \param max_local Maximum number of local qubits
       * \param max_cluster_size Maximum number of qubits in fused multi-qubit gate
+      * \param max_memory Maximum size in bytes of the local state vector (0 for no
+                limit)
+      * \param out_of_core_dir Directory (on a local disk) of the files holding the
+                state vector, see SimulatorMPI(mpi::communicator, ...)
       */
-     SimulatorMPI(uint64_t seed, size_t max_local, size_t max_cluster_size);
+     SimulatorMPI(uint64_t seed, size_t max_local, size_t max_cluster_size,
+                  size_t max_memory = 0,
+                  const std::string &out_of_core_dir = std::string());
 
      //! Constructor
      /*!
       * \brief With this constructor you can define your own MPI communicator which
                must be able to work with `2^N` processes, where N is the number of qubits.
+               The processes are renumbered so that the lowest rank bits (and thus the
+               first global qubits) stay within a node, see GetGlobalQubitsSwapCost().
       * \param aWorld A MPI communicator
       * \param seed Seed for pseudo-random number generator
       * \param max_local Maximum number of local qubits
       * \param max_cluster_size Maximum number of qubits in fused multi-qubit gate
+      * \param max_memory Maximum size in bytes of the local state vector (0 for no
+                limit)
+      * \param out_of_core_dir If not empty, the state vector of this simulator is
+                memory-mapped files in this directory (on a local disk), so that
+                max_local (and max_memory) may go beyond the memory; the page
+                cache reads them ahead and writes them behind. Temporary vectors
+                stay in memory, other simulators are not affected
+      * \throw std::runtime_error if the state vector can't be mapped in
+               out_of_core_dir
       */
      SimulatorMPI(mpi::communicator aWorld, uint64_t seed, size_t max_local,
-                  size_t max_cluster_size);
+                  size_t max_cluster_size, size_t max_memory = 0,
+                  const std::string &out_of_core_dir = std::string());
 
      //! Copy constructor
      /*!
@@ -87,6 +181,8 @@ public:
      //! Allocate one qubit with a given ID
      /*!
       * \param id ID of the qubit to allocate
+      * \throw std::runtime_error if all qubits are allocated or the local state
+               vector would exceed the memory budget
       */
      void AllocateQubit(Index id);
 
@@ -114,10 +210,14 @@ public:
 
      //! Save gate and than apply it to function Run()
      /*!
+      * A gate that only permutes (up to phases) global qubits under global controls,
+      * e.g. X, CNOT or SWAP between global qubits, is applied at once by relabeling
+      * the ranks, without moving any amplitude.
       * \param m Matrix of the gate
       * \param ids Array of qubit IDs
       * \param ctrl Array of control qubits
-      * \throw std::runtime_error if gate is non-diagonal
+      * \throw std::runtime_error if gate is non-diagonal on global qubits and is not
+               such a permutation
       */
      void ApplyGate(Matrix m, std::vector<Index> ids, std::vector<Index> ctrl);
 
@@ -128,6 +228,31 @@ public:
       */
      std::vector<bool> MeasureQubits(std::vector<Index> const &ids);
 
+     //! Measure qubits and de-allocate them
+     /*!
+      * \brief The outcome is sampled as in MeasureQubits(), then the amplitudes
+               agreeing with it are compacted into the smaller state vector in a
+               single parallel pass. The renormalisation is deferred to the next
+               Run(). Measured qubits that can't be dropped from the local ones
+               (global qubits, or local ones when there are too few of them) are
+               collapsed in the same pass and then de-allocated by DeallocateQubit().
+      * \param ids Array of qubit IDs to measure and de-allocate
+      * \return Bit array of measurement results (containing either True or False)
+      */
+     std::vector<bool> MeasureAndDeallocate(std::vector<Index> const &ids);
+
+     //! Sample measurement outcomes without collapsing the state
+     /*!
+      * \brief All shots are drawn in a single pass over the state vector
+      * \param ids Array of qubit IDs to sample
+      * \param shots Number of samples
+      * \param seed Seed for the pseudo-random number generator (taken from rank 0)
+      * \return Map from outcome (bit i is the value of qubit ids[i]) to the number
+                of times it was drawn
+      */
+     std::map<uint64_t, uint64_t> Sample(std::vector<Index> const &ids,
+                                         uint64_t shots, uint64_t seed);
+
      //! See SwapQubits()
      /*!
       * \brief Print logs: duration, qubits, bandwidth
@@ -142,6 +267,37 @@ public:
       */
      void SwapQubits(const std::vector<Index> &swap_pairs_ids);
 
+     //! Start swapping global and local qubits in pairs
+     /*!
+      * \brief The qubit permutation is updated immediately and the state
+               vector is exchanged chunk by chunk by a background thread (if
+               MPI provides MPI_THREAD_MULTIPLE, otherwise by WaitSwapQubits()).
+               A cluster passed to Run() in between that fits in a chunk, e.g.
+               one acting on the qubits that have just become local, and costs
+               no more than a dense gate on four qubits is applied on all
+               threads to the chunks already received, and by the swap (also
+               on all threads) to the later ones before they are unpacked into
+               the state vector. The other clusters, and the calls that need
+               the whole state vector, wait for the swap.
+      * \param swap_pairs_ids See SwapQubits()
+      */
+     void StartSwapQubits(const std::vector<Index> &swap_pairs_ids);
+
+     //! Complete the swap started by StartSwapQubits()
+     /*!
+      * \note Does nothing if there is no pending swap
+      */
+     void WaitSwapQubits();
+
+     /*!
+      * \return Number of clusters applied while a swap was pending (see
+                StartSwapQubits())
+      */
+     size_t OverlappedClustersCount() const
+     {
+          return total_overlapped_clusters;
+     }
+
      /*!
       * \brief Return the amplitude of the supplied amplitude index
       * \param bit_string Index amplitude
@@ -153,6 +309,20 @@ public:
      Complex GetAmplitude(const std::vector<bool> &bit_string,
                           const std::vector<Index> &ids) const;
 
+     /*!
+      * \brief Return the amplitudes of several basis states with a single
+               collective operation: every rank works out the owner of each
+               amplitude, the owners send theirs in one MPI_Allgatherv.
+      * \param bit_strings Array of basis states
+      * \param ids Array of qubit IDs
+      * \return Amplitude of each of the bit strings, on every rank
+      * \throw std::runtime_error if the number of IDs does not match the number
+               of qubits, if any of the desired qubits are not already allocated
+               or if the length of any bit string does not match the number of IDs
+      */
+     StateVector GetAmplitudes(const std::vector<std::vector<bool>> &bit_strings,
+                               const std::vector<Index> &ids) const;
+
      /*!
       * \brief Return the probability of the outcome bit_string when measuring
       *        the quantum register qureg.
@@ -165,11 +335,83 @@ public:
      Float GetProbability(const std::vector<bool> &bit_string,
                           const std::vector<Index> &ids);
 
+     /*!
+      * \brief Return the probabilities of all outcomes when measuring the qubits
+               ids, computed in a single pass over the state vector.
+      * \param ids Array of qubit IDs (at most kMaxMarginalQubits_)
+      * \return Array of 2^ids.size() probabilities, bit i of the index is the value
+                of qubit ids[i]
+      * \throw std::runtime_error if there are too many qubits
+      */
+     std::vector<Float> GetMarginalDistribution(const std::vector<Index> &ids);
+
+     /*!
+      * \brief Return the probabilities of several outcomes of measuring the qubits
+               ids, computed in a single pass over the state vector.
+      * \param bit_strings Array of measurement outcomes
+      * \param ids Array of qubit IDs
+      * \return Probability of each of the bit strings
+      * \throw std::runtime_error if the length of any bit string does not match the
+               number of IDs
+      */
+     std::vector<Float> GetProbabilities(
+         const std::vector<std::vector<bool>> &bit_strings,
+         const std::vector<Index> &ids);
+
+     /*!
+      * \brief Return the expectation value of a sum of Pauli strings.
+               Terms are grouped by the qubits they flip, so that every group is
+               evaluated in one pass over the state vector (exchanging it with the
+               partner rank if global qubits are flipped).
+      * \param td Array of terms (pairs of index in ids and one of 'X', 'Y', 'Z') and
+                their coefficients
+      * \param ids Array of qubit IDs
+      * \return Expectation value
+      * \throw std::runtime_error if a term refers to an index out of ids
+      */
+     Float GetExpectationValue(const TermsDict &td,
+                               const std::vector<Index> &ids);
+
+     /*!
+      * \brief Apply a (possibly non-unitary) sum of Pauli strings to the state,
+               without re-normalizing it.
+      * \param td Array of terms (see GetExpectationValue()) and their coefficients
+      * \param ids Array of qubit IDs
+      * \throw std::runtime_error if a term refers to an index out of ids
+      */
+     void ApplyQubitOperator(const ComplexTermsDict &td,
+                             const std::vector<Index> &ids);
+
+     /*!
+      * \brief Apply exp(-i * time * H), where H is a sum of Pauli strings, using a
+               truncated Taylor series in int(|time| * |H| + 1) steps.
+      * \param td Array of terms of H (see GetExpectationValue()) and their
+                coefficients
+      * \param time Evolution time
+      * \param ids Array of qubit IDs
+      * \param ctrl Array of control qubits
+      * \throw std::runtime_error if a term refers to an index out of ids
+      */
+     void EmulateTimeEvolution(const TermsDict &td, Float time,
+                               const std::vector<Index> &ids,
+                               const std::vector<Index> &ctrl);
+
      /*!
       * \brief Return the entropy of quantum state.
       */
      Float Entropy();
 
+     /*!
+      * \brief Evaluate all the observables of r in a single threaded pass over
+               the state vector, followed by one all_reduce of the packed results.
+      * \param r Observables
+      * \return Array of r.size() values, indexed by the slots returned by the
+                Add*() methods of r
+      * \throw std::runtime_error if the length of a bit string does not match the
+               number of its IDs or if a qubit is not allocated
+      */
+     std::vector<Float> Reduce(const Reduction &r);
+
      /*!
       * \brief Get permutation of qubits.
       * \return Array of qubit IDs
@@ -188,6 +430,25 @@ public:
       */
      std::vector<Index> GetGlobalQubitsPermutation();
 
+     /*!
+      * \brief Get the relative cost of swapping each global qubit with a local one.
+               Qubits whose rank bit only splits processes within a node cost 1, the
+               ones that cross the network for any process (as mapped by the rank
+               relabelings of ApplyGate()) cost kInterNodeSwapCost_.
+      * \return Array of costs in the order of GetGlobalQubitsPermutation()
+      */
+     std::vector<Float> GetGlobalQubitsSwapCost() const;
+
+     /*!
+      * \return Logical rank of this process, i.e. the global bits of the part
+                of the state vector it holds (it may differ from the rank in the
+                communicator once global qubits have been flipped by relabeling)
+      */
+     int GetRank() const
+     {
+          return rank_;
+     }
+
      //! Set permutation to all qubits without actually reordering quantum state vector
      /*!
       * \param p Array of qubit IDs
@@ -200,9 +461,146 @@ public:
       * \return A tuple where the first entry is a dictionary mapping qubit
                 indices to bit-locations (all qubits) and the second entry is the local part
                 of state vector.
+      * \note The other member functions update the state vector in place, the
+              reference is only invalidated by allocating or deallocating
+              qubits (MeasureAndDeallocate() included)
       */
      std::tuple<std::map<int, int>, StateVector &> cheat_local();
 
+     /*!
+      * \brief Replace the state by a given wavefunction.
+               Since the whole state is replaced, the qubits are first reordered
+               (without moving any data) so that each process holds a contiguous
+               slice of the wavefunction, which is the only part it reads.
+      * \param wavefunction Pointer to the 2^ids.size() amplitudes, bit i of the
+                index being the state of ids[i] (it may be a memory-mapped file)
+      * \param size Number of amplitudes
+      * \param ids Array of qubit IDs, a permutation of all allocated qubits
+      * \throw std::runtime_error if ids is not a permutation of the allocated
+               qubits or size does not match
+      */
+     void SetWavefunction(const Complex *wavefunction, size_t size,
+                          const std::vector<Index> &ids);
+
+     /*!
+      * \brief Replace the state by a wavefunction which this process reads
+               through a callback (see SetWavefunction()), for wavefunctions
+               that aren't arrays of Complex in memory.
+      * \param size Number of amplitudes
+      * \param ids Array of qubit IDs, a permutation of all allocated qubits
+      * \param read Called (at most once) with the index of the first amplitude
+               of this process's slice, the local state vector and the number
+               of amplitudes to copy into it
+      * \throw std::runtime_error if ids is not a permutation of the allocated
+               qubits or size does not match
+      */
+     void SetWavefunction(
+         size_t size, const std::vector<Index> &ids,
+         const std::function<void(size_t, Complex *, size_t)> &read);
+
+     /*!
+      * \brief Replace the state by a wavefunction stored in a file, each process
+               reading only its slice with MPI-IO (see SetWavefunction()).
+      * \param path Raw file of 2^ids.size() complex doubles in native byte order
+      * \param ids Array of qubit IDs, a permutation of all allocated qubits
+      * \throw std::runtime_error if ids is not a permutation of the allocated
+               qubits, or the file cannot be read or has the wrong size
+      */
+     void SetWavefunctionFromFile(const std::string &path,
+                                  const std::vector<Index> &ids);
+
+     /*!
+      * \brief Replace the state by a computational basis state.
+      * \param bit_string State of each qubit
+      * \param ids Array of qubit IDs, a permutation of all allocated qubits
+      * \throw std::runtime_error if ids is not a permutation of the allocated
+               qubits or bit_string.size() != ids.size()
+      */
+     void SetBasisState(const std::vector<bool> &bit_string,
+                        const std::vector<Index> &ids);
+
+     //! Replace the state by the uniform superposition of all basis states
+     void SetUniformSuperposition();
+
+     /*!
+      * \brief Replace the state by a product state.
+      * \param states Amplitudes of |0> and |1> of each qubit (normalized)
+      * \param ids Array of qubit IDs, a permutation of all allocated qubits
+      * \throw std::runtime_error if ids is not a permutation of the allocated
+               qubits or states.size() != ids.size()
+      */
+     void SetProductState(const std::vector<std::array<Complex, 2>> &states,
+                          const std::vector<Index> &ids);
+
+     /*!
+      * \brief Gather the whole state vector on one MPI process.
+               The parts are received in place in the order of the (logical) ranks,
+               the other processes don't allocate anything.
+      * \param root Rank (in world_) of the process receiving the state vector
+      * \return The state vector of size 2^(local qubits) * world size (see
+                cheat_local() for the ordering) on root, an empty one elsewhere
+      */
+     StateVector GatherStateVector(int root = 0);
+
+     /*!
+      * \brief Save the state of the simulator to a file, with collective MPI-IO.
+               The file holds the whole state vector in the order of the qubits
+               (each process writes its slice), the qubit IDs, the state of the
+               random engine and the gate/run/stage counters. Pending gates are
+               applied first.
+      * \param path File to (over)write
+      * \throw std::runtime_error if the file cannot be written
+      */
+     void SaveCheckpoint(const std::string &path);
+
+     /*!
+      * \brief Restore the state saved by SaveCheckpoint(), possibly with another
+               number of processes: the qubits are distributed again and each
+               process reads its slice. If no qubit is allocated, the qubits of
+               the checkpoint are allocated first. Pending gates are discarded.
+      * \param path File written by SaveCheckpoint()
+      * \throw std::runtime_error if the file cannot be read, is not a checkpoint,
+               or the allocated qubits differ from the ones of the checkpoint
+      */
+     void LoadCheckpoint(const std::string &path);
+
+     /*!
+      * \brief Record the calls received from now on (allocations, gates, runs,
+               swaps, measurements and their outcomes) in a binary trace, which
+               hiq-replay replays without Python. Calls made by other calls are
+               not recorded, the ones that can't be replayed are recorded by name.
+      * \param path File written by the process of rank 0
+      * \throw std::runtime_error if qubits are allocated (the trace must start
+               from the empty state) or the file cannot be written
+      */
+     void StartTrace(const std::string &path);
+
+     //! Stop recording the trace started by StartTrace() and close its file
+     void StopTrace();
+
+     /*!
+      * \brief Execute a plan recorded from an earlier run with other values of
+               its parameters: the global qubits are first swapped back to the
+               ones of the recorded run, then the swaps and clusters of gates
+               are executed in order without scheduling them again. The fused
+               matrix of a cluster without parametric gates is kept in the plan
+               and reused as long as the process has the same logical rank and
+               global qubits. The plan is executed call by call while a trace is
+               recorded.
+      * \param plan Plan built with the Add*() methods of ExecutionPlan
+      * \param params Values of the parameters of the gates
+      * \throw std::runtime_error if there are fewer values than parameters or
+               the allocated qubits differ from the ones of the recorded run
+      */
+     void RunPlan(ExecutionPlan &plan, const std::vector<Float> &params);
+
+     /*!
+      * \brief Set the state of the pseudo-random number generator, e.g. to
+               replay the measurements of a trace.
+      * \param state State written by the generator's operator<<
+      */
+     void SetRandomState(const std::string &state);
+
      //! Collapse a quantum register into a classical basis state
      /*!
       * \param ids Array of qubit IDs
@@ -214,14 +612,77 @@ public:
                                const std::vector<bool> &values);
 
 
-     //! This function is not supported
+     //! Apply a classical function to the basis states
+     /*!
+      * \brief Every basis state |x_0, x_1, ...> (where x_i is the value of quregs[i])
+               is mapped to |f(x_0, x_1, ...)>. Amplitudes that move to another rank
+               are exchanged in batches with one all-to-all per batch.
+      * \param f Function modifying the register values in place, see
+               arithmetic.hpp for common ones
+      * \param quregs Array of quantum registers (arrays of qubit IDs)
+      * \param ctrl Array of control qubits
+      * \param num_threads Number of threads calling f (1 for functions that are
+               not thread-safe, e.g. Python callbacks)
+      */
      template <class F, class QuReg>
-     void emulate_math(F const &, QuReg, const std::vector<Index> &,
-                       unsigned = 1)
+     void emulate_math(F const &f, QuReg quregs, const std::vector<Index> &ctrl,
+                       unsigned num_threads = 1)
      {
-          world_.barrier();
-          throw std::runtime_error(
-              "SimulatorMPI::emulate_math() is not supported");
+          TraceWriter::Scope trace(trace_.get());
+          Record(trace, TraceOp::kUnsupported, std::string("emulate_math"));
+
+          std::vector<std::vector<size_t>> bits;
+          uint64_t ctrl_mask = 0;
+          PrepareEmulateMath(quregs, ctrl, bits, ctrl_mask);
+
+          uint64_t rank_index = static_cast<uint64_t>(rank_) << locals_.size();
+          StateVector out(vec_.size(), 0., vec_.get_allocator());
+
+          size_t batch = std::min(vec_.size(), std::size_t(1ul << 20));
+          std::vector<uint64_t> dest(batch);
+          for (size_t begin = 0; begin < vec_.size(); begin += batch) {
+#pragma omp parallel num_threads(num_threads)
+               {
+                    std::vector<int> x(bits.size());
+#pragma omp for schedule(static)
+                    for (size_t j = 0; j < batch; ++j) {
+                         uint64_t i = rank_index | (begin + j);
+                         if (vec_[begin + j] == Complex(0.)) {
+                              dest[j] = kNotFound_;
+                              continue;
+                         }
+                         if ((i & ctrl_mask) != ctrl_mask) {
+                              dest[j] = i;
+                              continue;
+                         }
+
+                         uint64_t new_i = i;
+                         for (size_t r = 0; r < bits.size(); ++r) {
+                              x[r] = 0;
+                              for (size_t b = 0; b < bits[r].size(); ++b) {
+                                   x[r] |= static_cast<int>(i >> bits[r][b] & 1)
+                                           << b;
+                                   new_i &= ~(1ul << bits[r][b]);
+                              }
+                         }
+                         f(x);
+                         for (size_t r = 0; r < bits.size(); ++r) {
+                              for (size_t b = 0; b < bits[r].size(); ++b) {
+                                   new_i |= static_cast<uint64_t>(x[r] >> b & 1)
+                                            << bits[r][b];
+                              }
+                         }
+                         dest[j] = new_i;
+                    }
+               }
+               MovePermutedAmplitudes(begin, dest, out);
+          }
+
+          // written back rather than swapped, see cheat_local()
+#pragma omp parallel for schedule(static)
+          for (size_t i = 0; i < out.size(); ++i) {
+               vec_[i] = out[i];
+          }
      }
 
      /*!
@@ -257,7 +718,16 @@ private:
      const Float kMaxFloatError_;
      const size_t kMinLocal_;
      const size_t kMaxLocal_;
+     const size_t kMaxMemory_;
      const size_t kMaxGlobal_;
+     const Float kInterNodeSwapCost_;
+     static constexpr size_t kMaxMarginalQubits_ = 20;
+     // bound on the multiplications per amplitude of the clusters applied by
+     // a swap to the received chunks (see OverlapWithSwap()); measured on a
+     // 2^22 amplitudes swap, a dense 4-qubit cluster takes about as long as
+     // the exchange on one thread, a 5-qubit one three times as long
+     static constexpr size_t kMaxOverlapCost_ = 16;
+     size_t intra_node_bits_;
      size_t kMaxClusterSize_;
      std::vector<Index> locals_;
      std::vector<Index> globals_;
@@ -266,7 +736,10 @@ private:
      RndEngine rnd_eng_;
      std::function<double()> rng_;
 
+     // rank_ is the logical rank, i.e. the global bits of the amplitudes held
+     // by this process; rank_map_[l] is the process holding logical rank l
      int rank_;
+     std::vector<int> rank_map_;
      SwapBuffers<Complex> buffs_;
 
      int run_gates = 0;
@@ -275,6 +748,7 @@ private:
      int stage_runs = 0;
      int total_runs = 0;
      int total_stages = 0;
+     size_t total_overlapped_clusters = 0;
      Float total_runs_duration = 0.0;
      Float total_swap_duration = 0.0;
      Float total_measure_duration = 0.0;
@@ -282,11 +756,70 @@ private:
      Float total_dealloc_duration = 0.0;
      Clock::time_point start_stage_time;
      Clock::time_point start_time;
+     Clock::time_point start_swap_time;
 
+     struct OverlapCluster
+     {
+          Matrix m;
+          std::vector<uint32_t> ids_pos;
+          uint64_t ctrl_mask;
+          bool diag;
+     };
+
+     std::vector<Index> pending_swap_;
+     std::vector<uint64_t> pending_swap_bits_;
+     uint64_t pending_swap_color_ = 0;
+     uint64_t pending_swap_local_msk_ = 0;
+     size_t pending_swap_chunk_bits_ = 0;
+     // read by the consumer thread of swapper_ under its chunk_mutex
+     std::vector<OverlapCluster> overlap_clusters_;
+     mpi::communicator swap_comm_;
+     std::unique_ptr<SwapperMT> swapper_;
+     // runs the exchange of swapper_ while Run() applies the clusters
+     std::thread swap_thread_;
+     std::exception_ptr swap_error_;
+
+     // only set on the process of rank 0 while a trace is recorded
+     std::unique_ptr<TraceWriter> trace_;
+     template <class... Args>
+     void Record(const TraceWriter::Scope &scope, TraceOp op,
+                 const Args &... args)
+     {
+          if (scope) {
+               trace_->Put(op);
+               (void) std::initializer_list<int>{(trace_->Put(args), 0)...};
+          }
+     }
+
+     // the projection and renormalisation of the last measurement is waiting
+     // in fused_gates_ for the next Run()
+     bool pending_normalization_ = false;
+     // qubits of the gates in fused_gates_, the same on every rank (unlike
+     // fused_gates_, which has the global qubits folded in)
+     std::set<Index> fused_qubits_;
+     void FlushNormalization();
+     void FlushNormalizationBeforeSwap(const std::vector<Index> &swap_pairs);
+     void RunFused(Matrix m, std::vector<Index> ids, std::vector<Index> ctrls,
+                   uint64_t flags, Clock::time_point start_run_time);
+     void ArrangeGlobals(const std::vector<Index> &target);
+
+     size_t MaxStateVectorSize() const;
      void AllocateLocalQubit(Index id);
+     void CheckLoading(const std::vector<Index> &ids,
+                       const char *caller) const;
+     void StartLoading(const std::vector<Index> &ids, const char *caller);
+     uint64_t LoadingSlice(const std::vector<Index> &ids, const char *caller);
+     uint64_t CompressedRank() const;
+     bool FileSlice(MPI_File file, MPI_Offset offset, uint64_t slice,
+                    bool write);
      void AllocateGlobalQubit(Index id);
      void DeallocateLocalQubit(Index id);
      void DeallocateGlobalQubit(Index id);
+     int PhysicalRank(uint64_t logical) const;
+     template <class F>
+     void RelabelRanks(F sigma);
+     bool ApplyGlobalPermutation(const Matrix &m, const std::vector<Index> &ids,
+                                 const std::vector<Index> &ctrls);
      void CheckNorm();
      size_t ArrayFind(const std::vector<Index> &v, Index val) const;
      size_t ArrayFindSure(const std::vector<Index> &v, Index val) const;
@@ -295,14 +828,87 @@ private:
      std::vector<Index> ExtractLocalCtrls(const std::vector<Index> &ctrl) const;
      void StartStage();
      void EndStage();
+     void BeginSwap(const std::vector<Index> &swap_pairs, bool async);
+     void FinishSwap();
+     size_t SwapChunkBit(size_t pos) const;
+     bool OverlapWithSwap(Matrix &m, const std::vector<uint32_t> &ids_pos,
+                          uint64_t ctrl_mask, bool diag);
+     void ApplyToSwappedChunks(const OverlapCluster &c, size_t chunks);
+
+     struct PauliMasks
+     {
+          uint64_t local_x;
+          uint64_t global_x;
+          uint64_t local_z;
+          uint64_t global_z;
+          unsigned num_y;
+     };
+
+     PauliMasks GetPauliMasks(const Term &term,
+                              const std::vector<Index> &ids) const;
+     void PauliPass(const Complex *other, size_t begin, size_t end,
+                    uint64_t local_x, const std::vector<uint64_t> &local_z,
+                    std::vector<Complex> &sums) const;
+     void ApplyPauliSum(const ComplexTermsDict &td,
+                        const std::vector<Index> &ids, const StateVector &in,
+                        StateVector &out);
+     template <class QuReg>
+     void PrepareEmulateMath(const QuReg &quregs, const std::vector<Index> &ctrl,
+                             std::vector<std::vector<size_t>> &bits,
+                             uint64_t &ctrl_mask)
+     {
+          if (fused_gates_.size() > 0 || pending_normalization_) {
+               Run();
+          }
+          WaitSwapQubits();
+
+          // bit of the full (rank and local) index of every qubit
+          auto full_bit = [&](Index id) {
+               auto pos = ArrayFind(locals_, id);
+               if (pos != kNotFound_) {
+                    return pos;
+               }
+               return locals_.size() + ArrayFindSure(globals_, id);
+          };
+
+          bits.clear();
+          for (auto &qureg: quregs) {
+               bits.emplace_back();
+               for (auto id: qureg) {
+                    bits.back().push_back(full_bit(static_cast<Index>(id)));
+               }
+          }
+
+          ctrl_mask = 0;
+          for (auto id: ctrl) {
+               ctrl_mask |= 1ul << full_bit(id);
+          }
+     }
+     void MovePermutedAmplitudes(size_t begin, const std::vector<uint64_t> &dest,
+                                 StateVector &out);
+     template <class F>
+     void ExchangeChunks(const Complex *data, size_t size, int partner, F f);
 
      bc::vector<Float> block_distribution;
-     bc::vector<Float> total_block_distribution;
 
      void calcLocalApproxDistribution(size_t n);
+     uint64_t SampleLocalIndex(Float rnd) const;
+     uint64_t SampleIndex();
 
+     //! Sum of the probabilities of the local indices i with (i & local_msk) == local_val
+     struct MaskedSum
+     {
+          size_t slot;
+          uint64_t local_msk;
+          uint64_t local_val;
+     };
+
+     std::vector<Float> reduce_internal(size_t size,
+                                        const std::vector<MaskedSum> &sums,
+                                        const std::vector<size_t> &entropy);
      Float getProbability_internal(uint64_t local_msk, uint64_t local_val,
                                    uint64_t global_msk, uint64_t global_val);
+     std::vector<Float> getMarginal_internal(const std::vector<Index> &ids);
      void normalize(Float norm, uint64_t local_msk, uint64_t local_val,
                     uint64_t global_msk, uint64_t global_val);
 };
@@ -60,6 +60,35 @@ struct SwapArrays
      }
 };
 
+// Presents the received values of a swap chunk as a vector, so that the gate
+// kernels can be applied to them before they are scattered
+template <class T>
+struct ChunkView
+{
+     typedef T value_type;
+
+     T* data;
+     size_t count;
+
+     ChunkView(T* aData, size_t aCount) : data(aData), count(aCount)
+     {}
+
+     size_t size() const
+     {
+          return count;
+     }
+
+     T& operator[](size_t i)
+     {
+          return data[i];
+     }
+
+     const T& operator[](size_t i) const
+     {
+          return data[i];
+     }
+};
+
 template <class T>
 struct SwapBuffers
 {
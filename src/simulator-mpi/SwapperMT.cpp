@@ -57,6 +57,14 @@ void f_consumer2(SwapperMT& s, const mpi::communicator& comm)
           size_t n = s.n;
 
           uint64_t comm_rank = comm.rank();
+
+          std::lock_guard<std::mutex> lock(s.chunk_mutex);
+          // the handler works on the received chunk while it is in cache,
+          // which may also modify the block of my rank
+          if (s.chunk_handler && s.chunk_handler(*arrs, n * comm_size)) {
+               comm_rank = comm_size;
+          }
+
           size_t c = 0;
           while (c < comm_rank) {
                for (size_t i = 0; i < n; ++i) {
@@ -77,6 +85,7 @@ void f_consumer2(SwapperMT& s, const mpi::communicator& comm)
                }
                ++c;
           }
+          ++s.chunks_done;
 
           s.buffs.old_arrays.push_back(arrs);
 
@@ -85,6 +94,13 @@ void f_consumer2(SwapperMT& s, const mpi::communicator& comm)
      DLOG(INFO) << "f_consumer2(): exit";
 }
 
+void SwapperMT::gatherChunk(size_t k, value_type* values, uint64_t* indices,
+                            const std::vector<uint64_t>& aSwap_bits) const
+{
+     swapping::Swapping<SwapperMT::MaxGlobal>::calcSwap(
+         n_bits, state_vector.data(), n, k * n, values, indices, aSwap_bits);
+}
+
 void SwapperMT::runProducer(const std::vector<uint64_t>& aSwap_bits)
 {
      this->producer
@@ -21,7 +21,9 @@
 #include <boost/format.hpp>
 #include <boost/mpi.hpp>
 #include <complex>
+#include <functional>
 #include <list>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -33,6 +35,8 @@ class EXPORT_API SwapperMT
 public:
      typedef std::complex<double> value_type;
      typedef SwapBuffers<value_type> swap_buffers_type;
+     typedef std::function<bool(swap_buffers_type::swap_arrays_type&, size_t)>
+         chunk_handler_type;
 
      static const uint64_t MaxGlobal;
 
@@ -49,6 +53,17 @@ public:
 
      uint64_t n_bits;
 
+     //! Called by the consumer thread on the received values of a chunk
+     //! (arrays and number of used entries) before they are scattered back
+     //! into the state vector, returns whether it modified them
+     chunk_handler_type chunk_handler;
+
+     //! Held by the consumer thread while it handles and scatters a chunk
+     std::mutex chunk_mutex;
+     //! Number of chunks scattered into the state vector (under chunk_mutex),
+     //! the swap doesn't touch their entries any more
+     size_t chunks_done = 0;
+
      SwapperMT(mpi::communicator& aWorld,
                SimulatorMPI::StateVector& aStateVector, size_t aRank,
                uint64_t aM, size_t aComm_size, swap_buffers_type& aBuffs,
@@ -83,6 +98,17 @@ public:
           return n;
      }
 
+     //! Number of chunks exchanged by doSwap()
+     size_t chunkCount() const
+     {
+          return (1ul << (M - n_bits)) / n;
+     }
+
+     //! Copy the entries of chunk k of the state vector (in the order in
+     //! which they are sent) and their indices
+     void gatherChunk(size_t k, value_type* values, uint64_t* indices,
+                      const std::vector<uint64_t>& aSwap_bits) const;
+
      void runProducer(const std::vector<uint64_t>& aSwap_bits);
      void runConsumer2(const mpi::communicator& comm);
 
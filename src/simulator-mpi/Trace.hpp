@@ -0,0 +1,255 @@
+//   Copyright 2019 <Huawei Technologies Co., Ltd>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Binary traces of the calls received by SimulatorMPI, replayed by hiq-replay.
+// A trace is a TraceHeader, the state of the random engine as text, then one
+// record per call: the TraceOp as a byte followed by its arguments. Integers
+// are written as uint64_t/int64_t, arrays as their size followed by their
+// elements, matrices as their dimension followed by their rows.
+enum class TraceOp : uint8_t
+{
+     kAllocateQubit,         // id
+     kAllocateQureg,         // ids, init
+     kDeallocateQubit,       // id
+     kApplyGate,             // matrix, ids, ctrl
+     kRun,                   //
+     kSwapQubits,            // swap pairs
+     kStartSwapQubits,       // swap pairs
+     kWaitSwapQubits,        //
+     kMeasureQubits,         // ids, outcome
+     kMeasureAndDeallocate,  // ids, outcome
+     kCollapseWavefunction,  // ids, values
+     kSetQubitsPermutation,  // ids
+     kUnsupported,           // name of a call that is not replayed
+     kEnd
+};
+
+struct TraceHeader
+{
+     char magic[8];
+     uint64_t version;
+     uint64_t world_size;
+     uint64_t max_local;
+     uint64_t max_cluster_size;
+     uint64_t max_memory;
+     uint64_t rng_size;
+};
+
+static const char kTraceMagic[8] = {'H', 'i', 'Q', 'T', 'R', 'C', 'E', 0};
+static const uint64_t kTraceVersion = 1;
+
+class TraceWriter
+{
+public:
+     TraceWriter(const std::string& path, TraceHeader header,
+                 const std::string& rng_state)
+         : buffer_(1ul << 20)
+     {
+          out_.rdbuf()->pubsetbuf(buffer_.data(), buffer_.size());
+          out_.open(path, std::ios::binary | std::ios::trunc);
+          if (!out_) {
+               throw std::runtime_error("can't open trace file " + path);
+          }
+          std::copy(kTraceMagic, kTraceMagic + 8, header.magic);
+          header.version = kTraceVersion;
+          header.rng_size = rng_state.size();
+          out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+          out_ << rng_state;
+     }
+
+     ~TraceWriter()
+     {
+          Put(TraceOp::kEnd);
+     }
+
+     //! Marks a call: only the outermost of nested calls is recorded, e.g.
+     //! Run() called by GetProbability() is, DeallocateQubit() called by
+     //! MeasureAndDeallocate() is not
+     class Scope
+     {
+     public:
+          explicit Scope(TraceWriter* w) : w_(w), record_(w && w->depth_++ == 0)
+          {}
+          ~Scope()
+          {
+               if (w_) {
+                    --w_->depth_;
+               }
+          }
+          explicit operator bool() const
+          {
+               return record_;
+          }
+
+     private:
+          TraceWriter* w_;
+          bool record_;
+     };
+
+     void Put(TraceOp op)
+     {
+          out_.put(static_cast<char>(op));
+     }
+
+     template <class T>
+     void Put(const T& v)
+     {
+          Raw(&v, 1);
+     }
+
+     void Put(const std::string& s)
+     {
+          Put(static_cast<uint64_t>(s.size()));
+          out_.write(s.data(), s.size());
+     }
+
+     void Put(const std::vector<bool>& v)
+     {
+          Put(static_cast<uint64_t>(v.size()));
+          for (bool b: v) {
+               out_.put(static_cast<char>(b));
+          }
+     }
+
+     template <class T, class A>
+     void Put(const std::vector<T, A>& v)
+     {
+          Put(static_cast<uint64_t>(v.size()));
+          Raw(v.data(), v.size());
+     }
+
+     template <class T, class A, class B>
+     void Put(const std::vector<std::vector<T, A>, B>& m)
+     {
+          Put(static_cast<uint64_t>(m.size()));
+          for (auto& row: m) {
+               Raw(row.data(), row.size());
+          }
+     }
+
+private:
+     template <class T>
+     void Raw(const T* data, size_t n)
+     {
+          out_.write(reinterpret_cast<const char*>(data), n * sizeof(T));
+     }
+
+     std::vector<char> buffer_;
+     std::ofstream out_;
+     int depth_ = 0;
+};
+
+class TraceReader
+{
+public:
+     explicit TraceReader(const std::string& path)
+         : in_(path, std::ios::binary)
+     {
+          in_.read(reinterpret_cast<char*>(&header_), sizeof(header_));
+          if (!in_ || !std::equal(kTraceMagic, kTraceMagic + 8, header_.magic)
+              || header_.version != kTraceVersion) {
+               throw std::runtime_error(path + " is not a trace");
+          }
+          rng_state_.resize(header_.rng_size);
+          in_.read(&rng_state_[0], rng_state_.size());
+     }
+
+     const TraceHeader& header() const
+     {
+          return header_;
+     }
+
+     const std::string& rng_state() const
+     {
+          return rng_state_;
+     }
+
+     TraceOp NextOp()
+     {
+          int c = in_.get();
+          if (c == std::char_traits<char>::eof()) {
+               return TraceOp::kEnd;
+          }
+          return static_cast<TraceOp>(c);
+     }
+
+     template <class T>
+     T Get()
+     {
+          T v;
+          Raw(&v, 1);
+          return v;
+     }
+
+     std::string GetString()
+     {
+          std::string s(Get<uint64_t>(), ' ');
+          in_.read(&s[0], s.size());
+          return s;
+     }
+
+     std::vector<bool> GetBools()
+     {
+          std::vector<bool> v(Get<uint64_t>());
+          for (size_t i = 0; i < v.size(); ++i) {
+               v[i] = in_.get() != 0;
+          }
+          return v;
+     }
+
+     template <class V>
+     V GetVector()
+     {
+          V v(Get<uint64_t>());
+          Raw(v.data(), v.size());
+          return v;
+     }
+
+     template <class M>
+     M GetMatrix()
+     {
+          M m(Get<uint64_t>());
+          for (auto& row: m) {
+               row.resize(m.size());
+               Raw(row.data(), row.size());
+          }
+          return m;
+     }
+
+private:
+     template <class T>
+     void Raw(T* data, size_t n)
+     {
+          in_.read(reinterpret_cast<char*>(data), n * sizeof(T));
+          if (!in_) {
+               throw std::runtime_error("truncated trace");
+          }
+     }
+
+     std::ifstream in_;
+     TraceHeader header_;
+     std::string rng_state_;
+};
+
+#endif
@@ -0,0 +1,64 @@
+//   Copyright 2019 <Huawei Technologies Co., Ltd>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef ARITHMETIC_HPP
+#define ARITHMETIC_HPP
+
+#include <cstdint>
+#include <vector>
+
+// Basis state permutations for SimulatorMPI::emulate_math(), matching the
+// math functions of the ProjectQ gates of the same name. Only the bits that
+// fit into the quantum register are kept and, as in Python, the result of a
+// modulo is never negative.
+namespace arithmetic
+{
+//! x -> x + a
+struct AddConstant
+{
+     int a;
+
+     void operator()(std::vector<int>& x) const
+     {
+          x[0] += a;
+     }
+};
+
+//! x -> (x + a) mod N
+struct AddConstantModN
+{
+     int a;
+     int N;
+
+     void operator()(std::vector<int>& x) const
+     {
+          x[0] = ((x[0] + a) % N + N) % N;
+     }
+};
+
+//! x -> (a * x) mod N
+struct MultiplyByConstantModN
+{
+     int a;
+     int N;
+
+     void operator()(std::vector<int>& x) const
+     {
+          auto y = (static_cast<int64_t>(a) * x[0]) % N;
+          x[0] = static_cast<int>(y < 0 ? y + N : y);
+     }
+};
+}  // namespace arithmetic
+
+#endif  // ARITHMETIC_HPP
@@ -47,32 +47,21 @@ namespace hiq
 std::ostream& operator<<(std::ostream& out, const std::vector<bool>& v);
 
 template <class Simulator>
-void printAmplitude(const Simulator& sim, std::vector<bool>&& bits_string,
-                    size_t bit)
+void printAmplitudes(const Simulator& sim)
 {
-     if (bit != 0) {
-          bits_string[bit] = 0;
-          printAmplitude(sim, std::move(bits_string), bit - 1);
-
-          bits_string[bit] = 1;
-          printAmplitude(sim, std::move(bits_string), bit - 1);
-     }
-     else {
-          bits_string[bit] = 0;
-          auto a = sim.GetAmplitude(bits_string, sim.GetQubitsPermutation());
-          std::cerr << bits_string << ": " << a << std::endl;
-
-          bits_string[bit] = 1;
-          a = sim.GetAmplitude(bits_string, sim.GetQubitsPermutation());
-          std::cerr << bits_string << ": " << a << std::endl;
+     auto n = sim.TotalQubitsCount();
+     std::vector<std::vector<bool>> bit_strings(1ul << n,
+                                                std::vector<bool>(n));
+     for (size_t i = 0; i < bit_strings.size(); ++i) {
+          for (size_t bit = 0; bit < n; ++bit) {
+               bit_strings[i][bit] = i >> bit & 1;
+          }
      }
-}
 
-template <class Simulator>
-void printAmplitudes(const Simulator& sim)
-{
-     printAmplitude(sim, std::vector<bool>(sim.TotalQubitsCount()),
-                    sim.TotalQubitsCount() - 1);
+     auto a = sim.GetAmplitudes(bit_strings, sim.GetQubitsPermutation());
+     for (size_t i = 0; i < bit_strings.size(); ++i) {
+          std::cerr << bit_strings[i] << ": " << a[i] << std::endl;
+     }
 }
 }  // namespace hiq
 
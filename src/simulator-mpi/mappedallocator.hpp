@@ -0,0 +1,190 @@
+//   Copyright 2019 <Huawei Technologies Co., Ltd>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#ifndef MAPPEDALLOCATOR_HPP
+#define MAPPEDALLOCATOR_HPP
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifndef _WIN32
+#     include <fcntl.h>
+#     include <stdlib.h>
+#     include <sys/mman.h>
+#     include <unistd.h>
+#endif
+
+#include "simulator-mpi/alignedallocator.hpp"
+
+// Allocator of the state vectors: blocks of at least kMinMappedBytes are
+// anonymous mappings whose pages are only backed by memory once touched.
+//
+// The default allocator (temporary vectors) puts a block on explicit huge
+// pages if the pool can hold the whole block, on transparent huge pages
+// otherwise. The allocator of a state vector (see state_vector()) serves the
+// reservation of room for kMaxLocal_ qubits, which costs nothing but address
+// space: its blocks are left to transparent huge pages, as explicit ones
+// would be taken from the pool for the whole reservation. The vectors swapped
+// with a state vector take its allocator along, copies get the default one.
+// Smaller blocks (and all of them on Windows) come from aligned_allocator.
+//
+// If the state vector allocator is given a directory (out-of-core mode), its
+// blocks are shared mappings of unlinked sparse files in that directory
+// instead: the page cache then streams the state vector from and to the disk
+// (read-ahead on the sequential sweeps of the kernels, write-behind of the
+// dirty pages), so that it may be larger than the memory. The directory
+// belongs to the allocator, i.e. to one state vector.
+template <typename T, unsigned int Alignment>
+class mapped_allocator : public aligned_allocator<T, Alignment>
+{
+public:
+     typedef aligned_allocator<T, Alignment> base_type;
+     typedef typename base_type::pointer pointer;
+     typedef typename base_type::size_type size_type;
+     typedef std::true_type propagate_on_container_move_assignment;
+     typedef std::true_type propagate_on_container_swap;
+
+     static constexpr size_type kHugePageBytes = 1ul << 21;
+     static constexpr size_type kMinMappedBytes = kHugePageBytes;
+
+     template <typename U>
+     struct rebind
+     {
+          typedef mapped_allocator<U, Alignment> other;
+     };
+
+     mapped_allocator() noexcept : base_type()
+     {}
+     mapped_allocator(mapped_allocator const& other) noexcept
+         : base_type(), dir_(other.dir_)
+     {}
+     template <typename U>
+     mapped_allocator(mapped_allocator<U, Alignment> const& other) noexcept
+         : base_type(), dir_(other.dir_)
+     {}
+     mapped_allocator& operator=(mapped_allocator const& other) noexcept
+     {
+          dir_ = other.dir_;
+          return *this;
+     }
+
+     static mapped_allocator state_vector(const std::string& dir
+                                          = std::string())
+     {
+          mapped_allocator res;
+          res.dir_ = std::make_shared<const std::string>(dir);
+          return res;
+     }
+
+     mapped_allocator select_on_container_copy_construction() const noexcept
+     {
+          return mapped_allocator();
+     }
+
+     pointer allocate(size_type n)
+     {
+#ifndef _WIN32
+          auto bytes = n * sizeof(T);
+          if (bytes >= kMinMappedBytes && dir_ && !dir_->empty()) {
+               return reinterpret_cast<pointer>(map_file(*dir_, bytes));
+          }
+          if (bytes >= kMinMappedBytes) {
+               void* p = MAP_FAILED;
+#     ifdef MAP_HUGETLB
+               // the huge page pool is reserved at once (no MAP_NORESERVE),
+               // so that a short pool fails here rather than on first touch
+               if (!dir_ && bytes % kHugePageBytes == 0) {
+                    p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+               }
+#     endif  // MAP_HUGETLB
+               if (p == MAP_FAILED) {
+                    p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                             0);
+                    if (p == MAP_FAILED) {
+                         throw std::bad_alloc();
+                    }
+#     ifdef MADV_HUGEPAGE
+                    madvise(p, bytes, MADV_HUGEPAGE);
+#     endif  // MADV_HUGEPAGE
+               }
+               return reinterpret_cast<pointer>(p);
+          }
+#endif  // _WIN32
+          return base_type::allocate(n);
+     }
+
+     void deallocate(pointer p, size_type n) noexcept
+     {
+#ifndef _WIN32
+          if (n * sizeof(T) >= kMinMappedBytes) {
+               munmap(p, n * sizeof(T));
+               return;
+          }
+#endif  // _WIN32
+          base_type::deallocate(p, n);
+     }
+
+     bool operator==(mapped_allocator const& other) const noexcept
+     {
+          return dir_ == other.dir_
+                 || (dir_ && other.dir_ && *dir_ == *other.dir_);
+     }
+     bool operator!=(mapped_allocator const& other) const noexcept
+     {
+          return !(*this == other);
+     }
+
+private:
+     template <typename U, unsigned int UAlignment>
+     friend class mapped_allocator;
+
+     // directory of a state vector allocator (empty: in memory), null for
+     // the default allocator
+     std::shared_ptr<const std::string> dir_;
+
+#ifndef _WIN32
+     static void* map_file(const std::string& dir, size_type bytes)
+     {
+          auto path = dir + "/hiq-state-XXXXXX";
+          std::vector<char> name(path.begin(), path.end());
+          name.push_back(0);
+          int fd = mkstemp(name.data());
+          if (fd == -1) {
+               throw std::bad_alloc();
+          }
+          unlink(name.data());  // the space is freed with the mapping
+          void* p = MAP_FAILED;
+          if (ftruncate(fd, static_cast<off_t>(bytes)) == 0) {
+               p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd, 0);
+          }
+          close(fd);
+          if (p == MAP_FAILED) {
+               throw std::bad_alloc();
+          }
+#     ifdef MADV_SEQUENTIAL
+          madvise(p, bytes, MADV_SEQUENTIAL);
+#     endif  // MADV_SEQUENTIAL
+          return p;
+     }
+#endif  // _WIN32
+};
+
+#endif
@@ -0,0 +1,10 @@
+// 4-qubit GHZ state, used by the hiq-run smoke test
+OPENQASM 2.0;
+include "qelib1.inc";
+qreg q[4];
+creg c[4];
+h q[0];
+cx q[0], q[1];
+cx q[1], q[2];
+cx q[2], q[3];
+measure q -> c;
@@ -0,0 +1,56 @@
+#   Copyright 2019 <Huawei Technologies Co., Ltd>
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+
+# Smoke test of hiq-run and hiq-replay (run with cmake -P): samples the GHZ
+# circuit on two processes, checks that only 0000 and 1111 come out and
+# replays the recorded trace.
+#
+# Variables: HIQ_RUN, HIQ_REPLAY, CIRCUIT, WORK_DIR, MPIEXEC, NUMPROC_FLAG and
+# PREFLAGS (space separated)
+
+separate_arguments(_preflags UNIX_COMMAND "${PREFLAGS}")
+set(_mpirun ${MPIEXEC} ${NUMPROC_FLAG} 2 ${_preflags})
+set(_counts ${WORK_DIR}/ghz.counts)
+set(_trace ${WORK_DIR}/ghz.trace)
+set(_shots 1000)
+
+execute_process(COMMAND ${_mpirun} ${HIQ_RUN} --shots ${_shots}
+                        --output ${_counts} --trace ${_trace} ${CIRCUIT}
+                RESULT_VARIABLE _result)
+if(NOT _result EQUAL 0)
+  message(FATAL_ERROR "hiq-run failed: ${_result}")
+endif()
+
+file(STRINGS ${_counts} _lines)
+set(_total 0)
+set(_outcomes)
+foreach(_line ${_lines})
+  if(NOT _line MATCHES "^(0000|1111) ([0-9]+)$")
+    message(FATAL_ERROR "unexpected outcome: ${_line}")
+  endif()
+  list(APPEND _outcomes ${CMAKE_MATCH_1})
+  math(EXPR _total "${_total} + ${CMAKE_MATCH_2}")
+endforeach()
+list(LENGTH _outcomes _num_outcomes)
+if(NOT _total EQUAL _shots OR NOT _num_outcomes EQUAL 2)
+  message(FATAL_ERROR "expected ${_shots} shots of 0000 and 1111, got "
+                      "${_lines}")
+endif()
+
+execute_process(COMMAND ${_mpirun} ${HIQ_REPLAY} ${_trace}
+                RESULT_VARIABLE _result
+                OUTPUT_VARIABLE _output)
+if(NOT _result EQUAL 0 OR _output MATCHES "differ")
+  message(FATAL_ERROR "hiq-replay failed: ${_result}\n${_output}")
+endif()